@@ -1,12 +1,18 @@
 const fs = require('fs');
 const LIMITS = require('../wasm/settings.json');
 
+// SIMD build is optional, the decoder falls back to the scalar build if missing or unsupported
+const SIMD_BYTES = fs.existsSync('wasm/decoder-simd.wasm')
+  ? fs.readFileSync('wasm/decoder-simd.wasm').toString('base64')
+  : '';
+
 const file = `
 export const LIMITS = {
   CHUNK_SIZE: ${LIMITS.CHUNK_SIZE},
   PALETTE_SIZE: ${LIMITS.PALETTE_SIZE},
   MAX_WIDTH: ${LIMITS.MAX_WIDTH},
-  BYTES: '${fs.readFileSync('wasm/decoder.wasm').toString('base64')}'
+  BYTES: '${fs.readFileSync('wasm/decoder.wasm').toString('base64')}',
+  BYTES_SIMD: '${SIMD_BYTES}'
 };
 `;
 fs.writeFileSync('src/wasm.ts', file);
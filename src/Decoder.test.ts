@@ -6,7 +6,7 @@
 import * as assert from 'assert';
 import { alpha, blue, DEFAULT_BACKGROUND, DEFAULT_FOREGROUND, fromRGBA8888, green, PALETTE_ANSI_256, PALETTE_VT340_COLOR, red, toRGBA8888 } from './Colors';
 import { LIMITS } from './wasm';
-import { Decoder, DecoderAsync } from './Decoder';
+import { decode, Decoder, DecoderAsync } from './Decoder';
 import * as fs from 'fs';
 import { IWasmDecoder, IWasmDecoderExports, ParseMode, RGBA8888 } from './Types';
 
@@ -59,10 +59,6 @@ function getWasmDecoder(mode_parsed: (mode: number) => number, handle_band: (mod
 class TestDecoder {
   public inst: IWasmDecoder;
   public w: IWasmDecoderExports;
-  public chunk: Uint8Array;
-  public palette: Uint32Array;
-  public state: Uint32Array;
-  public pixels: Uint32Array;
   constructor(mode_parsed: (mode: number) => number, handle_band: (mode: number) => number) {
     const module = new WebAssembly.Module(WASM_BYTES);
     this.inst = new WebAssembly.Instance(module, {
@@ -72,26 +68,39 @@ class TestDecoder {
       }
     }) as IWasmDecoder;
     this.w = this.inst.exports;
-    this.chunk = new Uint8Array(this.w.memory.buffer, this.w.get_chunk_address(), LIMITS.CHUNK_SIZE);
-    this.palette = new Uint32Array(this.w.memory.buffer, this.w.get_palette_address(), LIMITS.PALETTE_SIZE);
-    this.state = new Uint32Array(this.w.memory.buffer, this.w.get_state_address(), 30);
-    this.pixels = new Uint32Array(this.w.memory.buffer, this.w.get_p0_address());
+  }
+  // the decoder grows the memory for wider pixel lines (detaches old views), thus create fresh views
+  public get chunk(): Uint8Array {
+    return new Uint8Array(this.w.memory.buffer, this.w.get_chunk_address(), LIMITS.CHUNK_SIZE);
+  }
+  public get palette(): Uint32Array {
+    return new Uint32Array(this.w.memory.buffer, this.w.get_palette_address(), LIMITS.PALETTE_SIZE);
+  }
+  public get state(): Uint32Array {
+    return new Uint32Array(this.w.memory.buffer, this.w.get_state_address(), 30);
+  }
+  public get pixels(): Uint32Array {
+    return new Uint32Array(this.w.memory.buffer, this.w.get_p0_address());
   }
   public loadString(data: string): void {
     if (data.length > LIMITS.CHUNK_SIZE) throw new Error('chunk too big');
-    for (let i = 0; i < data.length; ++i) this.chunk[i] = data.charCodeAt(i);
+    const chunk = this.chunk;
+    for (let i = 0; i < data.length; ++i) chunk[i] = data.charCodeAt(i);
   }
   public decodeString(data: string): void {
     this.loadString(data);
     this.w.decode(0, data.length);
   }
   public getPixels(line?: number): Uint32Array {
+    const pixels = this.pixels;
+    const stride = this.w.line_stride();
+    const width = stride - 4;
     if (line !== undefined) {
-      return this.pixels.subarray(line * (LIMITS.MAX_WIDTH + 4), line * (LIMITS.MAX_WIDTH + 4) + LIMITS.MAX_WIDTH);
+      return pixels.subarray(line * stride, line * stride + width);
     }
-    const result = new Uint32Array(6 * LIMITS.MAX_WIDTH);
+    const result = new Uint32Array(6 * width);
     for (let i = 0; i < 6; ++i) {
-      result.set(this.pixels.subarray(i * (LIMITS.MAX_WIDTH + 4), i * (LIMITS.MAX_WIDTH + 4) + LIMITS.MAX_WIDTH), i * LIMITS.MAX_WIDTH);
+      result.set(pixels.subarray(i * stride, i * stride + width), i * width);
     }
     return result;
   }
@@ -436,13 +445,20 @@ describe('WasmDecoder', () => {
       dec.w.init(sixelColor, fillColor, 256, 0);
       dec.decodeString('!100000@');
       // should have stopped at MAX_WIDTH-4
-      const comp = new Uint32Array(LIMITS.MAX_WIDTH).fill(255).fill(0, LIMITS.MAX_WIDTH - 4);
+      const comp = new Uint32Array(dec.getPixels(0).length).fill(255).fill(0, LIMITS.MAX_WIDTH - 4);
       assert.deepStrictEqual(dec.getPixels(0), comp);
       // should not overflow into other pixel lines
-      assert.deepStrictEqual(dec.getPixels(1), new Uint32Array(LIMITS.MAX_WIDTH));
+      assert.deepStrictEqual(dec.getPixels(1), new Uint32Array(comp.length));
       // reports clamped width
       assert.strictEqual(dec.w.current_width(), LIMITS.MAX_WIDTH - 4);
     });
+    it('put repeated - above set_max_width', () => {
+      dec.w.set_max_width(100);
+      dec.w.init(255, 0, 256, 0);
+      dec.decodeString('!200@');
+      assert.strictEqual(dec.w.current_width(), 100);
+      assert.deepStrictEqual(dec.getPixels(0).subarray(0, 104), new Uint32Array(104).fill(255, 0, 100));
+    });
     it('put single/repeated mixed', () => {
       const sixelColor = 255;
       const fillColor = 0;
@@ -452,9 +468,9 @@ describe('WasmDecoder', () => {
       assert.deepStrictEqual(dec.getPixels(0).subarray(0, 8), new Uint32Array([255, 255, 255,   0, 255, 255, 255,   0]));
       assert.deepStrictEqual(dec.getPixels(1).subarray(0, 8), new Uint32Array([  0,   0,   0, 255, 255, 255, 255,   0]));
       assert.deepStrictEqual(dec.getPixels(2).subarray(0, 8), new Uint32Array([  0,   0,   0,   0,   0,   0,   0, 255]));
-      assert.deepStrictEqual(dec.getPixels(3), new Uint32Array(LIMITS.MAX_WIDTH));
-      assert.deepStrictEqual(dec.getPixels(4), new Uint32Array(LIMITS.MAX_WIDTH));
-      assert.deepStrictEqual(dec.getPixels(5), new Uint32Array(LIMITS.MAX_WIDTH));
+      assert.deepStrictEqual(dec.getPixels(3), new Uint32Array(dec.getPixels(3).length));
+      assert.deepStrictEqual(dec.getPixels(4), new Uint32Array(dec.getPixels(4).length));
+      assert.deepStrictEqual(dec.getPixels(5), new Uint32Array(dec.getPixels(5).length));
     });
     describe('repeat count - edge cases', () => {
       it('!<sixel> counted as 1', () => {
@@ -491,6 +507,30 @@ describe('WasmDecoder', () => {
         dec.decodeString('"1;1;20;10!0@!0A!0?!0g!000~');
         assert.strictEqual(dec.state[18]-4, 5); // [17](cursor) - 4(padding offset)
       });
+      it('huge counts stop at the width limit', () => {
+        const sixelColor = 255;
+        const fillColor = 0;
+        dec.w.init(sixelColor, fillColor, 256, 0);
+        dec.decodeString('!2147483647~!4294967295~@');
+        const width = dec.w.current_width();
+        assert.strictEqual(width > 0 && width <= LIMITS.MAX_WIDTH - 4, true);
+        // M2
+        dec.w.init(sixelColor, fillColor, 256, 0);
+        dec.decodeString('"1;1;20;10!2147483647~!4294967295~');
+        assert.strictEqual(dec.state[18]-4, 20);
+      });
+      it('huge counts after a run beyond the width limit', () => {
+        // the cursor stops at the limit, thus the count cannot wrap it in front of the lines
+        const sixelColor = 255;
+        const fillColor = 0;
+        dec.w.init(sixelColor, fillColor, 256, 0);
+        dec.decodeString('"1;1;10;6' + '?'.repeat(22) + '!4294967265' + '~'.repeat(14) + '-');
+        assert.strictEqual(dec.state[18]-4, 0);
+        dec.w.init(sixelColor, fillColor, 256, 1);
+        dec.decodeString('"1;1;10;6' + '?'.repeat(22) + '!4294967265' + '~'.repeat(14));
+        assert.strictEqual(dec.state[18]-4, 10);
+        assert.deepStrictEqual(dec.getPixels(0).subarray(0, 10), new Uint32Array(10));
+      });
       it('!<non-sixel> ignored', () => {
         // !... default to 1
         const sixelColor = 255;
@@ -674,6 +714,50 @@ describe('Decoder', () => {
     assert.strictEqual(LIMITS.MAX_WIDTH, 16384);
     assert.strictEqual(LIMITS.BYTES.length !== 0, true);
   });
+  it('SIMD build decodes same as scalar build', function() {
+    if (!LIMITS.BYTES_SIMD || !WebAssembly.validate(decodeBase64(LIMITS.BYTES_SIMD))) {
+      this.skip();
+    }
+    // decode with raw wasm instance, collecting all band pixels
+    function decodeRaw(bytes: string, data: Uint8Array, truncate: number): number[] {
+      const result: number[] = [];
+      let w: IWasmDecoderExports;
+      const inst = new WebAssembly.Instance(new WebAssembly.Module(decodeBase64(bytes)), {
+        env: {
+          handle_band: (width: number) => {
+            const pixels = new Uint32Array(w.memory.buffer, w.get_p0_address());
+            const stride = w.line_stride();
+            for (let i = 0; i < 6; ++i) {
+              result.push(...pixels.subarray(i * stride, i * stride + width));
+            }
+            return 0;
+          },
+          mode_parsed: (mode: number) => 0
+        }
+      }) as IWasmDecoder;
+      w = inst.exports;
+      new Uint32Array(w.memory.buffer, w.get_palette_address(), 16).set(PALETTE_VT340_COLOR);
+      w.init(DEFAULT_FOREGROUND, DEFAULT_BACKGROUND, 256, truncate);
+      for (let p = 0; p < data.length; p += LIMITS.CHUNK_SIZE) {
+        const part = data.subarray(p, p + LIMITS.CHUNK_SIZE);
+        new Uint8Array(w.memory.buffer, w.get_chunk_address(), LIMITS.CHUNK_SIZE).set(part);
+        w.decode(0, part.length);
+      }
+      result.push(w.current_width(), w.current_height());
+      return result;
+    }
+    const files = fs.readdirSync('./testfiles').filter(name => name.indexOf('_clean.six') !== -1);
+    for (const name of files) {
+      const data = fs.readFileSync('./testfiles/' + name);
+      for (const truncate of [0, 1]) {
+        assert.deepStrictEqual(
+          decodeRaw(LIMITS.BYTES_SIMD, data, truncate),
+          decodeRaw(LIMITS.BYTES, data, truncate),
+          name
+        );
+      }
+    }
+  });
   it('sync ctor', () => {
     const dec = new Decoder();
     assert.notStrictEqual((dec as any)._instance, undefined);
@@ -699,6 +783,9 @@ describe('Decoder', () => {
     assert.deepStrictEqual((dec as any)._opts.palette, PALETTE_VT340_COLOR);
     assert.strictEqual((dec as any)._opts.paletteLimit, LIMITS.PALETTE_SIZE);
     assert.strictEqual((dec as any)._opts.truncate, true);
+    assert.strictEqual((dec as any)._opts.maxWidth, LIMITS.MAX_WIDTH - 4);
+    assert.strictEqual((dec as any)._opts.directCanvas, false);
+    assert.strictEqual((dec as any)._opts.indexed, 0);
   });
   it('should respect customized options', () => {
     const dec = new Decoder({
@@ -721,6 +808,33 @@ describe('Decoder', () => {
     assert.strictEqual((dec as any)._wasm.get_chunk_address() % 16, 0);
     assert.strictEqual((dec as any)._wasm.get_p0_address() % 16, 0);
   });
+  describe('maxWidth', () => {
+    it('wider than MAX_WIDTH', () => {
+      const dec = new Decoder({ maxWidth: 20000 });
+      dec.init();
+      dec.decodeString('#1!20000~-#2!20000~');
+      assert.strictEqual(dec.width, 20000);
+      assert.strictEqual(dec.height, 12);
+      const data32 = dec.data32;
+      assert.strictEqual(data32[20000 * 6 - 1], PALETTE_VT340_COLOR[1]);
+      assert.strictEqual(data32[20000 * 12 - 1], PALETTE_VT340_COLOR[2]);
+      // direct canvas sits behind the grown pixel lines
+      const direct = new Decoder({ maxWidth: 20000, directCanvas: true });
+      direct.init();
+      direct.decodeString('"1;1;20000;12#1!20000~-#2!20000~');
+      assert.deepStrictEqual(direct.data32, data32);
+    });
+    it('truncates to smaller width', () => {
+      const dec = new Decoder({ maxWidth: 10 });
+      dec.init();
+      dec.decodeString('#1!20~');
+      assert.strictEqual(dec.width, 10);
+      dec.init();
+      dec.decodeString('"1;1;20;6#1!20~');
+      assert.strictEqual(dec.width, 10);
+      assert.strictEqual(dec.data32.length, 60);
+    });
+  });
   describe('init', () => {
     it('fillColor from default', () => {
       let dec = new Decoder(); dec.init();
@@ -1012,6 +1126,529 @@ describe('Decoder', () => {
       }
     });
   });
+  describe('statistics', () => {
+    it('counters in properties.stats (wasm built with STATS=1)', () => {
+      const dec = new Decoder();
+      dec.init(9, null, 4, false);
+      const data = '#1;2;100;0;0#1!5~??$#2~-';
+      dec.decodeString(data);
+      const stats = dec.properties.stats;
+      if (!stats) {
+        // statistics not compiled in
+        return;
+      }
+      assert.strictEqual(stats.bytes, data.length);
+      assert.strictEqual(stats.sixels, 3);
+      assert.strictEqual(stats.repeats, 1);
+      assert.strictEqual(stats.repeatLength, 5);
+      assert.strictEqual(stats.colorSelects, 2);
+      assert.strictEqual(stats.colorHls, 0);
+      assert.strictEqual(stats.colorRgb, 1);
+      assert.strictEqual(stats.carriageReturns, 1);
+      assert.strictEqual(stats.bands, 1);
+      assert.strictEqual(stats.clears > 0, true);
+      // reset by init
+      dec.init();
+      assert.strictEqual(dec.properties.stats!.bytes, 0);
+    });
+  });
+  describe('M1 strided canvas', () => {
+    it('stride grows geometrically, zero-copy data32', () => {
+      const dec = new Decoder();
+      dec.init(0, new Uint32Array([128, 129, 130, 131]), 4, false);
+      dec.decodeString('#1!2~-#2!5~-#3!3~-');
+      // 2 --> max(5, 2 * 2)
+      assert.strictEqual((dec as any)._stride, 5);
+      const data32 = dec.data32;
+      assert.strictEqual(data32.buffer, (dec as any)._canvas.buffer);
+      assert.strictEqual(data32.length, 5 * 18);
+      assert.deepStrictEqual(Array.from(data32.subarray(25, 30)), [129, 129, 0, 0, 0]);
+      assert.deepStrictEqual(Array.from(data32.subarray(55, 60)), [130, 130, 130, 130, 130]);
+      assert.deepStrictEqual(Array.from(data32.subarray(85, 90)), [131, 131, 131, 0, 0]);
+      // 5 --> max(7, 5 * 2) for the pending band, gets compacted to the image width once
+      dec.decodeString('#1!7~');
+      const compacted = dec.data32;
+      assert.strictEqual((dec as any)._stride, 7);
+      assert.strictEqual(compacted.length, 7 * 24);
+      assert.deepStrictEqual(Array.from(compacted.subarray(0, 7)), [129, 129, 0, 0, 0, 0, 0]);
+      assert.deepStrictEqual(Array.from(compacted.subarray(84, 91)), [131, 131, 131, 0, 0, 0, 0]);
+      assert.deepStrictEqual(Array.from(compacted.subarray(161, 168)), Array(7).fill(129));
+    });
+  });
+  describe('directCanvas', () => {
+    it('M2 equals band copy decoding', () => {
+      const files = fs.readdirSync('./testfiles').filter(name => name.indexOf('_clean.six') !== -1);
+      const dec1 = new Decoder();
+      const dec2 = new Decoder({ directCanvas: true });
+      for (const name of files) {
+        const data = fs.readFileSync('./testfiles/' + name);
+        dec1.init();
+        dec1.decode(data);
+        dec2.init();
+        dec2.decode(data);
+        assert.strictEqual(dec2.width, dec1.width, name);
+        assert.strictEqual(dec2.height, dec1.height, name);
+        assert.deepStrictEqual(dec2.data32, dec1.data32, name);
+        assert.strictEqual((dec2 as any)._directCanvas, dec1.properties.mode === ParseMode.M2, name);
+      }
+    });
+    it('partial band and excess data', () => {
+      const dec = new Decoder({ directCanvas: true });
+      dec.init(9, new Uint32Array([128, 129, 130, 131]), 4, true);
+      dec.decodeString('"1;1;5;8#1!5~-#2!2@');
+      assert.strictEqual((dec as any)._directCanvas, true);
+      const pixels = dec.data32;
+      assert.strictEqual(pixels.length, 40);
+      assert.deepStrictEqual(Array.from(pixels.subarray(0, 30)), Array(30).fill(129));
+      assert.deepStrictEqual(Array.from(pixels.subarray(30, 40)), [130, 130, 9, 9, 9, 9, 9, 9, 9, 9]);
+      // data beyond raster height gets discarded
+      dec.decodeString('-#3!5~-!5~');
+      assert.strictEqual(dec.data32.length, 40);
+      assert.deepStrictEqual(Array.from(dec.data32.subarray(30, 40)), [130, 130, 9, 9, 9, 9, 9, 9, 9, 9]);
+    });
+    it('data8 from wasm memory', () => {
+      const dec = new Decoder({ directCanvas: true });
+      dec.init(9, new Uint32Array([128, 129, 130, 131]), 4, true);
+      dec.decodeString('"1;1;5;8#1!5~');
+      assert.deepStrictEqual(new Uint32Array(dec.data8.slice().buffer), dec.data32);
+    });
+    it('color definitions behind a full canvas', () => {
+      // the canvas is full after the first band, later definitions still go into the palette
+      const data = '"1;1;2;6#1~~-#2;2;100;0;0#3;2;0;100;0~~-#4;1;120;50;100$#5;2;0;0;100';
+      const ref = new Decoder();
+      ref.init(0, null, 256, true);
+      ref.decodeString(data);
+      for (const opts of [{ directCanvas: true }, { thumbnail: 2 }, { wasmCanvas: true }]) {
+        const dec = new Decoder(opts);
+        dec.init(0, null, 256, true);
+        dec.decodeString(data);
+        assert.strictEqual(dec.properties.directCanvas || dec.properties.thumbnail > 1 || dec.properties.wasmCanvas, true);
+        assert.deepStrictEqual(dec.palette, ref.palette, JSON.stringify(opts));
+      }
+      assert.strictEqual(ref.palette[5], toRGBA8888(0, 0, 255));
+    });
+    it('M1 does not use direct canvas', () => {
+      const dec = new Decoder({ directCanvas: true });
+      dec.init(9, null, 4, false);
+      dec.decodeString('"1;1;5;8!5~');
+      assert.strictEqual((dec as any)._directCanvas, false);
+      assert.strictEqual(dec.data32.length, 30);
+    });
+  });
+  describe('wasmCanvas', () => {
+    it('equals JS canvas decoding (M1 and M2)', () => {
+      const files = fs.readdirSync('./testfiles').filter(name => name.indexOf('_clean.six') !== -1);
+      for (const truncate of [true, false]) {
+        const dec1 = new Decoder({ truncate });
+        const dec2 = new Decoder({ truncate, wasmCanvas: true });
+        for (const name of files) {
+          const data = fs.readFileSync('./testfiles/' + name);
+          dec1.init();
+          dec1.decode(data);
+          dec2.init();
+          for (let p = 0; p < data.length; p += 4999) {
+            dec2.decode(data, p, Math.min(p + 4999, data.length));
+          }
+          assert.strictEqual(dec2.properties.wasmCanvas, true, name);
+          assert.strictEqual(dec2.width, dec1.width, name);
+          assert.strictEqual(dec2.height, dec1.height, name);
+          assert.deepStrictEqual(dec2.data32, dec1.data32, name);
+        }
+      }
+    });
+    it('M1 peek and growing width', () => {
+      const dec = new Decoder({ wasmCanvas: true });
+      dec.init(0, new Uint32Array([128, 129, 130, 131]), 4, false);
+      dec.decodeString('#1!2~-#2!3@');
+      assert.strictEqual(dec.height, 7);
+      const expected = ([] as number[]).concat(...Array(6).fill([129, 129, 0]), [130, 130, 130]);
+      assert.deepStrictEqual(Array.from(dec.data32), expected);
+      dec.decodeString('!2@$#3!5@');
+      assert.strictEqual(dec.width, 5);
+      assert.deepStrictEqual(Array.from(dec.data32.subarray(5, 10)), [129, 129, 0, 0, 0]);
+      assert.deepStrictEqual(Array.from(dec.data32.subarray(30, 35)), [131, 131, 131, 131, 131]);
+    });
+    it('memory limit', () => {
+      const dec = new Decoder({ wasmCanvas: true, memoryLimit: 65536 });
+      dec.init();
+      assert.throws(() => dec.decodeString('"1;1;2000;2000#1~'), /image exceeds memory limit/);
+      dec.init(0, null, 256, false);
+      assert.throws(() => dec.decodeString('!1000~-'.repeat(20)), /image exceeds memory limit/);
+      dec.init();
+      dec.decodeString('"1;1;10;10#1~');
+      assert.strictEqual(dec.data32.length, 100);
+    });
+    it('needs a 4 byte format', () => {
+      const dec = new Decoder({ wasmCanvas: true, format: 'rgb565' });
+      dec.init();
+      dec.decodeString('"1;1;2;2#1~~');
+      assert.strictEqual(dec.properties.wasmCanvas, false);
+      assert.strictEqual(dec.pixels.length, 4);
+    });
+  });
+  describe('thumbnail', () => {
+    const RED = toRGBA8888(255, 0, 0);
+    const BLUE = toRGBA8888(0, 0, 255);
+    it('nearest equals subsampled image', () => {
+      const files = fs.readdirSync('./testfiles').filter(name => name.indexOf('_clean.six') !== -1);
+      const dec1 = new Decoder();
+      const dec2 = new Decoder({ thumbnail: 3, thumbnailFilter: 'nearest' });
+      for (const name of files) {
+        const data = fs.readFileSync('./testfiles/' + name);
+        dec1.init();
+        dec1.decode(data);
+        dec2.init();
+        dec2.decode(data);
+        if (dec1.properties.mode !== ParseMode.M2) {
+          assert.strictEqual(dec2.properties.thumbnail, 1, name);
+          continue;
+        }
+        assert.strictEqual(dec2.properties.thumbnail, 3, name);
+        assert.strictEqual(dec2.width, Math.ceil(dec1.width / 3), name);
+        assert.strictEqual(dec2.height, Math.ceil(dec1.height / 3), name);
+        const full = dec1.data32;
+        const expected = new Uint32Array(dec2.width * dec2.height);
+        for (let y = 0; y < dec2.height; ++y) {
+          for (let x = 0; x < dec2.width; ++x) {
+            expected[y * dec2.width + x] = full[y * 3 * dec1.width + x * 3];
+          }
+        }
+        assert.deepStrictEqual(dec2.data32, expected, name);
+      }
+    });
+    it('box average', () => {
+      const dec = new Decoder({ thumbnail: 4 });
+      dec.init(0, new Uint32Array([0, RED, BLUE]), 4, true);
+      dec.decodeString('"1;1;4;6#1!2~#2!2~-');
+      assert.strictEqual(dec.width, 1);
+      assert.strictEqual(dec.height, 2);
+      // 2 rows left in the last box
+      assert.deepStrictEqual(Array.from(dec.data32), [toRGBA8888(128, 0, 128), toRGBA8888(128, 0, 128)]);
+      const half = new Decoder({ thumbnail: 2 });
+      half.init(0, new Uint32Array([0, RED, BLUE]), 4, true);
+      half.decodeString('"1;1;4;6#1!2~#2!2~');
+      assert.deepStrictEqual(Array.from(half.data32), [RED, BLUE, RED, BLUE, RED, BLUE]);
+    });
+    it('transparent pixels do not darken colors', () => {
+      const dec = new Decoder({ thumbnail: 2 });
+      dec.init(0, new Uint32Array([0, RED]), 4, true);
+      dec.decodeString('"1;1;2;2#1!1@');
+      assert.deepStrictEqual(Array.from(dec.data32), [toRGBA8888(255, 0, 0, 64)]);
+    });
+    it('band in progress and final rows', () => {
+      const dec = new Decoder({ thumbnail: 2, thumbnailFilter: 'nearest' });
+      dec.init(0, new Uint32Array([0, RED, BLUE]), 4, true);
+      dec.decodeString('"1;1;4;12#1!4~-#2!4~');
+      assert.deepStrictEqual(dec.takeFinalRows(), { start: 0, end: 3 });
+      assert.deepStrictEqual(Array.from(dec.getRow(2)), [RED, RED]);
+      assert.deepStrictEqual(dec.pendingRows, { start: 3, end: 6 });
+      assert.deepStrictEqual(Array.from(dec.getPendingRow(0)), [BLUE, BLUE]);
+      assert.deepStrictEqual(Array.from(dec.data32.subarray(6, 12)), Array(6).fill(BLUE));
+      dec.decodeString('-');
+      assert.deepStrictEqual(dec.takeFinalRows(), { start: 3, end: 6 });
+    });
+    it('M1 and indexed decode in full size', () => {
+      const dec = new Decoder({ thumbnail: 2 });
+      dec.init(0, null, 4, false);
+      dec.decodeString('"1;1;4;6!4~');
+      assert.strictEqual(dec.properties.thumbnail, 1);
+      assert.strictEqual(dec.data32.length, 24);
+      const indexed = new Decoder({ thumbnail: 2, indexed: 8 });
+      indexed.init();
+      indexed.decodeString('"1;1;4;6!4~');
+      assert.strictEqual(indexed.properties.thumbnail, 1);
+      assert.strictEqual(indexed.indices.length, 24);
+    });
+    it('options', () => {
+      assert.throws(() => new Decoder({ thumbnail: 0 }), /must be an integer/);
+      assert.throws(() => new Decoder({ thumbnail: 1.5 }), /must be an integer/);
+      assert.throws(() => new Decoder({ thumbnail: 257 }), /must be an integer/);
+    });
+  });
+  describe('aspectRatio', () => {
+    const PALETTE = new Uint32Array([0, 128, 129, 130]);
+    it('replicates rows by the pixel aspect ratio', () => {
+      const dec = new Decoder({ aspectRatio: true });
+      dec.init(9, PALETTE, 4, true);
+      dec.decodeString('"2;1;1;3#1@$#2A$#3C');
+      assert.strictEqual(dec.width, 1);
+      assert.strictEqual(dec.height, 6);
+      assert.deepStrictEqual(Array.from(dec.data32), [128, 128, 129, 129, 130, 130]);
+      dec.init(9, PALETTE, 4, true);
+      dec.decodeString('"3;2;1;3#1@$#2A$#3C-');
+      assert.strictEqual(dec.height, 4);
+      assert.deepStrictEqual(Array.from(dec.data32), [128, 129, 129, 130]);
+    });
+    it('unscaled without option or for wide pixels', () => {
+      const dec = new Decoder();
+      dec.init(9, PALETTE, 4, true);
+      dec.decodeString('"2;1;1;3#1@$#2A$#3C');
+      assert.strictEqual(dec.height, 3);
+      const wide = new Decoder({ aspectRatio: true });
+      wide.init(9, PALETTE, 4, true);
+      wide.decodeString('"1;2;1;3#1@$#2A$#3C');
+      assert.strictEqual(wide.height, 3);
+      assert.deepStrictEqual(Array.from(wide.data32), [128, 129, 130]);
+    });
+    it('progressive rendering', () => {
+      const dec = new Decoder({ aspectRatio: true });
+      dec.init(9, PALETTE, 4, true);
+      dec.decodeString('"2;1;1;12#1~-#2~');
+      assert.deepStrictEqual(dec.takeFinalRows(), { start: 0, end: 12 });
+      assert.deepStrictEqual(Array.from(dec.getRow(11)), [128]);
+      assert.deepStrictEqual(dec.pendingRows, { start: 12, end: 24 });
+      assert.deepStrictEqual(Array.from(dec.getPendingRow(0)), [129]);
+      assert.deepStrictEqual(Array.from(dec.getPendingRow(11)), [129]);
+      dec.decodeString('-');
+      assert.deepStrictEqual(dec.takeFinalRows(), { start: 12, end: 24 });
+    });
+    it('no direct canvas for scaled images', () => {
+      const dec = new Decoder({ aspectRatio: true, directCanvas: true });
+      dec.init(9, PALETTE, 4, true);
+      dec.decodeString('"2;1;1;3#1~');
+      assert.strictEqual((dec as any)._directCanvas, false);
+      assert.deepStrictEqual(Array.from(dec.data32), Array(6).fill(128));
+      dec.init(9, PALETTE, 4, true);
+      dec.decodeString('"1;1;1;3#1~');
+      assert.strictEqual((dec as any)._directCanvas, true);
+    });
+  });
+  describe('format', () => {
+    // reference conversion of RGBA8888 pixels into the output formats
+    function convert(format: string, colors: Uint32Array): number[] {
+      const result: number[] = [];
+      for (const c of colors) {
+        const [r, g, b, a] = [red(c), green(c), blue(c), alpha(c)];
+        if (format === 'bgra8888') {
+          result.push(((a << 24 | r << 16 | g << 8 | b) >>> 0));
+        } else if (format === 'rgba8888-premultiplied') {
+          const p = (v: number) => Math.floor((v * a + 127) / 255);
+          result.push(toRGBA8888(p(r), p(g), p(b), a));
+        } else if (format === 'rgb24') {
+          result.push(r, g, b);
+        } else if (format === 'rgb565') {
+          result.push((r >> 3) << 11 | (g >> 2) << 5 | b >> 3);
+        } else {
+          result.push(c);
+        }
+      }
+      return result;
+    }
+    const FORMATS = ['bgra8888', 'rgba8888-premultiplied', 'rgb24', 'rgb565'] as const;
+    it('equals converted RGBA8888 (M1 and M2)', () => {
+      const files = fs.readdirSync('./testfiles').filter(name => name.indexOf('_clean.six') !== -1);
+      const ref = new Decoder();
+      for (const format of FORMATS) {
+        const dec = new Decoder({ format });
+        for (const name of files) {
+          const data = fs.readFileSync('./testfiles/' + name);
+          for (const truncate of [true, false]) {
+            ref.init(undefined, undefined, undefined, truncate);
+            ref.decode(data);
+            dec.init(undefined, undefined, undefined, truncate);
+            dec.decode(data);
+            assert.strictEqual(dec.width, ref.width, name);
+            assert.strictEqual(dec.height, ref.height, name);
+            assert.deepStrictEqual(Array.from(dec.pixels), convert(format, ref.data32), `${format} ${name}`);
+          }
+        }
+      }
+    });
+    it('pixel arrays and fill color', () => {
+      const dec = new Decoder({ format: 'rgb24' });
+      dec.init(toRGBA8888(1, 2, 3), null, 4, true);
+      dec.decodeString('"1;1;2;7#1;2;100;0;0~');
+      const pixels = dec.pixels;
+      assert.strictEqual(pixels instanceof Uint8Array, true);
+      const rows = Array(6).fill([255, 0, 0, 1, 2, 3]).concat([[1, 2, 3, 1, 2, 3]]);
+      assert.deepStrictEqual(Array.from(pixels), ([] as number[]).concat(...rows));
+      assert.deepStrictEqual(Array.from(dec.data8), Array.from(pixels));
+      assert.deepStrictEqual(Array.from(dec.getRow(0)), [255, 0, 0, 1, 2, 3]);
+      assert.throws(() => dec.data32, /not available for format rgb24/);
+      const dec16 = new Decoder({ format: 'rgb565' });
+      dec16.init(toRGBA8888(0, 0, 255), null, 4, true);
+      dec16.decodeString('"1;1;2;6#1;2;0;100;0@');
+      assert.strictEqual(dec16.pixels instanceof Uint16Array, true);
+      assert.deepStrictEqual(Array.from(dec16.pixels), [0x07E0, 0x001F].concat(Array(10).fill(0x001F)));
+      assert.strictEqual(dec16.data8.length, 24);
+    });
+    it('premultiplied transparency', () => {
+      const dec = new Decoder({ format: 'rgba8888-premultiplied' });
+      dec.init(0, new Uint32Array([toRGBA8888(255, 128, 0, 128)]), 1, true);
+      dec.decodeString('"1;1;2;1#0@');
+      assert.deepStrictEqual(Array.from(dec.data32), [toRGBA8888(128, 64, 0, 128), 0]);
+    });
+    it('direct canvas and thumbnails', () => {
+      const data = fs.readFileSync('./testfiles/test1_clean.sixel');
+      const ref = new Decoder({ format: 'bgra8888' });
+      ref.init();
+      ref.decode(data);
+      const dec = new Decoder({ format: 'bgra8888', directCanvas: true });
+      dec.init();
+      dec.decode(data);
+      assert.strictEqual((dec as any)._directCanvas, true);
+      assert.deepStrictEqual(dec.data32, ref.data32);
+      // 16/24 bit formats are copied out at band flush
+      const dec16 = new Decoder({ format: 'rgb565', directCanvas: true, thumbnail: 2 });
+      dec16.init();
+      dec16.decode(data);
+      assert.strictEqual((dec16 as any)._directCanvas, false);
+      assert.strictEqual(dec16.properties.thumbnail, 1);
+      // premultiplied box thumbnails are taken as nearest
+      const thumb = new Decoder({ format: 'rgba8888-premultiplied', thumbnail: 2 });
+      thumb.init();
+      thumb.decode(data);
+      const near = new Decoder({ format: 'rgba8888-premultiplied', thumbnail: 2, thumbnailFilter: 'nearest' });
+      near.init();
+      near.decode(data);
+      assert.strictEqual(thumb.properties.thumbnail, 2);
+      assert.deepStrictEqual(thumb.data32, near.data32);
+    });
+    it('options', () => {
+      assert.strictEqual(new Decoder().properties.format, 'rgba8888');
+      assert.strictEqual(new Decoder({ format: 'rgb565' }).properties.format, 'rgb565');
+      assert.throws(() => new Decoder({ format: 'argb' as any }), /format must be one of/);
+      // indexed mode wins
+      const dec = new Decoder({ indexed: 8, format: 'rgb24' });
+      dec.init();
+      dec.decodeString('"1;1;2;1#1@');
+      assert.deepStrictEqual(Array.from(dec.pixels), [1, 0]);
+    });
+    it('decode function', () => {
+      const data = fs.readFileSync('./testfiles/test1_clean.sixel');
+      const ref = decode(data);
+      for (const format of FORMATS) {
+        const result = decode(data, { format });
+        const pixels = result.pixels;
+        assert.strictEqual(result.width, ref.width);
+        assert.strictEqual(result.height, ref.height);
+        assert.deepStrictEqual(Array.from(pixels), convert(format, ref.data32), format);
+        assert.deepStrictEqual(result.data8, new Uint8ClampedArray(pixels.buffer, pixels.byteOffset, pixels.byteLength));
+        assert.strictEqual(result.data32.length, format === 'rgb24' || format === 'rgb565' ? 0 : pixels.length);
+      }
+      // the palette given at init gets converted as well
+      const single = decode('"1;1;1;1#1@', { format: 'rgb565', palette: new Uint32Array([0, toRGBA8888(255, 0, 0)]) });
+      assert.deepStrictEqual(Array.from(single.pixels), [0xF800]);
+    });
+  });
+  describe('indexed', () => {
+    it('M2 indices and palette', () => {
+      const dec = new Decoder({ indexed: 8 });
+      dec.init(3, new Uint32Array([128, 129, 130, 131]), 4, true);
+      dec.decodeString('"1;1;5;8#1!5~-#2!2@');
+      const indices = dec.indices;
+      assert.strictEqual(indices instanceof Uint8Array, true);
+      assert.deepStrictEqual(Array.from(indices), Array(30).fill(1).concat([2, 2, 3, 3, 3, 3, 3, 3, 3, 3]));
+      assert.deepStrictEqual(Array.from(dec.data32), Array.from(indices).map(i => dec.palette[i]));
+      // recoloring by palette change
+      dec.palette[1] = 200;
+      assert.strictEqual(dec.data32[0], 200);
+      assert.strictEqual(dec.indices[0], 1);
+    });
+    it('color definitions update the palette', () => {
+      const dec = new Decoder({ indexed: 16 });
+      dec.init(0, null, 1024, false);
+      dec.decodeString('#300;2;100;0;0!3~$#5!2~');
+      const indices = dec.indices;
+      assert.strictEqual(indices instanceof Uint16Array, true);
+      assert.deepStrictEqual(Array.from(indices.subarray(0, 3)), [5, 5, 300]);
+      assert.strictEqual(dec.palette[300], toRGBA8888(255, 0, 0));
+      assert.deepStrictEqual(Array.from(dec.data32.subarray(0, 3)), [dec.palette[5], dec.palette[5], dec.palette[300]]);
+    });
+    it('M1 re-aligned bands', () => {
+      const dec = new Decoder({ indexed: 8 });
+      dec.init(undefined, null, undefined, false);
+      dec.decodeString('#1!4~-#2!2~');
+      const indices = dec.indices;
+      assert.strictEqual(indices instanceof Uint8Array, true);
+      assert.strictEqual(indices.length, 48);
+      assert.deepStrictEqual(Array.from(indices.subarray(0, 4)), [1, 1, 1, 1]);
+      assert.deepStrictEqual(Array.from(indices.subarray(44, 48)), [2, 2, 0, 0]);
+    });
+    it('options', () => {
+      assert.strictEqual((new Decoder({ indexed: 8 }) as any)._opts.paletteLimit, 256);
+      assert.strictEqual((new Decoder({ indexed: 8 }) as any)._opts.fillColor, 0);
+      assert.throws(() => new Decoder({ indexed: 8, paletteLimit: 1024 }), /must not exceed 256/);
+      assert.throws(() => new Decoder({ indexed: 8 }).init(0, null, 1024), /must not exceed 256/);
+      assert.throws(() => new Decoder().indices, /not in indexed mode/);
+      // no direct canvas for indices
+      const dec = new Decoder({ indexed: 16, directCanvas: true });
+      dec.init();
+      dec.decodeString('"1;1;5;8#1!5~');
+      assert.strictEqual((dec as any)._directCanvas, false);
+      assert.strictEqual(dec.indices instanceof Uint16Array, true);
+    });
+  });
+  describe('progressive rendering', () => {
+    // collect final rows with takeFinalRows/getRow, padded to the image width
+    function finalRows(dec: Decoder, rows: number[][]): void {
+      const range = dec.takeFinalRows();
+      assert.strictEqual(range.start, rows.length);
+      for (let y = range.start; y < range.end; ++y) {
+        rows.push(Array.from(dec.getRow(y)));
+      }
+    }
+    function pad(rows: number[][], width: number, fillColor: number): number[] {
+      const result: number[] = [];
+      for (const row of rows) {
+        result.push(...row, ...Array(width - row.length).fill(fillColor));
+      }
+      return result;
+    }
+    it('final rows equal data32 (M1, M2, directCanvas, wasmCanvas)', () => {
+      const data = fs.readFileSync('./testfiles/sem_clean.six');
+      const options = [
+        { truncate: false }, { truncate: true }, { directCanvas: true },
+        { wasmCanvas: true, truncate: false }, { wasmCanvas: true }
+      ];
+      for (const opts of options) {
+        const dec = new Decoder(opts);
+        dec.init();
+        const rows: number[][] = [];
+        for (let p = 0; p < data.length; p += 997) {
+          dec.decode(data, p, Math.min(p + 997, data.length));
+          finalRows(dec, rows);
+        }
+        const pending = dec.pendingRows;
+        assert.strictEqual(pending.start, rows.length);
+        for (let i = 0; i < pending.end - pending.start; ++i) {
+          const row = Array.from(dec.getPendingRow(i));
+          rows.push(row.length > dec.width ? row.slice(0, dec.width) : row);
+        }
+        rows.length = dec.height;
+        assert.deepStrictEqual(pad(rows, dec.width, dec.properties.fillColor), Array.from(dec.data32));
+      }
+    });
+    it('M1 bands with different widths', () => {
+      const dec = new Decoder();
+      dec.init(0, new Uint32Array([128, 129, 130, 131]), 4, false);
+      dec.decodeString('#1!4~-#2!2~');
+      assert.deepStrictEqual(dec.takeFinalRows(), { start: 0, end: 6 });
+      assert.deepStrictEqual(dec.takeFinalRows(), { start: 6, end: 6 });
+      assert.deepStrictEqual(Array.from(dec.getRow(5)), [129, 129, 129, 129]);
+      assert.strictEqual(dec.getRow(6).length, 0);
+      assert.deepStrictEqual(dec.pendingRows, { start: 6, end: 12 });
+      assert.deepStrictEqual(Array.from(dec.getPendingRow(0)), [130, 130]);
+      assert.strictEqual(dec.getPendingRow(6).length, 0);
+      dec.decodeString('$#3!6@-');
+      assert.deepStrictEqual(dec.takeFinalRows(), { start: 6, end: 12 });
+      assert.deepStrictEqual(Array.from(dec.getRow(6)), [131, 131, 131, 131, 131, 131]);
+      assert.deepStrictEqual(Array.from(dec.getRow(7)), [130, 130, 0, 0, 0, 0]);
+      assert.deepStrictEqual(dec.pendingRows, { start: 12, end: 12 });
+      // init resets the reported rows
+      dec.init();
+      assert.deepStrictEqual(dec.takeFinalRows(), { start: 0, end: 0 });
+    });
+    it('M2 pending band within raster height', () => {
+      const dec = new Decoder({ directCanvas: true });
+      dec.init(9, new Uint32Array([128, 129, 130, 131]), 4, true);
+      dec.decodeString('"1;1;5;8#1!5~-#2!2@');
+      assert.deepStrictEqual(dec.takeFinalRows(), { start: 0, end: 6 });
+      assert.deepStrictEqual(dec.pendingRows, { start: 6, end: 8 });
+      assert.deepStrictEqual(Array.from(dec.getPendingRow(0)), [130, 130, 9, 9, 9]);
+      assert.strictEqual(dec.getPendingRow(2).length, 0);
+    });
+  });
   describe('release', () => {
     const data = fs.readFileSync('./testfiles/test1_clean.sixel');
     const dec = new Decoder();
@@ -1040,11 +1677,105 @@ describe('Decoder', () => {
     assert.throws(() => dec.decodeString('"1;1;16;16?'), /image exceeds memory limit/);
     dec.init();
     assert.doesNotThrow(() => dec.decodeString('"1;1;10;10?'), /image exceeds memory limit/);
-    // M1 - allocates 256*256 pixels initially before realloc happens, skip with 5000*6+5000*6+922*6
+    // M1 - allocates 256*256 pixels initially before realloc happens, skip with 10922*6
     dec.init();
-    assert.doesNotThrow(() => dec.decodeString('!5000A$-!5000A$-'), /image exceeds memory limit/);
-    assert.doesNotThrow(() => dec.decodeString('!922A$-'), /image exceeds memory limit/);
-    // next line should throw
+    assert.doesNotThrow(() => dec.decodeString('!10922A$-'), /image exceeds memory limit/);
+    // next line should throw (rows take the stride of the widest band)
     assert.throws(() => dec.decodeString('A$-'), /image exceeds memory limit/);
   });
+  describe('work budget', () => {
+    it('overdraws', () => {
+      const dec = new Decoder({overdrawBudget: 100});
+      const data = '!2147483647~' + '$!2147483647~'.repeat(1000);
+      dec.init();
+      assert.throws(() => dec.decodeString(data), /image exceeds work budget/);
+      // ignores further data until init
+      assert.throws(() => dec.decodeString('-'), /image exceeds work budget/);
+      dec.init();
+      assert.doesNotThrow(() => dec.decodeString('$'.repeat(100)));
+    });
+    it('bands', () => {
+      const dec = new Decoder({bandBudget: 10});
+      dec.init();
+      assert.throws(() => dec.decodeString('~-'.repeat(11)), /image exceeds work budget/);
+      assert.strictEqual(dec.height, 60);
+      dec.init();
+      assert.doesNotThrow(() => dec.decodeString('"1;1;10;60' + '~-'.repeat(10)));
+    });
+    it('pixels', () => {
+      // cursor extent of every band pass times 6
+      const dec = new Decoder({pixelBudget: 6000});
+      dec.init();
+      assert.doesNotThrow(() => dec.decodeString('"1;1;100;6' + '!100~$'.repeat(10)));
+      dec.init();
+      assert.throws(() => dec.decodeString('"1;1;100;6' + '!100~$'.repeat(11)), /image exceeds work budget/);
+    });
+    it('pixels of runs beyond the width limit', () => {
+      // passes account the width only, also after huge repeats behind the limit
+      const m2 = new Decoder({pixelBudget: 1200});
+      m2.init();
+      assert.doesNotThrow(() => m2.decodeString('"1;1;100;6' + ('~'.repeat(150) + '!4294967265~$').repeat(2)));
+      const m1 = new Decoder({pixelBudget: 1200, maxWidth: 100});
+      m1.init();
+      assert.doesNotThrow(() => m1.decodeString(('~'.repeat(150) + '!4294967265~$').repeat(2)));
+      assert.throws(() => m1.decodeString('~$'), /image exceeds work budget/);
+    });
+    it('unlimited by default', () => {
+      const dec = new Decoder();
+      dec.init();
+      assert.doesNotThrow(() => dec.decodeString('~$-'.repeat(10000)));
+    });
+  });
+  describe('decodeBatch', () => {
+    const single = (data: Uint8Array | string, opts: any = {}) => {
+      const dec = new Decoder(opts);
+      dec.init();
+      typeof data === 'string' ? dec.decodeString(data) : dec.decode(data);
+      return { width: dec.width, height: dec.height, data32: dec.data32 };
+    };
+    it('equals single image decoding (M1 and M2)', () => {
+      const files = fs.readdirSync('./testfiles').filter(name => name.indexOf('_clean.six') !== -1);
+      const payloads = files.map(name => fs.readFileSync('./testfiles/' + name));
+      const dec = new Decoder();
+      const { pixels, images } = dec.decodeBatch(
+        payloads.concat(payloads), payloads.map(() => ({})).concat(payloads.map(() => ({ truncate: false }))));
+      for (let i = 0; i < images.length; ++i) {
+        const expected = single(payloads[i % payloads.length], { truncate: i < payloads.length });
+        const image = images[i];
+        assert.strictEqual(image.error, '');
+        assert.strictEqual(image.width, expected.width);
+        assert.strictEqual(image.height, expected.height);
+        assert.deepStrictEqual(pixels.subarray(image.offset, image.offset + image.width * image.height), expected.data32);
+      }
+    });
+    it('per image options and palette', () => {
+      const dec = new Decoder({ fillColor: 0 });
+      const { pixels, images } = dec.decodeBatch(
+        ['"1;1;2;2#1;2;100;0;0#1~', '"1;1;2;2#1~', '"1;1;2;2#1~'],
+        [{}, { keepPalette: true, fillColor: 0xFF00FF00 }, {}]
+      );
+      const red = toRGBA8888(255, 0, 0);
+      assert.deepStrictEqual(pixels.subarray(images[0].offset, images[0].offset + 4), new Uint32Array([red, 0, red, 0]));
+      assert.deepStrictEqual(
+        pixels.subarray(images[1].offset, images[1].offset + 4), new Uint32Array([red, 0xFF00FF00, red, 0xFF00FF00]));
+      assert.strictEqual(pixels[images[2].offset], PALETTE_VT340_COLOR[1]);
+    });
+    it('memory limit and work budget per image', () => {
+      const dec = new Decoder({ memoryLimit: 524288, pixelBudget: 60000 });
+      const { images } = dec.decodeBatch(['"1;1;2000;2000#1~', '#1!10000~$!10000~$!10000~', '"1;1;2;2#1~~']);
+      assert.strictEqual(images[0].error, 'image exceeds memory limit');
+      assert.strictEqual(images[0].width, 0);
+      assert.strictEqual(images[1].error, 'image exceeds work budget');
+      assert.strictEqual(images[2].error, '');
+      assert.strictEqual(images[2].width, 2);
+      // decoder usable afterwards
+      dec.init();
+      dec.decodeString('"1;1;2;2#1~~');
+      assert.strictEqual(dec.width, 2);
+    });
+    it('needs a 4 byte format', () => {
+      assert.throws(() => new Decoder({ indexed: 8 }).decodeBatch(['~']), /4 byte output format/);
+      assert.throws(() => new Decoder({ format: 'rgb565' }).decodeBatch(['~']), /4 byte output format/);
+    });
+  });
 });
@@ -3,7 +3,7 @@
  * @license MIT
  */
 
-import { IDecodeResult, InstanceLike, IDecoderOptions, IDecoderOptionsInternal, IWasmDecoderExports, RGBA8888, UintTypedArray, ParseMode, IDecoderProperties, IWasmDecoder } from './Types';
+import { IDecodeResult, InstanceLike, IDecoderOptions, IDecoderOptionsInternal, IWasmDecoderExports, RGBA8888, UintTypedArray, ParseMode, IDecoderProperties, IWasmDecoder, IRowRange, DecoderFormat, PixelFormat, IDecoderStats, DecoderAbort, IBatchImageOptions, IBatchResult, IBatchImage } from './Types';
 import { DEFAULT_BACKGROUND, DEFAULT_FOREGROUND, PALETTE_VT340_COLOR } from './Colors';
 import { LIMITS } from './wasm';
 
@@ -21,12 +21,56 @@ function decodeBase64(s: string): Uint8Array<ArrayBuffer> {
   return result;
 }
 
-const WASM_BYTES = decodeBase64(LIMITS.BYTES);
+// prefer the SIMD build, if the wasm engine supports it
+// (decoded lazily, pool workers get the compiled module instead)
+function wasmBytes(): Uint8Array<ArrayBuffer> {
+  if (LIMITS.BYTES_SIMD) {
+    const simdBytes = decodeBase64(LIMITS.BYTES_SIMD);
+    if (WebAssembly.validate(simdBytes)) {
+      return simdBytes;
+    }
+  }
+  return decodeBase64(LIMITS.BYTES);
+}
 let WASM_MODULE: WebAssembly.Module | undefined;
 
+/**
+ * Compiled wasm module, shared by all decoder and encoder instances.
+ */
+export function getWasmModule(): WebAssembly.Module {
+  return WASM_MODULE || (WASM_MODULE = new WebAssembly.Module(wasmBytes()));
+}
+
+/**
+ * Use an already compiled wasm module (e.g. posted from another thread to a worker),
+ * which skips the compilation for all instances created afterwards.
+ * The module must stem from `getWasmModule` of the same package version.
+ */
+export function setWasmModule(module: WebAssembly.Module): void {
+  WASM_MODULE = module;
+}
+
+// upper bound of DecoderOptions.maxWidth (hard limit of the wasm module)
+const MAX_WIDTH_LIMIT = 1 << 24;
+
+// upper bound of DecoderOptions.thumbnail (box sums in wasm are 32 bit)
+const MAX_THUMBNAIL = 256;
+
+// upper bound of the applied pixel aspect ratio (DecoderOptions.aspectRatio)
+const MAX_ASPECT = 16;
+
 // empty canvas
 const NULL_CANVAS = new Uint32Array();
 
+// wasm output formats of DecoderOptions.format
+const PIXEL_FORMATS: {[key in PixelFormat]: DecoderFormat} = {
+  'rgba8888': DecoderFormat.RGBA8888,
+  'bgra8888': DecoderFormat.BGRA8888,
+  'rgba8888-premultiplied': DecoderFormat.RGBA8888_PREMUL,
+  'rgb24': DecoderFormat.RGB24,
+  'rgb565': DecoderFormat.RGB565
+};
+
 
 // proxy for lazy binding of decoder methods to wasm env callbacks
 class CallbackProxy {
@@ -48,7 +92,24 @@ const DEFAULT_OPTIONS: IDecoderOptionsInternal = {
   fillColor: DEFAULT_BACKGROUND,
   palette: PALETTE_VT340_COLOR,
   paletteLimit: LIMITS.PALETTE_SIZE,
-  truncate: true
+  truncate: true,
+  maxWidth: LIMITS.MAX_WIDTH - 4,
+  directCanvas: false,
+  wasmCanvas: false,
+  aspectRatio: false,
+  indexed: 0,
+  format: 'rgba8888',
+  thumbnail: 1,
+  thumbnailFilter: 'box',
+  pixelBudget: 0,
+  bandBudget: 0,
+  overdrawBudget: 0
+};
+
+// indexed mode defaults, sixel and fill color are slots (VT340 grey and black)
+const DEFAULT_INDEXED_OPTIONS: IDecoderOptions = {
+  sixelColor: 7,
+  fillColor: 0
 };
 
 
@@ -64,7 +125,7 @@ export function DecoderAsync(opts?: IDecoderOptions): Promise<Decoder> {
       mode_parsed: cbProxy.mode_parsed.bind(cbProxy)
     }
   };
-  return WebAssembly.instantiate(WASM_MODULE || WASM_BYTES, importObj)
+  return WebAssembly.instantiate(WASM_MODULE || wasmBytes(), importObj)
     .then((inst: InstanceLike) => {
       WASM_MODULE = WASM_MODULE || inst.module;
       return new Decoder(opts, inst.instance || inst, cbProxy);
@@ -83,7 +144,7 @@ export function DecoderAsync(opts?: IDecoderOptions): Promise<Decoder> {
  *  - start over with next image by calling `init`
  *
  * Properties:
- *  - max width of 2^14 - 4 pixels (compile time setting in wasm)
+ *  - max width of 2^14 - 4 pixels by default (compile time setting in wasm, see `maxWidth`)
  *  - no explicit height limit (only limited by memory)
  *  - max 4096 colors palette (compile time setting in wasm)
  *
@@ -108,17 +169,25 @@ export class Decoder {
   private _opts: IDecoderOptionsInternal;
   private _instance: IWasmDecoder;
   private _wasm: IWasmDecoderExports;
-  private _states: Uint32Array;
-  private _chunk: Uint8Array;
-  private _palette: Uint32Array;
-  private _PIXEL_OFFSET = LIMITS.MAX_WIDTH + 4;
-  private _pSrc: Uint32Array;
-  private _canvas: Uint32Array = NULL_CANVAS;
+  private _states!: Uint32Array;
+  private _stats: Uint32Array | null = null;
+  private _chunk!: Uint8Array;
+  private _palette!: Uint32Array;
+  private _pSrc!: Uint32Array;
+  private _canvas: UintTypedArray = NULL_CANVAS;
   private _bandWidths: number[] = [];
+  private _reportedRows = 0;
   private _maxWidth = 0;
-  private _minWidth = LIMITS.MAX_WIDTH;
-  private _lastOffset = 0;
+  private _stride = 0;
+  private _widthLimit: number;
   private _currentHeight = 0;
+  private _aspectNum = 1;
+  private _aspectDen = 1;
+  private _canvasAddress = 0;
+  private _directCanvas = false;
+  private _arena = false;
+  private _thumbnail = 0;
+  private _budget = false;
 
   // some readonly parser states for internal usage
   private get _fillColor(): RGBA8888 { return this._states[0]; }
@@ -131,74 +200,304 @@ export class Decoder {
   private get _mode(): ParseMode { return this._states[10]; }
   private get _paletteLimit(): number { return this._states[11]; }
 
+  private get _bytesPerPixel(): number {
+    return this._opts.indexed
+      ? this._opts.indexed >> 3
+      : this._opts.format === 'rgb24' ? 3 : this._opts.format === 'rgb565' ? 2 : 4;
+  }
+
+  // wasm output format (DecoderFormat)
+  private get _format(): number {
+    return this._opts.indexed ? DecoderFormat.INDEXED : PIXEL_FORMATS[this._opts.format];
+  }
+
+  // canvas elements per pixel (rgb24 is stored as bytes)
+  private get _channels(): number {
+    return !this._opts.indexed && this._opts.format === 'rgb24' ? 3 : 1;
+  }
+
+  private get _canvasPixels(): number {
+    return this._canvas.length / this._channels;
+  }
+
+  // capacity of wasm arenas in 32 bit (memory limit, otherwise bound by the wasm memory)
+  private get _arenaCapacity(): number {
+    return this._opts.memoryLimit ? Math.min(this._opts.memoryLimit >> 2, 0x7FFFFFFF) : 0x7FFFFFFF;
+  }
+
+  private _createCanvas(pixels: number): UintTypedArray {
+    const bytes = this._bytesPerPixel;
+    return bytes === 4
+      ? new Uint32Array(pixels)
+      : bytes === 2
+        ? new Uint16Array(pixels)
+        : new Uint8Array(pixels * bytes);
+  }
+
+  /**
+   * Canvas pixel access in the output format.
+   *
+   * The wasm pixel lines hold one 32 bit value per pixel in the output format (the palette got
+   * converted when the mode settled), thus the band flush is a plain copy, narrowing to 16 bit
+   * for indices. rgb24 and rgb565 rows get packed to 3 and 2 bytes by the wasm module
+   * (`pack_rows`) into the memory behind the pixel lines first.
+   */
+
+  // Copy `width` pixels of pixel line `row` (0 .. 5) to canvas pixel `offset`.
+  private _copyPixels(row: number, width: number, offset: number): void {
+    const line = this._wasm.line_stride() * row;
+    if (this._opts.indexed || this._bytesPerPixel === 4) {
+      this._canvas.set(this._pSrc.subarray(line, line + width), offset);
+      return;
+    }
+    const address = this._wasm.get_free_address();
+    this._growMemory(address + width * 4);
+    this._wasm.pack_rows(address, row, 1, width);
+    const buffer = this._wasm.memory.buffer;
+    this._canvas.set(
+      this._channels === 3 ? new Uint8Array(buffer, address, width * 3) : new Uint16Array(buffer, address, width),
+      offset * this._channels
+    );
+  }
+
+  // Fill canvas pixels from start to end (exclusive) with fillColor.
+  private _fillPixels(start: number, end: number): void {
+    if (this._channels === 1) {
+      this._canvas.fill(this._fillColor, start, end);
+      return;
+    }
+    const canvas = this._canvas;
+    const color = this._fillColor;
+    for (let p = start * 3; p < end * 3; p += 3) {
+      canvas[p] = color & 0xFF;
+      canvas[p + 1] = (color >> 8) & 0xFF;
+      canvas[p + 2] = (color >> 16) & 0xFF;
+    }
+  }
+
+  // Copy canvas pixels from start to end (exclusive) to target (like copyWithin).
+  private _movePixels(target: number, start: number, end: number): void {
+    const c = this._channels;
+    this._canvas.copyWithin(target * c, start * c, end * c);
+  }
+
+  // View of canvas pixels from start to end (exclusive).
+  private _viewPixels(start: number, end: number): UintTypedArray {
+    const c = this._channels;
+    return this._canvas.subarray(start * c, end * c);
+  }
+
   private _initCanvas(mode: ParseMode): number {
+    this._updateViews();
+    this._aspectNum = 1;
+    this._aspectDen = 1;
+    if (mode === ParseMode.M2 && this._opts.thumbnail > 1 && this._bytesPerPixel === 4) {
+      // thumbnail in wasm memory behind the pixel lines, bands get reduced when finished
+      const factor = this._opts.thumbnail;
+      const pixels = Math.ceil(this._width / factor) * Math.ceil(this._height / factor);
+      if (this._opts.memoryLimit && pixels * 4 > this._opts.memoryLimit) {
+        this.release();
+        throw new Error('image exceeds memory limit');
+      }
+      this._canvasAddress = this._wasm.get_free_address();
+      this._growMemory(this._canvasAddress + this._wasm.thumbnail_length(factor) * 4);
+      // box sums need straight alpha, premultiplied colors get the nearest filter
+      const box = this._opts.thumbnailFilter === 'box' && this._opts.format !== 'rgba8888-premultiplied';
+      if (!this._wasm.set_thumbnail(this._canvasAddress, factor, box ? 1 : 0)) {
+        this._thumbnail = factor;
+        return 0;
+      }
+    }
+    if (mode === ParseMode.M2 && this._opts.aspectRatio) {
+      this._setAspect(this._states[4], this._states[5]);
+    }
+    if (mode === ParseMode.M2 && this._opts.directCanvas && this._bytesPerPixel === 4 && this._aspectNum === 1) {
+      // direct canvas in wasm memory behind the pixel lines, sized for full bands
+      const pixels = this.width * Math.ceil(this.height / 6) * 6;
+      if (this._opts.memoryLimit && pixels * 4 > this._opts.memoryLimit) {
+        this.release();
+        throw new Error('image exceeds memory limit');
+      }
+      this._canvasAddress = this._wasm.get_free_address();
+      this._growMemory(this._canvasAddress + pixels * 4);
+      this._directCanvas = !this._wasm.set_canvas(this._canvasAddress);
+      if (this._directCanvas) {
+        this._maxWidth = this._width;
+        return 0;
+      }
+    }
     if (mode === ParseMode.M2) {
       const pixels = this.width * this.height;
-      if (pixels > this._canvas.length) {
-        if (this._opts.memoryLimit && pixels * 4 > this._opts.memoryLimit) {
+      if (pixels > this._canvasPixels) {
+        if (this._opts.memoryLimit && pixels * this._bytesPerPixel > this._opts.memoryLimit) {
           this.release();
           throw new Error('image exceeds memory limit');
         }
-        this._canvas = new Uint32Array(pixels);
+        this._canvas = this._createCanvas(pixels);
       }
       this._maxWidth = this._width;
     } else if (mode === ParseMode.M1) {
       if (this._level === 2) {
-        // got raster attributes, use them as initial size hint
-        const pixels = Math.min(this._rasterWidth, LIMITS.MAX_WIDTH) * this._rasterHeight;
-        if (pixels > this._canvas.length) {
-          if (this._opts.memoryLimit && pixels * 4 > this._opts.memoryLimit) {
+        // got raster attributes, use them as initial size and stride hint
+        this._stride = Math.min(this._rasterWidth, this._widthLimit);
+        const pixels = this._stride * this._rasterHeight;
+        if (pixels > this._canvasPixels) {
+          if (this._opts.memoryLimit && pixels * this._bytesPerPixel > this._opts.memoryLimit) {
             this.release();
             throw new Error('image exceeds memory limit');
           }
-          this._canvas = new Uint32Array(pixels);
+          this._canvas = this._createCanvas(pixels);
         }
       } else {
         // else fallback to generic resizing, starting with 256*256 pixels
-        if (this._canvas.length < 65536) {
-          this._canvas = new Uint32Array(65536);
+        if (this._canvasPixels < 65536) {
+          this._canvas = this._createCanvas(65536);
         }
       }
     }
     return 0; // 0 - continue, 1 - abort right away
   }
 
+  /**
+   * M2 pixel aspect ratio.
+   *
+   * With `aspectRatio` set, source row y of the image covers the canvas rows
+   * `_scaleRow(y)` .. `_scaleRow(y + 1) - 1`, the band flush replicates the pixel line
+   * into all of them. Ratios are taken as integer terms (exact in double precision).
+   */
+
+  private _setAspect(num: number, denom: number): void {
+    if (num <= denom || !denom) {
+      return;
+    }
+    if (num > denom * MAX_ASPECT) {
+      num = MAX_ASPECT;
+      denom = 1;
+    } else if (denom > 0xFFFF) {
+      num = Math.round(num / denom * 0xFFFF);
+      denom = 0xFFFF;
+    }
+    this._aspectNum = num;
+    this._aspectDen = denom;
+  }
+
+  // first canvas row of source row y
+  private _scaleRow(y: number): number {
+    return Math.floor(y * this._aspectNum / this._aspectDen);
+  }
+
+  // source row of canvas row y
+  private _sourceRow(y: number): number {
+    return Math.ceil((y + 1) * this._aspectDen / this._aspectNum) - 1;
+  }
+
+  // Copy pixel line `row` as source row y into the M2 canvas.
+  private _putLine(y: number, row: number, width: number): void {
+    const start = this._scaleRow(y) * width;
+    const end = this._scaleRow(y + 1) * width;
+    this._copyPixels(row, width, start);
+    for (let p = start + width; p < end; p += width) {
+      this._movePixels(p, start, start + width);
+    }
+  }
+
+  private _growMemory(bytes: number): void {
+    const memory = this._wasm.memory;
+    if (bytes > memory.buffer.byteLength) {
+      memory.grow(Math.ceil((bytes - memory.buffer.byteLength) / 65536));
+      // growing detaches the old buffer
+      this._createViews();
+    }
+  }
+
+  // the wasm module grows the memory for wider pixel lines, thus views may need an update
+  private _updateViews(): void {
+    if (this._states.buffer !== this._wasm.memory.buffer) {
+      this._createViews();
+    }
+  }
+
+  private _createViews(): void {
+    const buffer = this._wasm.memory.buffer;
+    this._chunk = new Uint8Array(buffer, this._wasm.get_chunk_address(), LIMITS.CHUNK_SIZE);
+    this._states = new Uint32Array(buffer, this._wasm.get_state_address(), 12);
+    const stats = this._wasm.get_stats_address();
+    this._stats = stats ? new Uint32Array(buffer, stats, 10) : null;
+    this._palette = new Uint32Array(buffer, this._wasm.get_palette_address(), LIMITS.PALETTE_SIZE);
+    this._pSrc = new Uint32Array(buffer, this._wasm.get_p0_address());
+  }
+
   private _realloc(offset: number, additionalPixels: number): void {
     const pixels = offset + additionalPixels;
-    if (pixels > this._canvas.length) {
-      if (this._opts.memoryLimit && pixels * 4 > this._opts.memoryLimit) {
+    if (pixels > this._canvasPixels) {
+      if (this._opts.memoryLimit && pixels * this._bytesPerPixel > this._opts.memoryLimit) {
         this.release();
         throw new Error('image exceeds memory limit');
       }
-      // extend in 65536 pixel blocks
-      const newCanvas = new Uint32Array(Math.ceil(pixels / 65536) * 65536);
+      // extend in 65536 pixel blocks, at least doubling (up to memoryLimit)
+      const limit = this._opts.memoryLimit ? Math.floor(this._opts.memoryLimit / this._bytesPerPixel) : Infinity;
+      const size = Math.max(Math.ceil(pixels / 65536) * 65536, Math.min(this._canvasPixels * 2, limit));
+      const newCanvas = this._createCanvas(Math.max(size, pixels));
       newCanvas.set(this._canvas);
       this._canvas = newCanvas;
     }
   }
 
+  /**
+   * M1 canvas layout.
+   *
+   * Rows are stored with a row stride of at least the widest band, pixels behind the band width
+   * hold fillColor. The stride grows geometrically, thus the rows get restrided at most
+   * O(log width) times. `data32` compacts the rows to the image width once (if needed),
+   * otherwise returns the canvas as zero-copy view.
+   */
+
+  // Grow the M1 row stride to hold `width` pixels, restrides the rows of finished bands.
+  private _growStride(width: number): void {
+    const old = this._stride;
+    if (width <= old) {
+      return;
+    }
+    const stride = old ? Math.max(width, Math.min(old * 2, this._widthLimit)) : width;
+    const rows = this._bandWidths.length * 6;
+    this._realloc(0, stride * rows);
+    // backwards, the rows move to higher offsets
+    for (let y = rows - 1; y >= 0; --y) {
+      this._movePixels(y * stride, y * old, y * old + old);
+      this._fillPixels(y * stride + old, (y + 1) * stride);
+    }
+    this._stride = stride;
+  }
+
+  // Copy M1 band rows from the pixel lines into the canvas, fills up to the stride.
+  private _putRows(row: number, rows: number, width: number): void {
+    const stride = this._stride;
+    const offset = row * stride;
+    this._realloc(offset, stride * 6);
+    for (let i = 0; i < rows; ++i) {
+      this._copyPixels(i, width, offset + stride * i);
+      if (width < stride) {
+        this._fillPixels(offset + stride * i + width, offset + stride * (i + 1));
+      }
+    }
+  }
+
   private _handle_band(width: number): number {
-    const adv = this._PIXEL_OFFSET;
-    let offset = this._lastOffset;
+    this._updateViews();
     if (this._mode === ParseMode.M2) {
-      let remaining = this.height - this._currentHeight;
+      let remaining = this._height - this._currentHeight;
       let c = 0;
       while (c < 6 && remaining > 0) {
-        this._canvas.set(this._pSrc.subarray(adv * c, adv * c + width), offset + width * c);
+        this._putLine(this._currentHeight + c, c, width);
         c++;
         remaining--;
       }
-      this._lastOffset += width * c;
       this._currentHeight += c;
     } else if (this._mode === ParseMode.M1) {
-      this._realloc(offset, width * 6);
+      this._growStride(width);
+      this._putRows(this._bandWidths.length * 6, 6, width);
       this._maxWidth = Math.max(this._maxWidth, width);
-      this._minWidth = Math.min(this._minWidth, width);
-      for (let i = 0; i < 6; ++i) {
-        this._canvas.set(this._pSrc.subarray(adv * i, adv * i + width), offset + width * i);
-      }
       this._bandWidths.push(width);
-      this._lastOffset += width * 6;
       this._currentHeight += 6;
     }
     return 0; // 0 - continue, 1 - abort right away
@@ -213,13 +512,18 @@ export class Decoder {
     _instance?: WebAssembly.Instance,
     _cbProxy?: CallbackProxy
   ) {
-    this._opts = Object.assign({}, DEFAULT_OPTIONS, opts);
+    const indexedDefaults = opts && opts.indexed
+      ? Object.assign({}, DEFAULT_INDEXED_OPTIONS, opts.indexed === 8 ? { paletteLimit: 256 } : {})
+      : {};
+    this._opts = Object.assign({}, DEFAULT_OPTIONS, indexedDefaults, opts);
     if (this._opts.paletteLimit > LIMITS.PALETTE_SIZE) {
       throw new Error(`DecoderOptions.paletteLimit must not exceed ${LIMITS.PALETTE_SIZE}`);
     }
+    if (this._opts.indexed === 8 && this._opts.paletteLimit > 256) {
+      throw new Error('DecoderOptions.paletteLimit must not exceed 256 for 8 bit indices');
+    }
     if (!_instance) {
-      const module = WASM_MODULE || (WASM_MODULE = new WebAssembly.Module(WASM_BYTES));
-      _instance = new WebAssembly.Instance(module, {
+      _instance = new WebAssembly.Instance(getWasmModule(), {
         env: {
           handle_band: this._handle_band.bind(this),
           mode_parsed: this._initCanvas.bind(this)
@@ -231,40 +535,53 @@ export class Decoder {
     }
     this._instance = _instance as IWasmDecoder;
     this._wasm = this._instance.exports;
-    this._chunk = new Uint8Array(this._wasm.memory.buffer, this._wasm.get_chunk_address(), LIMITS.CHUNK_SIZE);
-    this._states = new Uint32Array(this._wasm.memory.buffer, this._wasm.get_state_address(), 12);
-    this._palette = new Uint32Array(this._wasm.memory.buffer, this._wasm.get_palette_address(), LIMITS.PALETTE_SIZE);
+    if (!PIXEL_FORMATS.hasOwnProperty(this._opts.format)) {
+      throw new Error(`DecoderOptions.format must be one of ${Object.keys(PIXEL_FORMATS).join(', ')}`);
+    }
+    if (!(this._opts.thumbnail >= 1 && this._opts.thumbnail <= MAX_THUMBNAIL) || this._opts.thumbnail % 1) {
+      throw new Error(`DecoderOptions.thumbnail must be an integer in 1 .. ${MAX_THUMBNAIL}`);
+    }
+    this._widthLimit = Math.min(Math.max(this._opts.maxWidth, 1), MAX_WIDTH_LIMIT);
+    this._wasm.set_max_width(this._widthLimit);
+    const budget = (value: number) => Math.min(Math.max(value, 0), 0xFFFFFFFF) >>> 0;
+    this._budget = !!(this._opts.pixelBudget || this._opts.bandBudget || this._opts.overdrawBudget);
+    this._wasm.set_budget(
+      budget(this._opts.pixelBudget), budget(this._opts.bandBudget), budget(this._opts.overdrawBudget));
+    // init allocates the pixel lines (may grow the memory), thus call it before creating the views
+    this._wasm.init(DEFAULT_FOREGROUND, 0, this._opts.paletteLimit, 0, this._format);
+    this._createViews();
     this._palette.set(this._opts.palette);
-    this._pSrc = new Uint32Array(this._wasm.memory.buffer, this._wasm.get_p0_address());
-    this._wasm.init(DEFAULT_FOREGROUND, 0, this._opts.paletteLimit, 0);
   }
 
   /**
    * Width of the image data.
-   * Returns the rasterWidth in level2/truncating mode,
+   * Returns the rasterWidth in level2/truncating mode (reduced for thumbnails),
    * otherwise the max width, that has been seen so far.
    */
   public get width(): number {
     return this._mode !== ParseMode.M1
-      ? this._width
-      : Math.max(this._maxWidth, this._wasm.current_width());
+      ? this._thumbnail ? Math.ceil(this._width / this._thumbnail) : this._width
+      : this._arena ? this._wasm.arena_width() : Math.max(this._maxWidth, this._wasm.current_width());
   }
 
   /**
    * Height of the image data.
-   * Returns the rasterHeight in level2/truncating mode,
-   * otherwise height touched by sixels.
+   * Returns the rasterHeight in level2/truncating mode (reduced for thumbnails,
+   * scaled by the pixel aspect ratio with `aspectRatio`), otherwise height touched by sixels.
    */
   public get height(): number {
     return this._mode !== ParseMode.M1
-      ? this._height
-      : this._wasm.current_width()
-        ? this._bandWidths.length * 6 + this._wasm.current_height()
-        : this._bandWidths.length * 6;
+      ? this._thumbnail ? Math.ceil(this._height / this._thumbnail) : this._scaleRow(this._height)
+      : this._arena
+        ? this._wasm.arena_height()
+        : this._wasm.current_width()
+          ? this._bandWidths.length * 6 + this._wasm.current_height()
+          : this._bandWidths.length * 6;
   }
 
   /**
    * Get active palette colors as RGBA8888[] (borrowed).
+   * In indexed mode this is the palette to resolve `indices` with.
    */
   public get palette(): Uint32Array {
     return this._palette.subarray(0, this._paletteLimit);
@@ -295,7 +612,13 @@ export class Decoder {
       truncate: !!this._truncate,
       paletteLimit: this._paletteLimit,
       fillColor: this._fillColor,
+      indexed: this._opts.indexed,
+      format: this._opts.format,
+      thumbnail: this._thumbnail || 1,
+      directCanvas: this._directCanvas,
+      wasmCanvas: this._arena,
       memUsage: this.memoryUsage,
+      stats: this._getStats(),
       rasterAttributes: {
         numerator: this._states[4],
         denominator: this._states[5],
@@ -305,6 +628,27 @@ export class Decoder {
     };
   }
 
+  // decoder statistics from wasm (null if not compiled in)
+  private _getStats(): IDecoderStats | null {
+    this._updateViews();
+    const s = this._stats;
+    if (!s) {
+      return null;
+    }
+    return {
+      bytes: s[0],
+      sixels: s[1],
+      repeats: s[2],
+      repeatLength: s[3],
+      colorSelects: s[4],
+      colorHls: s[5],
+      colorRgb: s[6],
+      carriageReturns: s[7],
+      bands: s[8],
+      clears: s[9]
+    };
+  }
+
   /**
    * Initialize decoder for next image. Must be called before
    * any calls to `decode` or `decodeString`.
@@ -316,20 +660,34 @@ export class Decoder {
     paletteLimit: number = this._opts.paletteLimit,
     truncate: boolean = this._opts.truncate
   ): void {
-    this._wasm.init(this._opts.sixelColor, fillColor, paletteLimit, truncate ? 1 : 0);
+    if (this._opts.indexed === 8 && paletteLimit > 256) {
+      throw new Error('paletteLimit must not exceed 256 for 8 bit indices');
+    }
+    this._wasm.init(this._opts.sixelColor, fillColor, paletteLimit, truncate ? 1 : 0, this._format);
+    this._updateViews();
     if (palette) {
       this._palette.set(palette.subarray(0, LIMITS.PALETTE_SIZE));
     }
     this._bandWidths.length = 0;
+    this._reportedRows = 0;
     this._maxWidth = 0;
-    this._minWidth = LIMITS.MAX_WIDTH;
-    this._lastOffset = 0;
+    this._stride = 0;
     this._currentHeight = 0;
+    this._aspectNum = 1;
+    this._aspectDen = 1;
+    this._directCanvas = false;
+    this._thumbnail = 0;
+    this._arena = this._opts.wasmCanvas && this._bytesPerPixel === 4;
+    if (this._arena) {
+      // bands get appended in wasm, neither `mode_parsed` nor `handle_band` get called
+      this._canvasAddress = this._wasm.arena_address();
+      this._wasm.set_arena(this._canvasAddress, this._arenaCapacity);
+    }
   }
 
   /**
    * Decode next chunk of data from start to end index (exclusive).
-   * @throws Will throw if the image exceeds the memory limit.
+   * @throws Will throw if the image exceeds the memory limit or the work budget.
    */
   public decode(data: UintTypedArray, start: number = 0, end: number = data.length): void {
     let p = start;
@@ -337,13 +695,15 @@ export class Decoder {
       const length = Math.min(end - p, LIMITS.CHUNK_SIZE);
       this._chunk.set(data.subarray(p, p += length));
       this._wasm.decode(0, length);
+      this._updateViews();
+      this._checkAbort();
     }
   }
 
   /**
    * Decode next chunk of string data from start to end index (exclusive).
    * Note: Decoding from string data is rather slow, use `decode` with byte data instead.
-   * @throws Will throw if the image exceeds the memory limit.
+   * @throws Will throw if the image exceeds the memory limit or the work budget.
    */
   public decodeString(data: string, start: number = 0, end: number = data.length): void {
     let p = start;
@@ -354,82 +714,304 @@ export class Decoder {
       }
       p += length;
       this._wasm.decode(0, length);
+      this._updateViews();
+      this._checkAbort();
+    }
+  }
+
+  // throw if the wasm decoder stopped the image for the work budget or a full wasm canvas
+  private _checkAbort(): void {
+    if (this._budget && this._wasm.abort_reason() === DecoderAbort.BUDGET) {
+      throw new Error('image exceeds work budget');
+    }
+    if (this._arena && this._wasm.abort_reason() === DecoderAbort.MEMORY) {
+      this.release();
+      throw new Error('image exceeds memory limit');
+    }
+  }
+
+  /**
+   * Decode many complete images (e.g. icons) in one wasm call.
+   *
+   * All images get decoded into one arena in wasm memory without any band callbacks,
+   * which saves the per image and per band overhead of `init`/`decode` for small images.
+   * Per image options override `fillColor`, `paletteLimit` and `truncate` of the decoder.
+   * `aspectRatio`, `directCanvas` and `thumbnail` are not applied, the memory limit applies
+   * to the whole arena. Needs a 4 byte output format (no `indexed`).
+   * The decoder gets re-initialized afterwards (`init`).
+   */
+  public decodeBatch(payloads: (UintTypedArray | string)[], opts: IBatchImageOptions[] = []): IBatchResult {
+    if (this._opts.indexed || this._bytesPerPixel !== 4) {
+      throw new Error('decodeBatch needs a 4 byte output format');
+    }
+    const count = payloads.length;
+    let length = 0;
+    for (const data of payloads) {
+      length += data.length;
+    }
+    // table of BatchImage entries (12 ints), payloads and the arena behind the pixel lines
+    const table = this._wasm.arena_address();
+    const data = table + count * 48;
+    const arena = (data + length + 15) & ~15;
+    this._growMemory(arena);
+    const entries = new Int32Array(this._wasm.memory.buffer, table, count * 12);
+    const bytes = new Uint8Array(this._wasm.memory.buffer, data, length);
+    const format = PIXEL_FORMATS[this._opts.format];
+    for (let i = 0, offset = 0; i < count; ++i) {
+      const payload = payloads[i];
+      const o: IBatchImageOptions = opts[i] || {};
+      const paletteLimit = o.paletteLimit === undefined ? this._opts.paletteLimit : o.paletteLimit;
+      if (paletteLimit > LIMITS.PALETTE_SIZE) {
+        throw new Error(`paletteLimit must not exceed ${LIMITS.PALETTE_SIZE}`);
+      }
+      if (typeof payload === 'string') {
+        for (let j = 0; j < payload.length; ++j) {
+          bytes[offset + j] = payload.charCodeAt(j);
+        }
+      } else {
+        bytes.set(payload, offset);
+      }
+      entries.set([
+        offset, payload.length, this._opts.sixelColor,
+        o.fillColor === undefined ? this._opts.fillColor : o.fillColor, paletteLimit,
+        (o.truncate === undefined ? this._opts.truncate : o.truncate) ? 1 : 0, format,
+        o.keepPalette ? 0 : 1
+      ], i * 12);
+      offset += payload.length;
+    }
+    this._palette.set(this._opts.palette);
+    const used = this._wasm.decode_batch(table, count, data, arena, this._arenaCapacity);
+    this._updateViews();
+    const results = new Int32Array(this._wasm.memory.buffer, table, count * 12);
+    const images: IBatchImage[] = [];
+    for (let i = 0; i < count; ++i) {
+      const abort = results[i * 12 + 11];
+      images.push({
+        offset: results[i * 12 + 8],
+        width: results[i * 12 + 9],
+        height: results[i * 12 + 10],
+        error: abort === DecoderAbort.MEMORY
+          ? 'image exceeds memory limit'
+          : abort === DecoderAbort.BUDGET ? 'image exceeds work budget' : ''
+      });
     }
+    const pixels = new Uint32Array(this._wasm.memory.buffer, arena, used);
+    this.init();
+    return { pixels, images };
   }
 
   /**
-   * Get current pixel data as 32-bit typed array (RGBA8888).
+   * Get current pixel data as 32-bit typed array (RGBA8888, or the 4 byte output format).
    * Also peeks into pixel data of the current band, that got not pushed yet.
+   * In indexed mode the indices get resolved with the current palette into a new array.
+   * @throws Will throw for the output formats 'rgb24' and 'rgb565' (use `pixels`).
    */
   public get data32(): Uint32Array {
+    if (!this._opts.indexed && this._bytesPerPixel !== 4) {
+      throw new Error(`data32 not available for format ${this._opts.format}`);
+    }
+    const pixels = this._pixels();
+    if (!this._opts.indexed) {
+      return pixels as Uint32Array;
+    }
+    const palette = this._palette;
+    const result = new Uint32Array(pixels.length);
+    for (let i = 0; i < pixels.length; ++i) {
+      result[i] = palette[pixels[i]];
+    }
+    return result;
+  }
+
+  /**
+   * Get current pixel data as palette indices (indexed mode only).
+   * Same dimension and borrow mechanics as `data32`, resolve colors with `palette`.
+   * @throws Will throw if the decoder is not in indexed mode.
+   */
+  public get indices(): UintTypedArray {
+    if (!this._opts.indexed) {
+      throw new Error('decoder not in indexed mode');
+    }
+    return this._pixels();
+  }
+
+  /**
+   * Get current pixel data in the output format (`format` option), or palette indices in indexed mode.
+   * Same dimension and borrow mechanics as `data32`, 'rgb24' holds 3 bytes per pixel.
+   */
+  public get pixels(): UintTypedArray {
+    return this._pixels();
+  }
+
+  /**
+   * Progressive rendering.
+   *
+   * Rows of finished bands never change anymore, thus a partially transmitted image
+   * can be drawn incrementally with `takeFinalRows` and `getRow` for the finished rows,
+   * and `pendingRows` with `getPendingRow` for the band still in progress.
+   * Other than `data32` none of these copy or re-align image data.
+   */
+
+  // rows of finished bands
+  private get _finalRows(): number {
+    if (this._arena) {
+      return this._wasm.arena_rows();
+    }
+    if (this._directCanvas || this._thumbnail) {
+      return Math.min(this._wasm.canvas_row(), this.height);
+    }
+    if (this._mode === ParseMode.M2) {
+      return this._scaleRow(this._currentHeight);
+    }
+    if (this._mode === ParseMode.M1) {
+      return this._bandWidths.length * 6;
+    }
+    return 0;
+  }
+
+  /**
+   * Rows that became final since the last call (or since `init`).
+   * Final rows can be read with `getRow`.
+   */
+  public takeFinalRows(): IRowRange {
+    const start = this._reportedRows;
+    this._reportedRows = this._finalRows;
+    return { start, end: this._reportedRows };
+  }
+
+  /**
+   * Get pixels of a final row (borrowed view in the output format, or palette indices in indexed mode).
+   * In M1 the row holds the width of its band, which may be less than `width`
+   * (pixels to the right are `fillColor`). Returns an empty array for rows not final yet.
+   */
+  public getRow(y: number): UintTypedArray {
+    if (y < 0 || y >= this._finalRows) {
+      return NULL_CANVAS;
+    }
+    if (this._arena) {
+      return this._arenaRow(y);
+    }
+    if (this._directCanvas || this._thumbnail) {
+      return new Uint32Array(this._wasm.memory.buffer, this._canvasAddress + y * this.width * 4, this.width);
+    }
+    if (this._mode === ParseMode.M2) {
+      return this._viewPixels(y * this.width, (y + 1) * this.width);
+    }
+    const offset = y * this._stride;
+    return this._viewPixels(offset, offset + this._bandWidths[Math.floor(y / 6)]);
+  }
+
+  /**
+   * Rows of the band in progress, which may change with further data.
+   * The range starts at the last final row and is empty if the band has no pixels yet.
+   */
+  public get pendingRows(): IRowRange {
+    const start = this._finalRows;
+    let rows = 0;
+    if (this._thumbnail) {
+      // thumbnail rows touched by the band in progress
+      rows = Math.min(Math.ceil(6 / this._thumbnail) + 1, Math.max(this.height - start, 0));
+    } else if (this._mode === ParseMode.M2 && this._arena) {
+      rows = Math.max(Math.min(start + 6, this._height) - start, 0);
+    } else if (this._mode === ParseMode.M2) {
+      rows = Math.max(this._scaleRow(Math.min(this._currentHeight + 6, this._height)) - start, 0);
+    } else if (this._mode === ParseMode.M1 && this._wasm.current_width()) {
+      rows = this._wasm.current_height();
+    }
+    return { start, end: start + rows };
+  }
+
+  /**
+   * Get pixels of a row of the band in progress, `i` counts from `pendingRows.start` (0 .. 5).
+   * The view points into the wasm pixel lines (or the direct canvas / thumbnail), it always holds 32 bit values
+   * (colors or palette indices) of the current band width and is only valid until the next
+   * `decode` call. Returns an empty array for rows outside of `pendingRows`.
+   */
+  public getPendingRow(i: number): Uint32Array {
+    const range = this.pendingRows;
+    if (i < 0 || range.start + i >= range.end) {
+      return NULL_CANVAS;
+    }
+    if (this._arena) {
+      // band in progress gets copied into the canvas
+      this._wasm.flush_arena();
+      return this._arenaRow(range.start + i);
+    }
+    this._updateViews();
+    if (this._thumbnail) {
+      this._wasm.flush_thumbnail();
+    }
+    if (this._directCanvas || this._thumbnail) {
+      return new Uint32Array(this._wasm.memory.buffer, this._canvasAddress + (range.start + i) * this.width * 4, this.width);
+    }
+    const stride = this._wasm.line_stride();
+    const line = this._mode === ParseMode.M2 ? this._sourceRow(range.start + i) - this._currentHeight : i;
+    return this._pSrc.subarray(stride * line, stride * line + this._wasm.current_width());
+  }
+
+  // row of the wasm canvas (M1 rows hold the stride, pixels right of the band are `fillColor`)
+  private _arenaRow(y: number): Uint32Array {
+    this._updateViews();
+    const stride = this._wasm.arena_stride();
+    return new Uint32Array(this._wasm.memory.buffer, this._canvasAddress + y * stride * 4, Math.min(stride, this.width));
+  }
+
+  private _pixels(): UintTypedArray {
     if (this._mode === ParseMode.M0 || !this.width || !this.height) {
       return NULL_CANVAS;
     }
 
+    if (this._arena) {
+      // adds the band in progress, M1 rows get compacted to the image width
+      this._wasm.flush_arena();
+      this._updateViews();
+      return new Uint32Array(this._wasm.memory.buffer, this._canvasAddress, this.width * this.height);
+    }
+
     // get width of pending band to peek into left-over data
     const currentWidth = this._wasm.current_width();
 
+    this._updateViews();
+    if (this._thumbnail) {
+      // reduce the band in progress (peek, gets reduced again when finished)
+      this._wasm.flush_thumbnail();
+    }
+    if (this._directCanvas || this._thumbnail) {
+      return new Uint32Array(this._wasm.memory.buffer, this._canvasAddress, this.width * this.height);
+    }
+
     if (this._mode === ParseMode.M2) {
-      let remaining = this.height - this._currentHeight;
+      let remaining = this._height - this._currentHeight;
       if (remaining > 0) {
-        const adv = this._PIXEL_OFFSET;
-        let offset = this._lastOffset;
         let c = 0;
         while (c < 6 && remaining > 0) {
-          this._canvas.set(this._pSrc.subarray(adv * c, adv * c + currentWidth), offset + currentWidth * c);
+          this._putLine(this._currentHeight + c, c, currentWidth);
           c++;
           remaining--;
         }
         if (remaining) {
-          this._canvas.fill(this._fillColor, offset + currentWidth * c);
+          this._fillPixels(this._scaleRow(this._currentHeight + c) * currentWidth, this._canvasPixels);
         }
       }
-      return this._canvas.subarray(0, this.width * this.height);
+      return this._viewPixels(0, this.width * this.height);
     }
 
     if (this._mode === ParseMode.M1) {
-      if (this._minWidth === this._maxWidth) {
-        let escape = false;
-        if (currentWidth) {
-          if (currentWidth !== this._minWidth) {
-            escape = true;
-          } else {
-            const adv = this._PIXEL_OFFSET;
-            let offset = this._lastOffset;
-            this._realloc(offset, currentWidth * 6);
-            for (let i = 0; i < 6; ++i) {
-              this._canvas.set(this._pSrc.subarray(adv * i, adv * i + currentWidth), offset + currentWidth * i);
-            }
-          }
-        }
-        if (!escape) {
-          return this._canvas.subarray(0, this.width * this.height);
-        }
-      }
-
-      // worst case: re-align pixels if we have bands with different width
-      // This is somewhat allocation intensive, any way to do that in-place, and just once?
-      const final = new Uint32Array(this.width * this.height);
-      final.fill(this._fillColor);
-      let finalOffset = 0;
-      let start = 0;
-      for (let i = 0; i < this._bandWidths.length; ++i) {
-        const bw = this._bandWidths[i];
-        for (let p = 0; p < 6; ++p) {
-          final.set(this._canvas.subarray(start, start += bw), finalOffset);
-          finalOffset += this.width;
-        }
-      }
-      // also handle left-over pixels of the current band
+      const width = this.width;
+      const height = this.height;
+      // left-over pixels of the current band (only up to currentHeight)
       if (currentWidth) {
-        const adv = this._PIXEL_OFFSET;
-        // other than finished bands, this runs only up to currentHeight
-        const currentHeight = this._wasm.current_height();
-        for (let i = 0; i < currentHeight; ++i) {
-          final.set(this._pSrc.subarray(adv * i, adv * i + currentWidth), finalOffset + this.width * i);
+        this._growStride(currentWidth);
+        this._putRows(this._bandWidths.length * 6, this._wasm.current_height(), currentWidth);
+      }
+      // compact rows to the image width, stays zero-copy until the width grows again
+      const stride = this._stride;
+      if (stride !== width) {
+        for (let y = 1; y < height; ++y) {
+          this._movePixels(y * width, y * stride, y * stride + width);
         }
+        this._stride = width;
       }
-      return final;
+      return this._viewPixels(0, width * height);
     }
 
     // fallthrough for all not handled cases
@@ -438,10 +1020,11 @@ export class Decoder {
 
   /**
    * Same as `data32`, but returning pixel data as Uint8ClampedArray suitable
-   * for direct usage with `ImageData`.
+   * for direct usage with `ImageData`. For other output formats these are the bytes of `pixels`.
    */
   public get data8(): Uint8ClampedArray {
-    return new Uint8ClampedArray(this.data32.buffer, 0, this.width * this.height * 4);
+    const pixels = this._opts.indexed ? this.data32 : this._pixels();
+    return new Uint8ClampedArray(pixels.buffer, pixels.byteOffset, pixels.byteLength);
   }
 
   /**
@@ -459,11 +1042,16 @@ export class Decoder {
   public release(): void {
     this._canvas = NULL_CANVAS;
     this._bandWidths.length = 0;
+    this._reportedRows = 0;
     this._maxWidth = 0;
-    this._minWidth = LIMITS.MAX_WIDTH;
+    this._stride = 0;
+    this._directCanvas = false;
+    this._arena = false;
+    this._thumbnail = 0;
     // also nullify parser states in wasm to avoid
     // width/height reporting potential out-of-bound values
-    this._wasm.init(DEFAULT_FOREGROUND, 0, this._opts.paletteLimit, 0);
+    this._wasm.init(DEFAULT_FOREGROUND, 0, this._opts.paletteLimit, 0, this._format);
+    this._updateViews();
   }
 }
 
@@ -478,10 +1066,22 @@ export class Decoder {
  */
 
 
+// result of the decode functions, data32 only for the 4 byte formats
+function decodeResult(dec: Decoder, opts?: IDecoderOptions): IDecodeResult {
+  const packed = !!opts && !opts.indexed && (opts.format === 'rgb24' || opts.format === 'rgb565');
+  return {
+    width: dec.width,
+    height: dec.height,
+    data32: packed ? new Uint32Array(0) : dec.data32,
+    data8: dec.data8,
+    pixels: dec.pixels
+  };
+}
+
 /**
  * Decode function with synchronous wasm loading.
  * Can be used in a web worker or in nodejs. Does not work reliable in normal browser context.
- * @throws Will throw if the image exceeds the memory limit.
+ * @throws Will throw if the image exceeds the memory limit or the work budget.
  */
  export function decode(
   data: UintTypedArray | string,
@@ -490,18 +1090,13 @@ export class Decoder {
   const dec = new Decoder(opts);
   dec.init();
   typeof data === 'string' ? dec.decodeString(data) : dec.decode(data);
-  return {
-    width: dec.width,
-    height: dec.height,
-    data32: dec.data32,
-    data8: dec.data8
-  };
+  return decodeResult(dec, opts);
 }
 
 /**
  * Decode function with asynchronous wasm loading.
  * Use this version in normal browser context.
- * @throws Will throw if the image exceeds the memory limit.
+ * @throws Will throw if the image exceeds the memory limit or the work budget.
  */
 export async function decodeAsync(
   data: UintTypedArray | string,
@@ -510,10 +1105,5 @@ export async function decodeAsync(
   const dec = await DecoderAsync(opts);
   dec.init();
   typeof data === 'string' ? dec.decodeString(data) : dec.decode(data);
-  return {
-    width: dec.width,
-    height: dec.height,
-    data32: dec.data32,
-    data8: dec.data8
-  };
+  return decodeResult(dec, opts);
 }
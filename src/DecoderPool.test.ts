@@ -0,0 +1,115 @@
+/**
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import { Worker } from 'worker_threads';
+import { decode } from './Decoder';
+import { DecoderPool } from './DecoderPool';
+
+
+const WORKER_SCRIPT = __dirname + '/DecoderWorker.js';
+
+
+describe('DecoderPool', () => {
+  let pool: DecoderPool;
+  beforeEach(() => {
+    pool = new DecoderPool({ size: 2, createWorker: () => new Worker(WORKER_SCRIPT) });
+  });
+  afterEach(() => {
+    pool.terminate();
+  });
+
+  it('decodes like the sync decoder', async () => {
+    const files = fs.readdirSync('./testfiles').filter(name => name.indexOf('_clean.six') !== -1);
+    const results = await Promise.all(files.map(name => pool.decode(fs.readFileSync('./testfiles/' + name))));
+    for (let i = 0; i < files.length; ++i) {
+      const expected = decode(fs.readFileSync('./testfiles/' + files[i]));
+      assert.strictEqual(results[i].width, expected.width);
+      assert.strictEqual(results[i].height, expected.height);
+      assert.deepStrictEqual(results[i].pixels, expected.data32);
+    }
+    assert.strictEqual(pool.pending, 0);
+  });
+  it('chunked images', async () => {
+    const data = fs.readFileSync('./testfiles/test1_clean.sixel');
+    const stream = pool.open();
+    for (let p = 0; p < data.length; p += 1000) {
+      stream.write(data.subarray(p, p + 1000));
+    }
+    const result = await stream.end();
+    const expected = decode(data);
+    assert.strictEqual(result.width, expected.width);
+    assert.strictEqual(result.height, expected.height);
+    assert.deepStrictEqual(result.pixels, expected.data32);
+    assert.throws(() => stream.write(data), /stream already ended/);
+  });
+  it('transferred chunks', async () => {
+    const data = fs.readFileSync('./testfiles/test1_clean.sixel');
+    const stream = pool.open();
+    const chunks: Uint8Array[] = [];
+    for (let p = 0; p < data.length; p += 1000) {
+      chunks.push(new Uint8Array(data.subarray(p, p + 1000)));
+      stream.write(chunks[chunks.length - 1], true);
+    }
+    const result = await stream.end();
+    assert.deepStrictEqual(result.pixels, decode(data).data32);
+    // buffers of transferred chunks got detached
+    assert.strictEqual(chunks[0].length, 0);
+  });
+  it('string data and per job options', async () => {
+    const result = await pool.decode('"1;1;2;2#1~~', { indexed: 8 });
+    assert.deepStrictEqual(result.pixels, new Uint8Array([1, 1, 1, 1]));
+    assert.strictEqual(result.palette.length, 256);
+    // data8 holds the resolved colors like Decoder.data8
+    assert.deepStrictEqual(result.data8, decode('"1;1;2;2#1~~', { indexed: 8 }).data8);
+  });
+  it('images without pixels', async () => {
+    const single = new DecoderPool({ size: 1, createWorker: () => new Worker(WORKER_SCRIPT) });
+    try {
+      // the empty pixels must not detach the empty canvas shared by the decoders of the worker
+      for (const data of ['', '"1;1;0;0', '#1;2;100;0;0']) {
+        const result = await single.decode(data);
+        assert.strictEqual(result.pixels.length, 0);
+        assert.strictEqual(result.data8.length, 0);
+      }
+      const result = await single.decode('"1;1;2;2#1~~');
+      assert.deepStrictEqual(result.pixels, decode('"1;1;2;2#1~~').data32);
+    } finally {
+      single.terminate();
+    }
+  });
+  it('direct canvas gets copied from wasm memory', async () => {
+    const data = fs.readFileSync('./testfiles/test1_clean.sixel');
+    const result = await pool.decode(data, { directCanvas: true });
+    assert.deepStrictEqual(result.pixels, decode(data).data32);
+  });
+  it('errors reject the job', async () => {
+    await assert.rejects(pool.decode('"1;1;2000;2000#1~~', { memoryLimit: 65536 }), /image exceeds memory limit/);
+    await assert.rejects(pool.decode('#1!10000~$!10000~$!10000~', { pixelBudget: 60000 }), /image exceeds work budget/);
+    // workers stay usable
+    const result = await pool.decode('"1;1;2;2#1~~');
+    assert.strictEqual(result.width, 2);
+  });
+  it('reused decoders start like new ones', async () => {
+    const single = new DecoderPool({ size: 1, createWorker: () => new Worker(WORKER_SCRIPT) });
+    try {
+      // register 20 gets defined by the first job only
+      await single.decode('"1;1;1;1#20;2;100;0;0#20~');
+      const results = await Promise.all([single.decode('"1;1;1;1#20~'), single.decode('"1;1;1;1#20~')]);
+      for (const result of results) {
+        assert.deepStrictEqual(result.pixels, decode('"1;1;1;1#20~').data32);
+      }
+    } finally {
+      single.terminate();
+    }
+  });
+  it('terminate rejects pending jobs', async () => {
+    const job = pool.decode(fs.readFileSync('./testfiles/test1_clean.sixel'));
+    pool.terminate();
+    await assert.rejects(job, /pool terminated/);
+    assert.throws(() => pool.open(), /pool already terminated/);
+  });
+});
@@ -0,0 +1,235 @@
+/**
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+import { IDecoderOptions, IDecoderPoolOptions, IPoolDecodeResult, IWorkerLike, PoolRequest, PoolResponse, UintTypedArray } from './Types';
+import { getWasmModule } from './Decoder';
+
+
+interface IPoolWorker {
+  worker: IWorkerLike;
+  jobs: number;
+}
+
+interface IPendingJob {
+  owner: IPoolWorker;
+  indexed: boolean;
+  resolve: (result: IPoolDecodeResult) => void;
+  reject: (error: Error) => void;
+}
+
+function defaultSize(): number {
+  const cores = typeof navigator !== 'undefined' && navigator.hardwareConcurrency;
+  return cores ? Math.min(cores, 4) : 2;
+}
+
+function createPixels(res: Extract<PoolResponse, { type: 'result' }>): UintTypedArray {
+  return res.bytesPerElement === 4
+    ? new Uint32Array(res.buffer, res.byteOffset, res.length)
+    : res.bytesPerElement === 2
+      ? new Uint16Array(res.buffer, res.byteOffset, res.length)
+      : new Uint8Array(res.buffer, res.byteOffset, res.length);
+}
+
+// colors of palette indices (as `Decoder.data32` in indexed mode)
+function resolveIndices(indices: UintTypedArray, palette: Uint32Array): Uint32Array {
+  const result = new Uint32Array(indices.length);
+  for (let i = 0; i < indices.length; ++i) {
+    result[i] = palette[indices[i]];
+  }
+  return result;
+}
+
+// own copy of the view (not `slice`, which returns a view for nodejs buffers)
+function copyChunk(data: UintTypedArray): UintTypedArray {
+  return data.BYTES_PER_ELEMENT === 4
+    ? new Uint32Array(data)
+    : data.BYTES_PER_ELEMENT === 2
+      ? new Uint16Array(data)
+      : new Uint8Array(data);
+}
+
+
+/**
+ * Chunked job of a DecoderPool, see `DecoderPool.open`.
+ */
+export class DecoderPoolStream {
+  private _post: (msg: PoolRequest, transfer?: ArrayBuffer[]) => void;
+  private _id: number;
+  private _result: Promise<IPoolDecodeResult>;
+  private _closed = false;
+
+  constructor(post: (msg: PoolRequest, transfer?: ArrayBuffer[]) => void, id: number, result: Promise<IPoolDecodeResult>) {
+    this._post = post;
+    this._id = id;
+    this._result = result;
+  }
+
+  /**
+   * Send the next chunk of image data to the worker.
+   * By default the chunk gets copied (only the bytes of the view, not its whole buffer).
+   * With `transfer` the underlying buffer of the view gets transferred instead,
+   * it is detached and not usable by the caller afterwards.
+   */
+  public write(data: UintTypedArray | string, transfer: boolean = false): void {
+    if (this._closed) {
+      throw new Error('stream already ended');
+    }
+    if (typeof data === 'string') {
+      this._post({ type: 'chunk', id: this._id, data });
+      return;
+    }
+    // posting a view clones its whole buffer, thus copy the view and transfer the copy
+    const chunk = transfer ? data : copyChunk(data);
+    this._post({ type: 'chunk', id: this._id, data: chunk }, [chunk.buffer as ArrayBuffer]);
+  }
+
+  /**
+   * End the image, resolves with the decoded image.
+   * @throws Rejects if the image exceeds the memory limit or the work budget.
+   */
+  public end(): Promise<IPoolDecodeResult> {
+    if (!this._closed) {
+      this._closed = true;
+      this._post({ type: 'close', id: this._id });
+    }
+    return this._result;
+  }
+}
+
+
+/**
+ * DecoderPool - decodes images in a pool of workers (Web Workers or nodejs `worker_threads`).
+ *
+ * All workers share the wasm module compiled by the pool, every worker instantiates it
+ * with its own memory. Jobs go to the worker with the fewest pending jobs, chunks of a job
+ * stay with its worker. Decoded pixels come back as transferred buffers without copying.
+ *
+ * Usage pattern:
+ *  - create the pool with a worker factory running `DecoderWorker.js`
+ *  - call `decode` with whole images, or `open` for images arriving in chunks
+ *  - call `terminate` when done, pending jobs get rejected
+ */
+export class DecoderPool {
+  private _workers: IPoolWorker[] = [];
+  private _jobs = new Map<number, IPendingJob>();
+  private _nextId = 1;
+  private _decoderOptions: IDecoderOptions;
+
+  constructor(opts: IDecoderPoolOptions) {
+    const size = opts.size || defaultSize();
+    if (!(size >= 1) || size % 1) {
+      throw new Error('DecoderPoolOptions.size must be a positive integer');
+    }
+    this._decoderOptions = opts.decoderOptions || {};
+    const module = getWasmModule();
+    for (let i = 0; i < size; ++i) {
+      const owner: IPoolWorker = { worker: opts.createWorker(), jobs: 0 };
+      const onMessage = (msg: PoolResponse) => this._handleResponse(msg);
+      const onError = (e: any) => this._rejectAll(owner, e instanceof Error ? e : new Error(String(e && e.message)));
+      if (owner.worker.on) {
+        owner.worker.on('message', onMessage);
+        owner.worker.on('error', onError);
+      } else {
+        owner.worker.addEventListener!('message', (ev: any) => onMessage(ev.data));
+        owner.worker.addEventListener!('error', onError);
+      }
+      owner.worker.postMessage({ type: 'module', module } as PoolRequest);
+      this._workers.push(owner);
+    }
+  }
+
+  /**
+   * Number of workers.
+   */
+  public get size(): number {
+    return this._workers.length;
+  }
+
+  /**
+   * Number of jobs not resolved yet.
+   */
+  public get pending(): number {
+    return this._jobs.size;
+  }
+
+  /**
+   * Decode a whole image in a worker.
+   * `opts` override the decoder options of the pool for this image.
+   * @throws Rejects if the image exceeds the memory limit or the work budget.
+   */
+  public decode(data: UintTypedArray | string, opts?: IDecoderOptions): Promise<IPoolDecodeResult> {
+    const stream = this.open(opts);
+    stream.write(data);
+    return stream.end();
+  }
+
+  /**
+   * Start an image arriving in chunks, feed it with `write` and finish it with `end`.
+   * `opts` override the decoder options of the pool for this image.
+   */
+  public open(opts?: IDecoderOptions): DecoderPoolStream {
+    if (!this._workers.length) {
+      throw new Error('pool already terminated');
+    }
+    let owner = this._workers[0];
+    for (const w of this._workers) {
+      if (w.jobs < owner.jobs) {
+        owner = w;
+      }
+    }
+    const id = this._nextId++;
+    const jobOptions: IDecoderOptions = Object.assign({}, this._decoderOptions, opts);
+    const result = new Promise<IPoolDecodeResult>((resolve, reject) => {
+      this._jobs.set(id, { owner, indexed: !!jobOptions.indexed, resolve, reject });
+    });
+    owner.jobs++;
+    const post = (msg: PoolRequest, transfer: ArrayBuffer[] = []): void => owner.worker.postMessage(msg, transfer);
+    post({ type: 'open', id, opts: jobOptions });
+    return new DecoderPoolStream(post, id, result);
+  }
+
+  /**
+   * Terminate all workers, pending jobs get rejected.
+   */
+  public terminate(): void {
+    for (const owner of this._workers) {
+      this._rejectAll(owner, new Error('pool terminated'));
+      owner.worker.terminate();
+    }
+    this._workers.length = 0;
+  }
+
+  private _handleResponse(msg: PoolResponse): void {
+    const job = this._jobs.get(msg.id);
+    if (!job) {
+      return;
+    }
+    this._jobs.delete(msg.id);
+    job.owner.jobs--;
+    if (msg.type === 'error') {
+      job.reject(new Error(msg.message));
+      return;
+    }
+    const pixels = createPixels(msg);
+    const colors = job.indexed ? resolveIndices(pixels, msg.palette) : pixels;
+    job.resolve({
+      width: msg.width,
+      height: msg.height,
+      pixels,
+      data8: new Uint8ClampedArray(colors.buffer, colors.byteOffset, colors.byteLength),
+      palette: msg.palette
+    });
+  }
+
+  private _rejectAll(owner: IPoolWorker, error: Error): void {
+    for (const [id, job] of this._jobs) {
+      if (job.owner === owner) {
+        this._jobs.delete(id);
+        job.reject(error);
+      }
+    }
+    owner.jobs = 0;
+  }
+}
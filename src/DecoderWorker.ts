@@ -0,0 +1,155 @@
+/**
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+import { Decoder, setWasmModule } from './Decoder';
+import { IDecoderOptions, PoolRequest, PoolResponse } from './Types';
+
+
+/**
+ * Worker script of `DecoderPool`, runs as Web Worker or as nodejs `worker_threads` worker.
+ *
+ * The pool sends the compiled wasm module first, thus the worker never compiles it.
+ * Every job gets a decoder of its own, since chunks of several jobs on the worker may interleave.
+ * Finished decoders are kept for later jobs with the same options (re-initialized per job),
+ * thus a worker only creates a new wasm instance for concurrent jobs or changed options.
+ * At the end of a job the pixels are transferred back, pixels of a JS canvas without
+ * copying, pixels in wasm memory (direct canvas, wasm canvas, thumbnail) get copied once,
+ * as well as the (empty) pixels of images without any pixels.
+ */
+
+type Post = (msg: PoolResponse, transfer: ArrayBuffer[]) => void;
+
+interface IJob {
+  decoder: Decoder | null;
+  key: string;
+  error: string;
+}
+
+interface IIdleDecoder {
+  decoder: Decoder;
+  key: string;
+}
+
+const JOBS = new Map<number, IJob>();
+
+// finished decoders for reuse, oldest first
+const IDLE: IIdleDecoder[] = [];
+const MAX_IDLE = 4;
+
+function errorMessage(e: any): string {
+  return e instanceof Error ? e.message : String(e);
+}
+
+// Decoders can only be reused for the same options (typed arrays compared by value).
+function optionsKey(opts: IDecoderOptions): string {
+  return JSON.stringify(opts, (_, value) => ArrayBuffer.isView(value) ? Array.from(value as Uint32Array) : value);
+}
+
+function acquire(opts: IDecoderOptions, key: string): Decoder {
+  for (let i = IDLE.length - 1; i >= 0; --i) {
+    if (IDLE[i].key === key) {
+      const dec = IDLE.splice(i, 1)[0].decoder;
+      // color registers beyond the palette option start empty as in a new instance
+      dec.palette.fill(0);
+      dec.init();
+      return dec;
+    }
+  }
+  const dec = new Decoder(opts);
+  dec.init();
+  return dec;
+}
+
+function recycle(job: IJob): void {
+  if (!job.decoder) {
+    return;
+  }
+  // drops the canvas (transferred with the result) and resets the wasm state
+  job.decoder.release();
+  IDLE.push({ decoder: job.decoder, key: job.key });
+  if (IDLE.length > MAX_IDLE) {
+    IDLE.shift();
+  }
+  job.decoder = null;
+}
+
+function finish(id: number, job: IJob | undefined, post: Post): void {
+  if (!job || !job.decoder || job.error) {
+    post({ type: 'error', id, message: job ? job.error : 'unknown job' }, []);
+    if (job) {
+      recycle(job);
+    }
+    return;
+  }
+  const dec = job.decoder;
+  const props = dec.properties;
+  let pixels = dec.pixels;
+  // images without pixels return the empty canvas shared by all decoders, which must not get detached
+  if (!pixels.length || props.directCanvas || props.wasmCanvas || props.thumbnail > 1) {
+    pixels = pixels.slice();
+  }
+  const palette = dec.palette.slice();
+  const buffer = pixels.buffer as ArrayBuffer;
+  post({
+    type: 'result',
+    id,
+    width: props.width,
+    height: props.height,
+    buffer,
+    byteOffset: pixels.byteOffset,
+    length: pixels.length,
+    bytesPerElement: pixels.BYTES_PER_ELEMENT,
+    palette
+  }, [buffer, palette.buffer]);
+  recycle(job);
+}
+
+function handleRequest(msg: PoolRequest, post: Post): void {
+  switch (msg.type) {
+    case 'module':
+      setWasmModule(msg.module);
+      return;
+    case 'open': {
+      const job: IJob = { decoder: null, key: optionsKey(msg.opts), error: '' };
+      try {
+        job.decoder = acquire(msg.opts, job.key);
+      } catch (e) {
+        job.error = errorMessage(e);
+      }
+      JOBS.set(msg.id, job);
+      return;
+    }
+    case 'chunk': {
+      const job = JOBS.get(msg.id);
+      if (!job || !job.decoder || job.error) {
+        return;
+      }
+      try {
+        typeof msg.data === 'string' ? job.decoder.decodeString(msg.data) : job.decoder.decode(msg.data);
+      } catch (e) {
+        // further chunks get ignored, the error is reported at close
+        job.error = errorMessage(e);
+      }
+      return;
+    }
+    case 'close': {
+      const job = JOBS.get(msg.id);
+      JOBS.delete(msg.id);
+      finish(msg.id, job, post);
+      return;
+    }
+  }
+}
+
+/* istanbul ignore next */
+if (typeof process !== 'undefined' && process.versions && process.versions.node) {
+  // nodejs worker_threads (the port queues messages until the listener is attached)
+  import('worker_threads').then(({ parentPort }) => {
+    parentPort!.on('message', (msg: PoolRequest) => handleRequest(msg, (res, transfer) => parentPort!.postMessage(res, transfer)));
+  });
+} else {
+  const scope = self as any;
+  scope.addEventListener('message', (ev: MessageEvent) => handleRequest(ev.data, (res, transfer) => scope.postMessage(res, transfer)));
+}
@@ -4,10 +4,11 @@
  */
 
 import * as assert from 'assert';
-import { introducer, FINALIZER, sixelEncode } from './SixelEncoder';
+import { introducer, FINALIZER, sixelEncode, sixelEncodeIndexed, image2sixel } from './SixelEncoder';
 import { fromRGBA8888, normalizeRGB, toRGBA8888 } from './Colors';
-import { RGBA8888 } from './Types';
-import { Decoder } from './Decoder';
+import { Dithering, RGBA8888, RGBColor } from './Types';
+import { Decoder, decode } from './Decoder';
+import { reduce } from './Quantizer';
 
 describe('encoding', () => {
   it('DCS introducer supports P2', () => {
@@ -134,5 +135,112 @@ describe('encoding', () => {
       // "#1??@@@$" color[1] skip 2 pixels + color 3 pixels + CR
       assert.strictEqual(sixels.indexOf('#0@$#1??@@@$') !== -1, true);
     });
+    it('unmatched colors get the nearest palette color', () => {
+      const data = new Uint8Array([250, 250, 250, 255, 10, 0, 5, 255]);
+      const sixels = sixelEncode(data, 2, 1, [[0, 0, 0], [255, 255, 255]]);
+      // "#1@$"  color[1] for the light pixel
+      // "#0?@$" color[0] for the dark pixel
+      assert.strictEqual(sixels.indexOf('#1@$#0?@$') !== -1, true);
+    });
+    it('roundtrip with output over several chunks', () => {
+      // colors from % values, that survive the conversion unchanged
+      const palette: RGBA8888[] = [];
+      for (let i = 0; i < 16; ++i) {
+        palette.push(normalizeRGB(3 * i + 2, 98 - 3 * i, 97 - 6 * i));
+      }
+      const width = 317;
+      const height = 201;
+      const data32 = new Uint32Array(width * height);
+      let seed = 1;
+      for (let i = 0; i < data32.length; ++i) {
+        seed = (seed * 1103515245 + 12345) & 0x7FFFFFFF;
+        data32[i] = palette[seed % 16];
+      }
+      const sixels = sixelEncode(new Uint8Array(data32.buffer), width, height, palette);
+      assert.strictEqual(sixels.length > 65536, true);
+      const result = decode(sixels);
+      assert.strictEqual(result.width, width);
+      assert.strictEqual(result.height, height);
+      assert.deepStrictEqual(result.data32, data32);
+    });
+    it('image width limit', () => {
+      assert.throws(() => { sixelEncode(new Uint8Array(16385 * 4), 16385, 1, [[0, 0, 0]]); }, /image width must not exceed/);
+    });
+  });
+  describe('sixelEncodeIndexed', () => {
+    it('8 and 16 bit indices', () => {
+      const indices = [0, 1, 1, 1, 1, 2, 0, 0];
+      const palette: RGBColor[] = [[0, 0, 0], [255, 0, 0], [0, 255, 0]];
+      const sixels = sixelEncodeIndexed(new Uint8Array(indices), 4, 2, palette);
+      assert.strictEqual(sixels, sixelEncodeIndexed(new Uint16Array(indices), 4, 2, palette));
+      // "#0@?AA$" color[0] 1st row at 1st column, 2nd row at 3rd and 4th column
+      // "#1A@@@$" color[1] 2nd row at 1st column, 1st row at 2nd to 4th column
+      // "#2?A$"   color[2] 2nd row at 2nd column
+      assert.strictEqual(sixels.indexOf('#0@?AA$#1A@@@$#2?A$') !== -1, true);
+    });
+    it('indices beyond palette are transparent', () => {
+      const sixels = sixelEncodeIndexed(new Uint8Array([0, 5]), 2, 1, [[0, 0, 0]], false);
+      assert.strictEqual(sixels, '#0;2;0;0;0#0@$');
+    });
+  });
+  describe('image2sixel', () => {
+    it('exact colors and transparent pixels', () => {
+      const width = 101;
+      const height = 37;
+      const data32 = new Uint32Array(width * height);
+      let seed = 1;
+      for (let i = 0; i < data32.length; ++i) {
+        seed = (seed * 1103515245 + 12345) & 0x7FFFFFFF;
+        data32[i] = seed % 17 ? normalizeRGB(seed % 16 * 6, 100 - seed % 16 * 3, 40) : 0;
+      }
+      const sixels = image2sixel(new Uint8Array(data32.buffer), width, height, 16);
+      const result = decode(sixels.slice(introducer().length, -FINALIZER.length), { fillColor: 0 });
+      assert.deepStrictEqual(result.data32, data32);
+    });
+  });
+});
+describe('quantizer', () => {
+  function gradient(width: number, height: number): Uint32Array {
+    const data32 = new Uint32Array(width * height);
+    for (let y = 0; y < height; ++y) {
+      for (let x = 0; x < width; ++x) {
+        data32[y * width + x] = x % 10 === 9 ? 0 : toRGBA8888(x * 255 / width, y * 255 / height, 128);
+      }
+    }
+    return data32;
+  }
+  for (const dithering of ['none', 'floyd-steinberg', 'ordered'] as Dithering[]) {
+    it(`reduce - ${dithering}`, () => {
+      const width = 199;
+      const height = 51;
+      const data32 = gradient(width, height);
+      const { indices, palette } = reduce(new Uint8Array(data32.buffer), width, 8, dithering);
+      assert.strictEqual(palette.length <= 8, true);
+      assert.strictEqual(indices.length, data32.length);
+      // transparent pixels are not mapped, mean color per row stays close for dithering
+      for (let y = 0; y < height; ++y) {
+        let sum = 0;
+        let sumQuantized = 0;
+        for (let x = 0; x < width; ++x) {
+          const i = y * width + x;
+          if (!data32[i]) {
+            assert.strictEqual(indices[i], 0xFFFF);
+            continue;
+          }
+          assert.strictEqual(indices[i] < palette.length, true);
+          sum += fromRGBA8888(data32[i])[0];
+          sumQuantized += fromRGBA8888(palette[indices[i]])[0];
+        }
+        if (dithering === 'floyd-steinberg') {
+          assert.strictEqual(Math.abs(sum - sumQuantized) / width < 4, true);
+        }
+      }
+    });
+  }
+  it('reduce - palette from exact colors', () => {
+    const data32 = new Uint32Array([toRGBA8888(1, 2, 3), 0, toRGBA8888(4, 5, 6), toRGBA8888(1, 2, 3)]);
+    const { indices, palette } = reduce(new Uint8Array(data32.buffer), 2, 256);
+    assert.deepStrictEqual(palette, [toRGBA8888(1, 2, 3), toRGBA8888(4, 5, 6)]);
+    assert.deepStrictEqual(indices, new Uint16Array([0, 0xFFFF, 1, 0]));
   });
 });
@@ -28,11 +28,31 @@ export type UintTypedArray = Uint8Array | Uint16Array | Uint32Array;
  */
 export type RGBColor = [number, number, number];
 
+/**
+ * Dithering of the internal quantizer.
+ */
+export type Dithering = 'none' | 'floyd-steinberg' | 'ordered';
+
+/**
+ * Filter of the thumbnail reduction (decoder option `thumbnail`).
+ */
+export type ThumbnailFilter = 'nearest' | 'box';
+
+/**
+ * Output pixel format of the decoder (decoder option `format`).
+ *  - 'rgba8888'                - RGBA8888 (ABGR32 words), 4 bytes
+ *  - 'bgra8888'                - BGRA byte order (ARGB32 words), 4 bytes
+ *  - 'rgba8888-premultiplied'  - RGBA8888 with color channels premultiplied by alpha, 4 bytes
+ *  - 'rgb24'                   - RGB bytes without alpha, 3 bytes
+ *  - 'rgb565'                  - 16 bit words (5 bit red in the high bits), 2 bytes
+ */
+export type PixelFormat = 'rgba8888' | 'bgra8888' | 'rgba8888-premultiplied' | 'rgb24' | 'rgb565';
+
 /**
  * Return value from internal quantizer.
  */
 export interface IQuantResult {
-  /** image data as palette indices (max. 2^16 colors supported) */
+  /** image data as palette indices (transparent pixels as 0xFFFF) */
   indices: Uint16Array;
   /** array with quantized colors */
   palette: number[];
@@ -81,16 +101,219 @@ export interface IDecoderOptions {
    * Default is true.
    */
   truncate?: boolean;
+  /**
+   * Maximum image width in pixels, wider pixel lines get truncated.
+   * The pixel line memory in wasm grows with the image width up to this limit.
+   * Default is 16380 (wasm compile time setting MAX_WIDTH - 4), maximum is 2^24.
+   */
+  maxWidth?: number;
+  /**
+   * Whether to paint level 2 images with `truncate=true` (M2) directly into a canvas in wasm memory.
+   * This saves the band copying on JS side, which is notable for tall images.
+   * Note that `data32` then returns a view into wasm memory, which gets overwritten
+   * (and may get detached) by the next image. The wasm memory grows to the biggest
+   * image seen and cannot be freed by `release`.
+   * Default is false.
+   */
+  directCanvas?: boolean;
+  /**
+   * Decode into a growable canvas owned by the wasm module, for M1 and M2 images.
+   * Finished bands get appended in wasm without calling into JS (no band copies on JS side),
+   * the decoder only checks the image after every `decode` call. `memoryLimit` caps the canvas,
+   * exceeding it throws like for the JS canvas. Same borrow mechanics as `directCanvas`,
+   * the M1 rows get compacted to the image width when the pixels are read (e.g. `data32`).
+   * Needs a 4 byte output format, `directCanvas`, `aspectRatio` and `thumbnail` are not applied.
+   * Default is false.
+   */
+  wasmCanvas?: boolean;
+  /**
+   * Apply the pixel aspect ratio of the raster attributes (`"Pan;Pad`) to level 2 images
+   * with `truncate=true` (M2). Every pixel line gets replicated to Pan/Pad canvas rows when its band
+   * is finished, thus `height` and `data32` reflect the scaled image without an extra pass.
+   * Only ratios with taller pixels are applied (up to 16:1), the width stays unchanged.
+   * Applied by the JS band flush only: M1 images, thumbnails, `wasmCanvas`, `decodeBatch` and the
+   * P1 ratio of the DCS introducer are not scaled, `directCanvas` is not used for scaled images.
+   * Default is false.
+   */
+  aspectRatio?: boolean;
+  /**
+   * Output palette indices instead of RGBA8888 colors, with 8 or 16 bit per pixel.
+   * This cuts the pixel memory to 1/4 or 1/2, and allows recoloring by changing the palette
+   * without decoding again. Get the indices with `indices` and the colors from `palette`.
+   * In indexed mode `sixelColor` and `fillColor` denote palette slots (default 7 and 0).
+   * With 8 bit indices `paletteLimit` defaults to 256 and must not exceed it.
+   * Indexed mode does not use `directCanvas`.
+   * Default is 0 (RGBA8888 output).
+   */
+  indexed?: 0 | 8 | 16;
+  /**
+   * Output pixel format. The wasm decoder keeps the palette converted to the target format,
+   * the pixels are written in the target format at band flush without a conversion pass. `sixelColor`, `fillColor`
+   * and `palette` stay RGBA8888. Get the pixels with `pixels` (or the bytes with `data8`),
+   * `data32` is only available for the 4 byte formats. 'rgb24' and 'rgb565' do not use
+   * `directCanvas` and `thumbnail`, box filtered thumbnails of 'rgba8888-premultiplied' fall back
+   * to 'nearest'. Ignored in indexed mode.
+   * Default is 'rgba8888'.
+   */
+  format?: PixelFormat;
+  /**
+   * Decode level 2 images with `truncate=true` (M2) as thumbnail, reduced by this integer factor (1 .. 256).
+   * Every band gets reduced in wasm when finished, thus the memory scales with the thumbnail size
+   * instead of the image size. `width`, `height`, `data32` and the progressive rendering methods
+   * refer to the thumbnail then (`ceil(width / thumbnail)` x `ceil(height / thumbnail)` pixels).
+   * Like with `directCanvas` the pixels live in wasm memory behind the pixel lines.
+   * Other images (M1) and indexed mode are decoded in full size, check `properties.thumbnail`.
+   * Default is 1 (no reduction).
+   */
+  thumbnail?: number;
+  /**
+   * Filter of the thumbnail reduction, 'box' averages `thumbnail` x `thumbnail` pixels
+   * (alpha weighted), 'nearest' takes the top left pixel of every box.
+   * Default is 'box'.
+   */
+  thumbnailFilter?: ThumbnailFilter;
+  /**
+   * Work budget per image, limiting the painted pixels, the bands (LF) and the overdraws (CR).
+   * Unlike the data size these grow without bounds for malicious data, e.g. a huge repeat
+   * followed by many CRs, or endless tiny bands in M1. Exceeding a limit stops the image
+   * and throws an exception (also for further data until the next `init`).
+   * Painted pixels are accounted with the cursor extent of every band pass (times 6).
+   * Default is 0 (unlimited) for all limits, the maximum is 2^32 - 1.
+   */
+  pixelBudget?: number;
+  bandBudget?: number;
+  overdrawBudget?: number;
 }
 
 /**
  * Return type of decode and decodeAsync.
+ * `pixels` holds the output format (see `Decoder.pixels`), `data32` is empty
+ * for the formats 'rgb24' and 'rgb565' (use `pixels` or `data8`).
  */
 export interface IDecodeResult {
   width: number;
   height: number;
   data32: Uint32Array;
   data8: Uint8ClampedArray;
+  pixels: UintTypedArray;
+}
+
+/**
+ * Per image options of `Decoder.decodeBatch`, defaults are taken from the decoder options.
+ */
+export interface IBatchImageOptions {
+  fillColor?: RGBA8888;
+  paletteLimit?: number;
+  truncate?: boolean;
+  /**
+   * Keep the color definitions of the previous image in the batch (default false).
+   * Otherwise every image starts with `DecoderOptions.palette`.
+   */
+  keepPalette?: boolean;
+}
+
+/**
+ * Image entry of a batch result, pixels are `pixels.subarray(offset, offset + width * height)`.
+ * `error` is set for images exceeding the memory limit (width and height are 0)
+ * or the work budget (pixels decoded so far), empty otherwise.
+ */
+export interface IBatchImage {
+  offset: number;
+  width: number;
+  height: number;
+  error: string;
+}
+
+/**
+ * Return type of `Decoder.decodeBatch`.
+ */
+export interface IBatchResult {
+  /** arena holding all images (borrowed from wasm memory, valid until the next decoder call) */
+  pixels: Uint32Array;
+  images: IBatchImage[];
+}
+
+/**
+ * Worker used by `DecoderPool`, a Web Worker or a nodejs `worker_threads` Worker,
+ * running the worker script `DecoderWorker.js` of this package.
+ */
+export interface IWorkerLike {
+  postMessage(message: any, transfer?: any[]): void;
+  terminate(): any;
+  // nodejs worker_threads
+  on?(event: 'message' | 'error', listener: (value: any) => void): any;
+  // Web Worker
+  addEventListener?(type: 'message' | 'error', listener: (ev: any) => void): void;
+}
+
+/**
+ * DecoderPool options.
+ */
+export interface IDecoderPoolOptions {
+  /**
+   * Create a worker running `DecoderWorker.js` (`lib/DecoderWorker.js` in nodejs,
+   * `dist/decode.worker.js` in the browser).
+   */
+  createWorker: () => IWorkerLike;
+  /**
+   * Number of workers, started with the pool.
+   * Default is `navigator.hardwareConcurrency` (up to 4), or 2.
+   */
+  size?: number;
+  /**
+   * Decoder options of the jobs, can be overridden for single jobs.
+   */
+  decoderOptions?: IDecoderOptions;
+}
+
+/**
+ * Return type of DecoderPool jobs.
+ * All arrays are owned by the receiver (transferred from the worker).
+ */
+export interface IPoolDecodeResult {
+  width: number;
+  height: number;
+  /** pixels in the output format (palette indices in indexed mode), like `Decoder.pixels` */
+  pixels: UintTypedArray;
+  /** bytes of `pixels` like `Decoder.data8`, e.g. for `ImageData` with RGBA8888 (resolved colors in indexed mode) */
+  data8: Uint8ClampedArray;
+  /** palette of the image (RGBA8888), resolves the indices in indexed mode */
+  palette: Uint32Array;
+}
+
+/**
+ * Range of image rows from start to end (exclusive).
+ */
+export interface IRowRange {
+  start: number;
+  end: number;
+}
+
+/**
+ * Decoder statistics of the current image (wasm built with STATS=1).
+ * The counters are 32 bit and wrap around.
+ */
+export interface IDecoderStats {
+  /** bytes consumed */
+  bytes: number;
+  /** sixels painted singly */
+  sixels: number;
+  /** repeat introducers (`!Pn`) */
+  repeats: number;
+  /** pixels painted by repeats */
+  repeatLength: number;
+  /** color register selects */
+  colorSelects: number;
+  /** color definitions in HLS */
+  colorHls: number;
+  /** color definitions in RGB */
+  colorRgb: number;
+  /** carriage returns (band overdraws) */
+  carriageReturns: number;
+  /** finished bands */
+  bands: number;
+  /** pixel line clears */
+  clears: number;
 }
 
 export interface IDecoderProperties {
@@ -101,7 +324,15 @@ export interface IDecoderProperties {
   truncate: boolean;
   paletteLimit: number;
   fillColor: RGBA8888;
+  indexed: 0 | 8 | 16;
+  format: PixelFormat;
+  thumbnail: number;
+  /** pixels get painted into wasm memory (`directCanvas` in use) */
+  directCanvas: boolean;
+  /** pixels get appended to a canvas in wasm memory (`wasmCanvas` in use) */
+  wasmCanvas: boolean;
   memUsage: number;
+  stats: IDecoderStats | null;
   rasterAttributes: {
     numerator: number;
     denominator: number;
@@ -127,6 +358,25 @@ export interface InstanceLike extends WebAssembly.Instance {
   instance?: WebAssembly.Instance;
 }
 
+// output pixel formats of the wasm decoder
+export const enum DecoderFormat {
+  RGBA8888 = 0,
+  INDEXED = 1,
+  BGRA8888 = 2,
+  RGBA8888_PREMUL = 3,
+  RGB24 = 4,
+  RGB565 = 5
+}
+
+// abort reasons of the wasm decoder
+export const enum DecoderAbort {
+  NONE = 0,
+  CALLBACK = 1,
+  COMPLETE = 2,
+  MEMORY = 3,
+  BUDGET = 4
+}
+
 // parser operation modes
 export const enum ParseMode {
   M0 = 0,   // image processing mode still undecided
@@ -138,13 +388,44 @@ export const enum ParseMode {
 export interface IWasmDecoderExports extends Record<string, WebAssembly.ExportValue> {
   memory: WebAssembly.Memory;
   get_state_address(): number;
+  get_stats_address(): number;
   get_chunk_address(): number;
   get_p0_address(): number;
+  line_stride(): number;
+  get_free_address(): number;
+  set_max_width(width: number): void;
+  set_budget(pixels: number, bands: number, overdraws: number): void;
+  abort_reason(): number;
   get_palette_address(): number;
-  init(sixelColor: number, fillColor: number, paletteLimit: number, truncate: number): void;
+  init(sixelColor: number, fillColor: number, paletteLimit: number, truncate: number, format?: number): void;
   decode(start: number, end: number): void;
   current_width(): number;
   current_height(): number;
+  pack_rows(address: number, row: number, rows: number, width: number): number;
+  set_canvas(address: number): number;
+  canvas_row(): number;
+  thumbnail_length(factor: number): number;
+  set_thumbnail(address: number, factor: number, box: number): number;
+  flush_thumbnail(): void;
+  set_arena(address: number, capacity: number): void;
+  flush_arena(): void;
+  arena_width(): number;
+  arena_height(): number;
+  arena_rows(): number;
+  arena_stride(): number;
+  arena_address(): number;
+  decode_batch(images: number, count: number, data: number, arena: number, capacity: number): number;
+  // encoder
+  get_encoder_palette_address(): number;
+  encode_init(pixels: number, format: number, width: number, height: number, paletteLength: number, raster: number): number;
+  encode(out: number, size: number): number;
+  encode_limit(width: number, paletteLength: number): number;
+  // quantizer
+  quantize_state_size(): number;
+  quantize_palette_address(state: number): number;
+  quantize_palette(state: number, pixels: number, length: number, colors: number): number;
+  quantize_set_palette(state: number, length: number): number;
+  quantize_reduce(state: number, pixels: number, width: number, height: number, indices: number, dither: number): number;
 }
 
 // wasm decoder
@@ -152,6 +433,21 @@ export interface IWasmDecoder extends WebAssembly.Instance {
   exports: IWasmDecoderExports;
 }
 
+// messages from DecoderPool to DecoderWorker
+export type PoolRequest =
+  { type: 'module', module: WebAssembly.Module } |
+  { type: 'open', id: number, opts: IDecoderOptions } |
+  { type: 'chunk', id: number, data: UintTypedArray | string } |
+  { type: 'close', id: number };
+
+// messages from DecoderWorker to DecoderPool
+export type PoolResponse =
+  {
+    type: 'result', id: number, width: number, height: number,
+    buffer: ArrayBuffer, byteOffset: number, length: number, bytesPerElement: number, palette: Uint32Array
+  } |
+  { type: 'error', id: number, message: string };
+
 
 /**
  * OLD (to be removed)
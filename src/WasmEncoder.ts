@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+import { IWasmDecoder, IWasmDecoderExports } from './Types';
+import { getWasmModule } from './Decoder';
+
+
+// input pixel formats of the wasm encoder
+export const enum EncoderFormat {
+  RGBA8888 = 0,
+  INDEXED8 = 1,
+  INDEXED16 = 2
+}
+
+// wasm instance for encoding and quantization, created on first usage
+// (the decoder callbacks are never called by the encoder)
+let ENCODER: IWasmDecoderExports | undefined;
+let ENCODER_BASE = 0;
+
+export function getEncoder(): IWasmDecoderExports {
+  if (!ENCODER) {
+    const instance = new WebAssembly.Instance(getWasmModule(), {
+      env: {
+        handle_band: () => 1,
+        mode_parsed: () => 1
+      }
+    }) as IWasmDecoder;
+    ENCODER = instance.exports;
+    // free memory starts behind the initial (static) memory
+    ENCODER_BASE = ENCODER.memory.buffer.byteLength;
+  }
+  return ENCODER;
+}
+
+/**
+ * Reserve `size` bytes of free memory of the encoder instance, returns the start address.
+ * The memory is shared by all encoder and quantizer calls, it is only valid until the next call.
+ * Note that the instance memory never shrinks, it stays at the biggest size requested so far.
+ */
+export function reserveMemory(size: number): number {
+  const memory = getEncoder().memory;
+  if (ENCODER_BASE + size > memory.buffer.byteLength) {
+    memory.grow(Math.ceil((ENCODER_BASE + size - memory.buffer.byteLength) / 65536));
+  }
+  return ENCODER_BASE;
+}
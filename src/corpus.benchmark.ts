@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+import { ThroughputRuntimeCase, perfContext, before } from 'xterm-benchmark';
+import { ICaseResult, IPerfCase } from 'xterm-benchmark/lib/interfaces';
+import * as fs from 'fs';
+import { Decoder } from './Decoder';
+import { sixelEncodeIndexed } from './SixelEncoder';
+import { reduce } from './Quantizer';
+
+
+/**
+ * Corpus benchmark - runs every file of testfiles/ through the decoder
+ * in both parse modes (M1, M2), from bytes and from string, and through
+ * an encode round-trip (quantize + encode + decode of the decoded image).
+ *
+ * Besides runtime and MB/s every case reports pixel throughput, peak
+ * `memoryUsage` of the decoder and the allocations on JS side
+ * (growth of `process.memoryUsage().arrayBuffers`) in its summary.
+ * Create a baseline with `npm run benchmark-baseline`, compare against it
+ * with `npm run benchmark-eval` (thresholds in benchmark.json).
+ */
+
+
+const REPEAT = 10;
+const TESTFILES = __dirname + '/../testfiles/';
+
+const CORPUS = fs.readdirSync(TESTFILES)
+  .filter(name => name.endsWith('_clean.six') || name.endsWith('_clean.sixel'))
+  .sort()
+  .map(name => {
+    const bytes = fs.readFileSync(TESTFILES + name);
+    return { name, bytes, string: bytes.toString('latin1') };
+  });
+
+
+interface ICorpusResult {
+  payloadSize: number;
+  pixelSize: number;
+  memoryUsage: number;
+  arrayBuffers: number;
+}
+
+function corpusResult(dec: Decoder, payloadSize: number, arrayBuffers: number): ICorpusResult {
+  return {
+    payloadSize,
+    pixelSize: dec.width * dec.height,
+    memoryUsage: dec.memoryUsage,
+    arrayBuffers: process.memoryUsage().arrayBuffers - arrayBuffers
+  };
+}
+
+// Pixel throughput, peak memory and allocations of all runs into the case summary.
+function corpusStats(results: ICaseResult[], perfCase: IPerfCase): void {
+  let runtime = 0;
+  let pixels = 0;
+  let peakMemory = 0;
+  let allocations = 0;
+  for (const r of results) {
+    const value: ICorpusResult = r.returnValue;
+    runtime += r.runtime[0] * 1000 + r.runtime[1] / 1000000;
+    pixels += value.pixelSize;
+    peakMemory = Math.max(peakMemory, value.memoryUsage);
+    allocations += Math.max(0, value.arrayBuffers);
+  }
+  const summary = {
+    pixelThroughput: pixels / runtime * 1000,
+    peakMemory,
+    allocations: allocations / results.length
+  };
+  perfCase.summary['corpus'] = summary;
+  console.log(
+    `${perfCase.getIndent()} --> ${fmtBig(summary.pixelThroughput)}Pixel/s,`,
+    `peak memory: ${fmtBig(summary.peakMemory)}B,`,
+    `allocations: ${fmtBig(summary.allocations)}B/run`
+  );
+}
+
+function fmtBig(v: number): string {
+  return v > 1000000000
+    ? (v / 1000000000).toFixed(2) + ' G'
+    : v > 1000000
+      ? (v / 1000000).toFixed(2) + ' M'
+      : v > 1000
+        ? (v / 1000).toFixed(2) + ' K'
+        : v.toFixed(0) + ' ';
+}
+
+
+for (const { name, bytes, string } of CORPUS) {
+  perfContext(name, () => {
+    let dec: Decoder;
+    before(() => {
+      dec = new Decoder({ memoryLimit: 0 });
+    });
+
+    for (const [mode, truncate] of [['M1', false], ['M2', true]] as [string, boolean][]) {
+      new ThroughputRuntimeCase(`${mode} decode`, () => {
+        const arrayBuffers = process.memoryUsage().arrayBuffers;
+        dec.init(undefined, undefined, undefined, truncate);
+        dec.decode(bytes);
+        dec.data32;
+        return corpusResult(dec, bytes.length, arrayBuffers);
+      }, { repeat: REPEAT }).showAverageRuntime().showAverageThroughput().postAll(corpusStats);
+      new ThroughputRuntimeCase(`${mode} decodeString`, () => {
+        const arrayBuffers = process.memoryUsage().arrayBuffers;
+        dec.init(undefined, undefined, undefined, truncate);
+        dec.decodeString(string);
+        dec.data32;
+        return corpusResult(dec, string.length, arrayBuffers);
+      }, { repeat: REPEAT }).showAverageRuntime().showAverageThroughput().postAll(corpusStats);
+    }
+
+    // round-trip: quantize + encode the decoded image, decode the result again
+    let source: Uint8ClampedArray;
+    let width = 0;
+    let height = 0;
+    before(() => {
+      dec.init();
+      dec.decode(bytes);
+      width = dec.width;
+      height = dec.height;
+      source = dec.data8.slice();
+    });
+    new ThroughputRuntimeCase('encode round-trip', () => {
+      const arrayBuffers = process.memoryUsage().arrayBuffers;
+      const { indices, palette } = reduce(source, width, 256, 'none');
+      const sixels = sixelEncodeIndexed(indices, width, height, palette);
+      dec.init();
+      dec.decodeString(sixels);
+      dec.data32;
+      return corpusResult(dec, sixels.length, arrayBuffers);
+    }, { repeat: REPEAT }).showAverageRuntime().showAverageThroughput().postAll(corpusStats);
+  });
+}
@@ -10,6 +10,11 @@ export  {
   decodeAsync,
 } from './Decoder';
 
+export {
+  DecoderPool,
+  DecoderPoolStream
+} from './DecoderPool';
+
 export {
   sixelEncode,
   introducer,
@@ -30,7 +35,17 @@ export {
 export {
   IDecodeResult,
   IDecoderOptions,
+  IRowRange,
   RGBA8888,
   RGBColor,
-  UintTypedArray
+  UintTypedArray,
+  Dithering,
+  ThumbnailFilter,
+  PixelFormat,
+  IDecoderPoolOptions,
+  IPoolDecodeResult,
+  IWorkerLike,
+  IBatchImageOptions,
+  IBatchImage,
+  IBatchResult
 } from './Types';
@@ -0,0 +1,412 @@
+/**
+ * Native throughput benchmark for the SIXEL band decoder.
+ *
+ * Decodes every given file in M1 (truncate=0) and M2 (truncate=1) with
+ * several chunk sizes and reports MB/s and pixels/s of the decoder alone
+ * (no pixel copying in the band callback).
+ * Note that M2 only applies to level 2 images, level 1 images always run in M1.
+ * The "buffer" rows decode the whole file in place with `decoder_decode_buffer`.
+ * With -i the decoder writes palette indices instead of colors (indexed variants).
+ * With -d (needs DECODER_SPANS) the line decoders paint deferred from band spans (`decoder_set_spans`).
+ * With -j (needs DECODER_THREADS) M2 images are additionally decoded into a canvas
+ * with `decoder_decode_parallel`, once serial (j1) and with the given thread count.
+ *
+ * With -s the files are fed as terminal stream through the DCS front end (`stream_feed`),
+ * "stream" rows include the sequence search and passthrough of non SIXEL bytes.
+ *
+ * Built with DECODER_STATS the decoder statistics of the "buffer" run get printed below the rows
+ * of every mode (the counters themselves cost some speed, compare against a build without).
+ *
+ * With -e every image is encoded back with the encoder, from RGBA8888 and indexed pixels
+ * (j1/jN rows again with -j), reporting MB/s of the SIXEL output and pixels/s.
+ * The quantize rows reduce the RGBA8888 pixels to 256 colors (palette creation
+ * and reduction without and with dithering), reporting MB/s of the input pixels.
+ *
+ * Usage: decoder-bench [-t seconds] [-j threads] [-e] [-i] [-d] [-s] files...
+ *
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "decoder.h"
+#include "encoder.h"
+#include "quantizer.h"
+#include "stream.h"
+
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchResult {
+  double seconds;
+  long long bytes;
+  long long pixels;
+  int mode;
+};
+
+static bool read_file(const char *filename, std::vector<char> &data) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) return false;
+  char buf[65536];
+  size_t n;
+  data.clear();
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+  fclose(f);
+  return true;
+}
+
+struct Counter {
+  ParserState *ps;
+  long long pixels;
+};
+
+static int count_band(void *user_data, int width) {
+  Counter *c = (Counter *) user_data;
+  c->pixels += width * 6;
+  return 0;
+}
+
+static int accept_mode(void *user_data, int mode) {
+  return 0;
+}
+
+static BenchResult run(ParserState *ps, const std::vector<char> &data, int truncate, int indexed,
+                       int chunk_size, double min_time) {
+  // chunk_size 0 - decode in place from data
+  Counter counter = { ps, 0 };
+  decoder_set_callbacks(ps, &count_band, &accept_mode, &counter);
+  BenchResult r = { 0, 0, 0, 0 };
+  Clock::time_point start = Clock::now();
+  do {
+    counter.pixels = 0;
+    decoder_init(ps, indexed ? 7 : (int) 0xFFFFFFFF, indexed ? 0 : (int) 0xFF000000, 256, truncate, indexed);
+    if (!chunk_size) decoder_decode_buffer(ps, &data[0], data.size());
+    else for (size_t p = 0; p < data.size(); p += chunk_size) {
+      int length = data.size() - p < (size_t) chunk_size ? data.size() - p : chunk_size;
+      memcpy(ps->chunk, &data[p], length);
+      decoder_decode(ps, 0, length);
+    }
+#ifdef DECODER_SPANS
+    decoder_flush_spans(ps);
+#endif
+    // account pixels of a pending band
+    if (ps->mode == 2) {
+      counter.pixels = (long long) (ps->width - 4) * ps->height;
+    } else {
+      counter.pixels += decoder_current_width(ps) * decoder_current_height(ps);
+    }
+    r.bytes += data.size();
+    r.pixels += counter.pixels;
+    r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (r.seconds < min_time);
+  r.mode = ps->mode;
+  return r;
+}
+
+
+static int skip_passthrough(void *user_data, const char *data, int length) {
+  return 0;
+}
+
+static BenchResult run_stream(ParserState *ps, const std::vector<char> &data, int truncate, int indexed,
+                              double min_time) {
+  Counter counter = { ps, 0 };
+  decoder_set_callbacks(ps, &count_band, &accept_mode, &counter);
+  StreamState ss;
+  stream_init(&ss, ps, 1);
+  stream_set_callbacks(&ss, &skip_passthrough, 0, 0);
+  stream_set_image(&ss, indexed ? 7 : (int) 0xFFFFFFFF, indexed ? 0 : (int) 0xFF000000, 256, truncate, indexed);
+  BenchResult r = { 0, 0, 0, 0 };
+  Clock::time_point start = Clock::now();
+  do {
+    counter.pixels = 0;
+    stream_feed(&ss, &data[0], data.size());
+    r.bytes += data.size();
+    r.pixels += counter.pixels;
+    r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (r.seconds < min_time);
+  r.mode = ps->mode;
+  return r;
+}
+
+
+#ifdef DECODER_THREADS
+struct Canvas {
+  ParserState *ps;
+  std::vector<int> pixels;
+};
+
+static int skip_band(void *user_data, int width) {
+  return 0;
+}
+
+static int alloc_canvas(void *user_data, int mode) {
+  Canvas *c = (Canvas *) user_data;
+  if (mode == 2) {
+    c->pixels.resize((size_t) (c->ps->width - 4) * ((c->ps->height + 5) / 6 * 6));
+    decoder_set_canvas(c->ps, c->pixels.data());
+  }
+  return 0;
+}
+
+static BenchResult run_parallel(ParserState *ps, const std::vector<char> &data, int threads, double min_time) {
+  Canvas canvas;
+  canvas.ps = ps;
+  decoder_set_callbacks(ps, &skip_band, &alloc_canvas, &canvas);
+  BenchResult r = { 0, 0, 0, 0 };
+  Clock::time_point start = Clock::now();
+  do {
+    decoder_init(ps, (int) 0xFFFFFFFF, (int) 0xFF000000, 256, 1, 0);
+    decoder_decode_parallel(ps, &data[0], data.size(), threads);
+    r.bytes += data.size();
+    r.pixels += (long long) (ps->width - 4) * ps->height;
+    r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (r.seconds < min_time);
+  r.mode = ps->mode;
+  return r;
+}
+#endif
+
+
+// Decoded image for the encoder runs, bands get collected by the band handler.
+struct Image {
+  ParserState *ps;
+  int width;
+  int height;
+  std::vector<std::vector<int> > bands;
+  std::vector<int> pixels;
+  std::vector<unsigned short> indices;
+  std::vector<int> palette;
+};
+
+static void collect_rows(Image *img, int width, int height) {
+  img->bands.push_back(std::vector<int>((size_t) width * 6));
+  int *rows[6] = { img->ps->p0, img->ps->p1, img->ps->p2, img->ps->p3, img->ps->p4, img->ps->p5 };
+  for (int r = 0; r < height; ++r) memcpy(&img->bands.back()[(size_t) width * r], rows[r] + 4, width * sizeof(int));
+  if (width > img->width) img->width = width;
+  img->height += height;
+}
+
+static int collect_band(void *user_data, int width) {
+  collect_rows((Image *) user_data, width, 6);
+  return 0;
+}
+
+// Decode data into img, either as RGBA8888 pixels or as palette indices.
+static void decode_image(ParserState *ps, const std::vector<char> &data, Image &img, int indexed) {
+  img.ps = ps;
+  img.width = 0;
+  img.height = 0;
+  img.bands.clear();
+  decoder_set_callbacks(ps, &collect_band, &accept_mode, &img);
+  decoder_init(ps, indexed ? 7 : (int) 0xFFFFFFFF, 0, 256, 0, indexed);
+  decoder_decode_buffer(ps, &data[0], data.size());
+#ifdef DECODER_SPANS
+  decoder_flush_spans(ps);
+#endif
+  if (decoder_current_width(ps)) collect_rows(&img, decoder_current_width(ps), decoder_current_height(ps));
+
+  // assemble bands, short bands are padded with transparent pixels (index 0 when indexed)
+  img.pixels.assign((size_t) img.width * (img.bands.size() * 6), 0);
+  for (size_t b = 0; b < img.bands.size(); ++b) {
+    int width = img.bands[b].size() / 6;
+    for (int r = 0; r < 6; ++r) {
+      memcpy(&img.pixels[(b * 6 + r) * img.width], &img.bands[b][(size_t) width * r], width * sizeof(int));
+    }
+  }
+  img.pixels.resize((size_t) img.width * img.height);
+  img.indices.assign(img.pixels.begin(), img.pixels.end());
+  img.palette.assign(ps->palette, ps->palette + ps->palette_length);
+}
+
+static BenchResult run_encode(const Image &img, int format, int threads, double min_time) {
+  EncoderState *es = new EncoderState;
+  const void *pixels = format == ENC_RGBA8888 ? (const void *) &img.pixels[0] : (const void *) &img.indices[0];
+  std::vector<char> out(1 << 20);
+  if ((int) out.size() < encoder_output_limit(img.width, img.palette.size())) {
+    out.resize(encoder_output_limit(img.width, img.palette.size()));
+  }
+  BenchResult r = { 0, 0, 0, format };
+  Clock::time_point start = Clock::now();
+  do {
+    encoder_init(es, pixels, format, img.width, img.height, &img.palette[0], img.palette.size(), 1);
+    int n;
+#ifdef DECODER_THREADS
+    while ((n = threads ? encoder_encode_parallel(es, &out[0], out.size(), threads)
+                        : encoder_encode(es, &out[0], out.size())) > 0) r.bytes += n;
+#else
+    while ((n = encoder_encode(es, &out[0], out.size())) > 0) r.bytes += n;
+#endif
+    r.pixels += (long long) img.width * img.height;
+    r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (r.seconds < min_time);
+  delete es;
+  return r;
+}
+
+static BenchResult run_quantize(const Image &img, int dither, double min_time) {
+  QuantizerState *qs = new QuantizerState;
+  const unsigned int *pixels = (const unsigned int *) &img.pixels[0];
+  std::vector<unsigned short> indices(img.pixels.size());
+  BenchResult r = { 0, 0, 0, 0 };
+  Clock::time_point start = Clock::now();
+  do {
+    quantizer_create_palette(qs, pixels, img.pixels.size(), 256);
+    quantizer_reduce(qs, pixels, img.width, img.height, &indices[0], dither);
+    r.bytes += img.pixels.size() * 4;
+    r.pixels += img.pixels.size();
+    r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (r.seconds < min_time);
+  delete qs;
+  return r;
+}
+
+
+static void print_result(const char *name, int truncate, const char *chunk, const BenchResult &r) {
+  printf("%-40s %8s  M%d  %6s  %10.2f  %10.2f\n",
+    name, truncate ? "truncate" : "-", r.mode, chunk,
+    r.bytes / r.seconds / 1000000, r.pixels / r.seconds / 1000000);
+}
+
+#ifdef DECODER_STATS
+static void print_stats(const DecoderStats &s) {
+  printf("  bytes %u, sixels %u, repeats %u (%u pixels), color selects %u, hls %u, rgb %u, "
+    "CR %u, bands %u, clears %u, cycles band %llu mode %llu\n",
+    s.bytes, s.sixels, s.repeats, s.repeat_length, s.color_selects, s.color_hls, s.color_rgb,
+    s.crs, s.bands, s.clears, s.band_cycles, s.mode_cycles);
+}
+#endif
+
+
+int main(int argc, char **argv) {
+  double min_time = 0.2;
+  int threads = 0;
+  int encode = 0;
+  int indexed = 0;
+  int spans = 0;
+  int stream = 0;
+  int first = 1;
+  while (first < argc && argv[first][0] == '-') {
+    if (!strcmp(argv[first], "-e")) {
+      encode = 1;
+      first++;
+      continue;
+    }
+    if (!strcmp(argv[first], "-i")) {
+      indexed = 1;
+      first++;
+      continue;
+    }
+    if (!strcmp(argv[first], "-d")) {
+      spans = 1;
+      first++;
+      continue;
+    }
+    if (!strcmp(argv[first], "-s")) {
+      stream = 1;
+      first++;
+      continue;
+    }
+    if (first + 1 >= argc) break;
+    if (!strcmp(argv[first], "-t")) min_time = atof(argv[first + 1]);
+    else if (!strcmp(argv[first], "-j")) threads = atoi(argv[first + 1]);
+    else break;
+    first += 2;
+  }
+  if (first >= argc) {
+    fprintf(stderr, "usage: %s [-t seconds] [-j threads] [-e] [-i] [-d] [-s] files...\n", argv[0]);
+    return 1;
+  }
+#ifndef DECODER_THREADS
+  if (threads) fprintf(stderr, "built without DECODER_THREADS, ignoring -j\n");
+#endif
+#ifndef DECODER_SPANS
+  if (spans) fprintf(stderr, "built without DECODER_SPANS, ignoring -d\n");
+#endif
+
+  // chunk sizes to test, CHUNK_SIZE is the upper limit set at compile time
+  std::vector<int> chunk_sizes;
+  for (int cs = 256; cs < CHUNK_SIZE; cs *= 4) chunk_sizes.push_back(cs);
+  chunk_sizes.push_back(CHUNK_SIZE);
+  chunk_sizes.push_back(0);
+
+  ParserState *ps = new ParserState();
+#ifdef DECODER_SPANS
+  decoder_set_spans(ps, spans);
+#endif
+  for (int i = 0; i < PALETTE_SIZE; ++i) ps->palette[i] = 0xFF000000 | (i * 0x10101);
+
+  printf("%-40s %8s  %2s  %6s  %10s  %10s\n", "file", "truncate", "mode", "chunk", "MB/s", "MPixel/s");
+  std::vector<char> data;
+  long long total_bytes = 0;
+  double total_seconds = 0;
+  for (int i = first; i < argc; ++i) {
+    if (!read_file(argv[i], data)) {
+      fprintf(stderr, "cannot read %s\n", argv[i]);
+      continue;
+    }
+    std::string path(argv[i]);
+    const char *name = argv[i] + (path.rfind('/') == std::string::npos ? 0 : path.rfind('/') + 1);
+    for (int truncate = 0; truncate < 2; ++truncate) {
+      for (size_t k = 0; k < chunk_sizes.size(); ++k) {
+        BenchResult r = run(ps, data, truncate, indexed, chunk_sizes[k], min_time);
+        char chunk[16];
+        if (chunk_sizes[k]) snprintf(chunk, sizeof(chunk), "%d", chunk_sizes[k]);
+        else snprintf(chunk, sizeof(chunk), "buffer");
+        print_result(name, truncate, chunk, r);
+        total_bytes += r.bytes;
+        total_seconds += r.seconds;
+      }
+#ifdef DECODER_STATS
+      print_stats(ps->stats);
+#endif
+      if (stream) print_result(name, truncate, "stream", run_stream(ps, data, truncate, indexed, min_time));
+    }
+#ifdef DECODER_THREADS
+    if (threads) {
+      int counts[2] = { 1, threads };
+      for (int k = 0; k < 2; ++k) {
+        BenchResult r = run_parallel(ps, data, counts[k], min_time);
+        if (r.mode != 2) break;
+        char label[16];
+        snprintf(label, sizeof(label), "j%d", counts[k]);
+        print_result(name, 1, label, r);
+      }
+    }
+#endif
+    if (encode) {
+      Image img;
+      const char *formats[2] = { "encode", "encode indexed" };
+      for (int indexed = 0; indexed < 2; ++indexed) {
+        decode_image(ps, data, img, indexed);
+        if (!img.width || !img.height) break;
+        int counts[2] = { 0, threads };
+        for (int k = 0; k < (threads ? 2 : 1); ++k) {
+          BenchResult r = run_encode(img, indexed ? ENC_INDEXED16 : ENC_RGBA8888, counts[k], min_time);
+          char label[16];
+          snprintf(label, sizeof(label), "j%d", counts[k] ? counts[k] : 1);
+          printf("%-40s %8s  %2s  %6s  %10.2f  %10.2f\n", name, formats[indexed], "-", label,
+            r.bytes / r.seconds / 1000000, r.pixels / r.seconds / 1000000);
+        }
+        if (!indexed && img.width <= MAX_WIDTH) {
+          const char *dithers[3] = { "quantize", "quantize fs", "quantize ordered" };
+          for (int d = 0; d < 3; ++d) {
+            BenchResult r = run_quantize(img, d, min_time);
+            printf("%-40s %8s  %2s  %6s  %10.2f  %10.2f\n", name, dithers[d], "-", "-",
+              r.bytes / r.seconds / 1000000, r.pixels / r.seconds / 1000000);
+          }
+        }
+      }
+    }
+  }
+  printf("\ntotal: %.2f MB/s\n", total_bytes / total_seconds / 1000000);
+  decoder_release(ps);
+  delete ps;
+  return 0;
+}
@@ -26,14 +26,41 @@ CHUNK_SIZE=16384
 PALETTE_SIZE=4096
 
 # MAX_WIDTH
-# Maximum width of a pixel line the decoder can handle.
+# Default width limit of the decoder (can be changed at runtime with `set_max_width`),
+# and hard limit of the encoder and quantizer.
 # Changing this will also change the memory needs below.
 # This value must be a multiple of 128 to stay in line with the clear logic.
 MAX_WIDTH=16384
 
+# STACK
+# Shadow stack of an instance, placed in front of the heap base (pixel lines).
+# The encoder and quantizer keep small arrays on the stack (number digits, histogram counts),
+# 64 KB leaves plenty of room for them and the call depth of the decoder.
+STACK=65536
+
 # MEMORY
-# Memory used by an instance. Formula is roughly MAX_WIDTH * 4 * 6 + 65536.
-MEMORY=$((7 * 65536))
+# Initial memory of an instance (static decoder and encoder state and the stack).
+# Formula is roughly MAX_WIDTH * 32 + PALETTE_SIZE * 8 + CHUNK_SIZE + STACK + 65536
+# (+ SPAN_SIZE * 20 + SPAN_CODES + MAX_WIDTH with SPANS, see decoder.h).
+MEMORY=$((12 * 65536))
+
+# MAXIMUM_MEMORY
+# Upper limit for memory growth. The decoder grows the memory for its pixel lines
+# (placed behind the static memory, sized by the image width),
+# JS grows it to place a direct canvas behind the lines (M2 only),
+# or the pixels and output buffer for encoding (also the quantizer state).
+# The effective limit is set by `memoryLimit` on JS side.
+MAXIMUM_MEMORY=$((32768 * 65536))
+
+# STATS
+# Set to 1 to compile in the decoder statistics (DECODER_STATS), readable with
+# `Decoder.properties.stats`. Costs some decoding speed, leave it off for release builds.
+STATS=0
+
+# SPANS
+# Set to 1 to compile in deferred span painting (DECODER_SPANS, exports `set_spans`
+# and `flush_spans`). Slower than eager painting for all test images, leave it off for release builds.
+SPANS=0
 
 ##################
 # compile script #
@@ -44,14 +71,18 @@ MEMORY=$((7 * 65536))
 source $EMSCRIPTEN_PATH
 
 # compile with customizations
+# $1 - additional compiler flags, $2 - output file
+compile() {
 emcc -O3 \
+$([ "$STATS" != "0" ] && echo -DDECODER_STATS) \
+$([ "$SPANS" != "0" ] && echo -DDECODER_SPANS) \
 -DCHUNK_SIZE=$CHUNK_SIZE \
 -DPALETTE_SIZE=$PALETTE_SIZE \
 -DMAX_WIDTH=$MAX_WIDTH \
 -s ASSERTIONS=0 \
 -s IMPORTED_MEMORY=0 \
 -s MALLOC=none \
--s ALLOW_MEMORY_GROWTH=0 \
+-s ALLOW_MEMORY_GROWTH=1 \
 -s SAFE_HEAP=0 \
 -s WARN_ON_UNDEFINED_SYMBOLS=0 \
 -s ERROR_ON_UNDEFINED_SYMBOLS=0 \
@@ -59,49 +90,56 @@ emcc -O3 \
 -s DEFAULT_TO_CXX=0 \
 -s STRICT=1 \
 -s SUPPORT_ERRNO=0 \
--s TOTAL_STACK=0 \
+-s TOTAL_STACK=$STACK \
 -s INITIAL_MEMORY=$MEMORY \
--s MAXIMUM_MEMORY=$MEMORY \
+-s MAXIMUM_MEMORY=$MAXIMUM_MEMORY \
 -s EXPORTED_FUNCTIONS='[
   "_init",
   "_decode",
   "_current_width",
   "_current_height",
+  "_pack_rows",
+  "_set_canvas",
+  "_canvas_row",
+  "_thumbnail_length",
+  "_set_thumbnail",
+  "_flush_thumbnail",
   "_get_state_address",
+  "_get_stats_address",
   "_get_chunk_address",
   "_get_p0_address",
-  "_get_palette_address"
+  "_line_stride",
+  "_get_free_address",
+  "_set_max_width",
+  "_set_budget",
+  "_set_arena",
+  "_flush_arena",
+  "_arena_width",
+  "_arena_height",
+  "_arena_rows",
+  "_arena_stride",
+  "_decode_batch",
+  "_arena_address",
+  "_abort_reason",
+  "_get_palette_address",
+  "_encode_init",
+  "_encode",
+  "_encode_limit",
+  "_get_encoder_palette_address",
+  "_quantize_state_size",
+  "_quantize_palette_address",
+  "_quantize_palette",
+  "_quantize_set_palette",
+  "_quantize_reduce"'"$([ "$SPANS" != "0" ] && echo ', "_set_spans", "_flush_spans"')"'
 ]' \
---no-entry -mbulk-memory decoder.cpp -o decoder.wasm
+--no-entry -mbulk-memory $1 decoder.cpp encoder.cpp quantizer.cpp -o $2
+}
 
-# export compile time settings with settings.json
-echo "{\"CHUNK_SIZE\": $CHUNK_SIZE, \"PALETTE_SIZE\": $PALETTE_SIZE, \"MAX_WIDTH\": $MAX_WIDTH}" > settings.json
+# scalar build (baseline for all engines)
+compile "" decoder.wasm
 
+# SIMD build, picked at load time if the engine supports wasm-simd
+compile "-msimd128" decoder-simd.wasm
 
-# SIMD test
-#emcc -O3 \
-#-DCHUNK_SIZE=$CHUNK_SIZE \
-#-DPALETTE_SIZE=$PALETTE_SIZE \
-#-DMAX_WIDTH=$MAX_WIDTH \
-#-s ASSERTIONS=0 \
-#-s IMPORTED_MEMORY=0 \
-#-s MALLOC=none \
-#-s ALLOW_MEMORY_GROWTH=0 \
-#-s SAFE_HEAP=0 \
-#-s WARN_ON_UNDEFINED_SYMBOLS=0 \
-#-s ERROR_ON_UNDEFINED_SYMBOLS=0 \
-#-s DISABLE_EXCEPTION_CATCHING=1 \
-#-s DEFAULT_TO_CXX=0 \
-#-s STRICT=1 \
-#-s SUPPORT_ERRNO=0 \
-#-s TOTAL_STACK=0 \
-#-s INITIAL_MEMORY=$((145 * 65536)) \
-#-s MAXIMUM_MEMORY=$((145 * 65536)) \
-#-s EXPORTED_FUNCTIONS='[
-#  "_init",
-#  "_decode",
-#  "_get_chunk_address",
-#  "_get_canvas_address",
-#  "_get_palette_address"
-#]' \
-#--no-entry -msimd128 -msse -msse2 -msse4.1 decoder-simd.cpp -o decoder-simd.wasm
+# export compile time settings with settings.json
+echo "{\"CHUNK_SIZE\": $CHUNK_SIZE, \"PALETTE_SIZE\": $PALETTE_SIZE, \"MAX_WIDTH\": $MAX_WIDTH}" > settings.json
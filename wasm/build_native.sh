@@ -0,0 +1,80 @@
+#!/bin/bash
+
+################################
+# native decoder build settings #
+################################
+
+# CXX
+# Compiler to use (any C++11 capable gcc or clang).
+CXX=${CXX:-g++}
+
+# CXXFLAGS
+# Optimization flags. -march=native is fine for local benchmarking,
+# remove it for portable library builds.
+CXXFLAGS=${CXXFLAGS:-"-O3 -march=native"}
+
+# CHUNK_SIZE, PALETTE_SIZE, MAX_WIDTH
+# Same meaning as in build.sh. Code linking against the static library
+# must use the same values, as they define the ParserState layout.
+# CHUNK_SIZE is set higher here, the benchmark tests chunk sizes up to this value.
+CHUNK_SIZE=65536
+PALETTE_SIZE=4096
+MAX_WIDTH=16384
+
+# THREADS
+# Set to 0 to build without band parallel decoding (`decoder_decode_parallel`).
+# Code linking against the library needs -pthread then.
+THREADS=${THREADS:-1}
+
+# STATS
+# Set to 1 to count decoder statistics per image (`DecoderStats`, DECODER_STATS),
+# the benchmark prints them for every file. Changes the ParserState layout.
+STATS=${STATS:-0}
+
+# SPANS
+# Set to 1 to compile in deferred span painting (`decoder_set_spans`, DECODER_SPANS),
+# the benchmark measures it with -d. Changes the ParserState layout.
+SPANS=${SPANS:-0}
+
+# OUT
+# Output folder for library and benchmark binaries.
+OUT=native
+
+##################
+# compile script #
+##################
+
+set -e
+mkdir -p $OUT
+
+DEFINES="-DCHUNK_SIZE=$CHUNK_SIZE -DPALETTE_SIZE=$PALETTE_SIZE -DMAX_WIDTH=$MAX_WIDTH"
+if [ "$THREADS" != "0" ]; then
+  DEFINES="$DEFINES -DDECODER_THREADS -pthread"
+fi
+if [ "$STATS" != "0" ]; then
+  DEFINES="$DEFINES -DDECODER_STATS"
+fi
+if [ "$SPANS" != "0" ]; then
+  DEFINES="$DEFINES -DDECODER_SPANS"
+fi
+
+# band decoder, DCS stream front end, encoder and quantizer as static library
+# (SIMD painting is enabled by CXXFLAGS, e.g. -march=native, -msse4.1 or -mavx2)
+$CXX $CXXFLAGS $DEFINES -c decoder.cpp -o $OUT/decoder.o
+$CXX $CXXFLAGS $DEFINES -c stream.cpp -o $OUT/stream.o
+$CXX $CXXFLAGS $DEFINES -c encoder.cpp -o $OUT/encoder.o
+$CXX $CXXFLAGS $DEFINES -c quantizer.cpp -o $OUT/quantizer.o
+ar rcs $OUT/libsixeldecoder.a $OUT/decoder.o $OUT/stream.o $OUT/encoder.o $OUT/quantizer.o
+
+# scalar only variant for comparison
+$CXX $CXXFLAGS $DEFINES -DNO_SIMD -c decoder.cpp -o $OUT/decoder-scalar.o
+$CXX $CXXFLAGS $DEFINES -DNO_SIMD -c stream.cpp -o $OUT/stream-scalar.o
+$CXX $CXXFLAGS $DEFINES -DNO_SIMD -c quantizer.cpp -o $OUT/quantizer-scalar.o
+ar rcs $OUT/libsixeldecoder-scalar.a $OUT/decoder-scalar.o $OUT/stream-scalar.o $OUT/encoder.o $OUT/quantizer-scalar.o
+
+# benchmark binaries
+$CXX $CXXFLAGS $DEFINES benchmark.cpp -L$OUT -lsixeldecoder -o $OUT/decoder-bench
+$CXX $CXXFLAGS $DEFINES benchmark.cpp -L$OUT -lsixeldecoder-scalar -o $OUT/decoder-bench-scalar
+
+# run benchmark with: ./native/decoder-bench [-j threads] [-e] [-s] ../testfiles/*.six
+echo "built $OUT/libsixeldecoder.a $OUT/decoder-bench $OUT/decoder-bench-scalar"
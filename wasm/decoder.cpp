@@ -1,19 +1,68 @@
 /**
- * WasmDecoder - static SIXEL band decoder.
+ * WasmDecoder - SIXEL band decoder.
  * 
  * Copyright (c) 2021 Joerg Breitbart.
  * @license MIT
  */
 
-// cmdline overridable defines
-#ifndef CHUNK_SIZE
-  #define CHUNK_SIZE 4096
+#include "decoder.h"
+
+// SIMD painting path, selected at compile time by the target features
+// (-msse4.1, -mavx2 or -march=native natively, -msimd128 for wasm).
+// Define NO_SIMD to force the scalar path.
+#ifndef NO_SIMD
+  #if defined(__AVX2__)
+    #include <immintrin.h>
+    #define SIMD_WIDTH 8
+  #elif defined(__SSE4_1__)
+    #include <smmintrin.h>
+    #define SIMD_WIDTH 4
+  #elif defined(__wasm_simd128__)
+    #include <wasm_simd128.h>
+    #define SIMD_WIDTH 4
+  #endif
 #endif
-#ifndef PALETTE_SIZE
-  #define PALETTE_SIZE 256
+
+// file decoding with mmap (POSIX only)
+#if !defined(__EMSCRIPTEN__) && (defined(__unix__) || defined(__APPLE__))
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+  #define DECODER_MMAP
 #endif
-#ifndef MAX_WIDTH
-  #define MAX_WIDTH 4096
+
+// line buffer allocation (wasm places them behind the static memory)
+#ifndef __EMSCRIPTEN__
+  #include <cstdlib>
+#endif
+
+// band parallel decoding with native threads (not available in wasm)
+#ifdef DECODER_THREADS
+  #include <atomic>
+  #include <cstring>
+  #include <mutex>
+  #include <thread>
+  #include <vector>
+#endif
+
+// decoder statistics, the counters compile to nothing without DECODER_STATS
+#ifdef DECODER_STATS
+  #define STATS_ADD(ps, counter, n) ((ps)->stats.counter += (n))
+  #if !defined(__EMSCRIPTEN__) && (defined(__x86_64__) || defined(__i386__))
+    #include <x86intrin.h>
+    static inline unsigned long long stats_clock() { return __rdtsc(); }
+  #elif !defined(__EMSCRIPTEN__) && defined(__aarch64__)
+    static inline unsigned long long stats_clock() {
+      unsigned long long value;
+      asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+      return value;
+    }
+  #else
+    static inline unsigned long long stats_clock() { return 0; }
+  #endif
+#else
+  #define STATS_ADD(ps, counter, n) ((void) 0)
 #endif
 
 // internal defines
@@ -22,8 +71,6 @@
 #define  ST_ATTR 34
 #define  ST_COLOR 35
 
-#define PARAM_SIZE 8
-
 
 #define LV0 0
 #define LV1 1
@@ -33,96 +80,194 @@
 #define M1 1
 #define M2 2
 
-
-/**
- * static parser state
- */
-static struct {
-  // exposed entries (when changed also needs changes in JS)
-  long long fill_color;
-  int width;
-  int height;
-  int r_num;
-  int r_denom;
-  int r_width;
-  int r_height;
-  int truncate;
-  int level;  // LV0 undecided, LV1 level1, LV2 level2
-  int mode;   // M0 undecided, M1 level1 or !truncate, M2 level2 + truncate
-  int palette_length;
-
-  // internal or individually exposed
-  int abort;
-  int cleared_width;
-  int real_width;
-  int band_height;
-  int state;
-  int color;
-  int cursor;
-  int p_length;
-  int params[PARAM_SIZE];
-  int palette[PALETTE_SIZE];
-  char chunk[CHUNK_SIZE + 1] __attribute__((aligned(16)));
-  int p0[MAX_WIDTH + 4] __attribute__((aligned(16)));
-  int p1[MAX_WIDTH + 4] __attribute__((aligned(16)));
-  int p2[MAX_WIDTH + 4] __attribute__((aligned(16)));
-  int p3[MAX_WIDTH + 4] __attribute__((aligned(16)));
-  int p4[MAX_WIDTH + 4] __attribute__((aligned(16)));
-  int p5[MAX_WIDTH + 4] __attribute__((aligned(16)));
-} __attribute__((aligned(16))) ps;
+// decoder variants of the templated core (see `decode_sixels`)
+#define V_M1 0
+#define V_M2 1
+#define V_M2_CANVAS 2
 
 
 /**
- * Exported/imported functions.
+ * Sixel painting.
  */
-extern "C" {
-  void* get_state_address() { return &ps.fill_color; }
-  void* get_chunk_address() { return &ps.chunk[0]; }
-  void* get_p0_address() { return &ps.p0[4]; }
-  void* get_palette_address() { return &ps.palette[0]; }
 
-  void init(int sixel_color, int fill_color, unsigned int palette_length, int truncate);
-  void decode(int start, int end);
-  int current_width();
-  int current_height();
+// Put single sixel at current cursor position, if below limit.
+static inline void put_single(ParserState *ps, unsigned int code, int color, unsigned int cursor, unsigned int limit) {
+  if (cursor < limit) {
+    ps->p0[(code >> 0 & 1) * cursor] = color;
+    ps->p1[(code >> 1 & 1) * cursor] = color;
+    ps->p2[(code >> 2 & 1) * cursor] = color;
+    ps->p3[(code >> 3 & 1) * cursor] = color;
+    ps->p4[(code >> 4 & 1) * cursor] = color;
+    ps->p5[(code >> 5 & 1) * cursor] = color;
+  }
+}
 
-  // imported
-  int handle_band(int width);
-  int mode_parsed(int mode);
+// Put sixel n-times from current cursor position, up to limit.
+static inline void put(ParserState *ps, int code, int color, unsigned int n, unsigned int cursor, unsigned int limit) {
+  if (code && cursor < limit) {
+    if (cursor + n >= limit) {
+      n = limit - cursor;
+    }
+    if (code >> 0 & 1) { int *pp = ps->p0 + cursor; int r = n; while (r--) *pp++ = color; }
+    if (code >> 1 & 1) { int *pp = ps->p1 + cursor; int r = n; while (r--) *pp++ = color; }
+    if (code >> 2 & 1) { int *pp = ps->p2 + cursor; int r = n; while (r--) *pp++ = color; }
+    if (code >> 3 & 1) { int *pp = ps->p3 + cursor; int r = n; while (r--) *pp++ = color; }
+    if (code >> 4 & 1) { int *pp = ps->p4 + cursor; int r = n; while (r--) *pp++ = color; }
+    if (code >> 5 & 1) { int *pp = ps->p5 + cursor; int r = n; while (r--) *pp++ = color; }
+  }
 }
 
 
 /**
- * Sixel painting.
+ * Direct canvas painting (M2 only).
+ *
+ * Other than the band buffers the canvas rows have no dummy slot at index 0,
+ * thus the pixels are updated with a select instead of the index trick.
+ * `p` points to the top row of the current band shifted by -4
+ * (to be indexed by cursor directly), `width` is the cursor limit (raster width + 4).
  */
 
-// Put single sixel at current cursor position.
-static inline void put_single(unsigned int code, int color, unsigned int cursor) {
-  if (cursor < MAX_WIDTH) {
-    ps.p0[(code >> 0 & 1) * cursor] = color;
-    ps.p1[(code >> 1 & 1) * cursor] = color;
-    ps.p2[(code >> 2 & 1) * cursor] = color;
-    ps.p3[(code >> 3 & 1) * cursor] = color;
-    ps.p4[(code >> 4 & 1) * cursor] = color;
-    ps.p5[(code >> 5 & 1) * cursor] = color;
+// Put single sixel into the canvas at current cursor position.
+static inline void put_single_canvas(int *p, int stride, unsigned int code, int color, unsigned int cursor, unsigned int width) {
+  if (cursor < width) {
+    p += cursor;
+    p[0] = code & 1 ? color : p[0];
+    p[stride] = code & 2 ? color : p[stride];
+    p[stride * 2] = code & 4 ? color : p[stride * 2];
+    p[stride * 3] = code & 8 ? color : p[stride * 3];
+    p[stride * 4] = code & 16 ? color : p[stride * 4];
+    p[stride * 5] = code & 32 ? color : p[stride * 5];
   }
 }
 
-// Put sixel n-times from current cursor position.
-static inline void put(int code, int color, unsigned int n, unsigned int cursor) {
-  if (code && cursor < MAX_WIDTH) {
-    if (cursor + n >= MAX_WIDTH) {
-      n = MAX_WIDTH - cursor;
+// Put sixel n-times into the canvas from current cursor position.
+static inline void put_canvas(int *p, int stride, int code, int color, unsigned int n, unsigned int cursor, unsigned int width) {
+  if (code && cursor < width) {
+    if (cursor + n >= width) {
+      n = width - cursor;
+    }
+    p += cursor;
+    for (int i = 0; i < 6; ++i, p += stride) {
+      if (code >> i & 1) { int *pp = p; int r = n; while (r--) *pp++ = color; }
     }
-    if (code >> 0 & 1) { int *pp = ps.p0 + cursor; int r = n; while (r--) *pp++ = color; }
-    if (code >> 1 & 1) { int *pp = ps.p1 + cursor; int r = n; while (r--) *pp++ = color; }
-    if (code >> 2 & 1) { int *pp = ps.p2 + cursor; int r = n; while (r--) *pp++ = color; }
-    if (code >> 3 & 1) { int *pp = ps.p3 + cursor; int r = n; while (r--) *pp++ = color; }
-    if (code >> 4 & 1) { int *pp = ps.p4 + cursor; int r = n; while (r--) *pp++ = color; }
-    if (code >> 5 & 1) { int *pp = ps.p5 + cursor; int r = n; while (r--) *pp++ = color; }
   }
 }
 
+#ifdef SIMD_WIDTH
+/**
+ * SIMD painting of sixel runs.
+ *
+ * `sixel_run` classifies SCAN_WIDTH bytes at once into a bitmask of sixel bytes and
+ * takes the length of the sixel run from the trailing set bits, thus the decoder loops
+ * can paint whole runs without per byte branching. The run stops latest at the sentinel
+ * (bytes behind it get loaded but never used, see overread space of `ParserState.chunk`).
+ * Full packs of SIMD_WIDTH sixels are normalized with SWAR and painted with `put_simd`,
+ * the remainder of a run falls back to `put_single`.
+ * `put_simd` takes the pointer to the first pixel in the top row and the row stride,
+ * thus works for the band buffers p0..p5 (contiguous) and the direct canvas alike.
+ */
+#if SIMD_WIDTH == 8
+  typedef unsigned long long sixel_pack;
+  #define SWAR_ONES 0x0101010101010101ULL
+  #define SCAN_WIDTH 32
+#else
+  typedef unsigned int sixel_pack;
+  #define SWAR_ONES 0x01010101U
+  #define SCAN_WIDTH 16
+#endif
+
+// Load SIMD_WIDTH sixel bytes from c as sixel codes with an extra bit 6 set.
+// All bytes must be sixels (byte + 1 sets bit 6 and leaves the code in the lower bits).
+static inline sixel_pack load_sixels(const char *c) {
+  sixel_pack v;
+  __builtin_memcpy(&v, c, sizeof(v));
+  return (v & SWAR_ONES * 0x7F) + SWAR_ONES;
+}
+
+// Length of the sixel run starting at c (1 .. SCAN_WIDTH).
+static inline int sixel_run(const char *c) {
+#if defined(__AVX2__)
+  __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) c), _mm256_set1_epi8(0x7F));
+  __m256i t = _mm256_and_si256(_mm256_sub_epi8(v, _mm256_set1_epi8(63)), _mm256_set1_epi8((char) 0xC0));
+  unsigned long long mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(t, _mm256_setzero_si256()));
+  return __builtin_ctzll(~mask);
+#elif defined(__SSE4_1__)
+  __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *) c), _mm_set1_epi8(0x7F));
+  __m128i t = _mm_and_si128(_mm_sub_epi8(v, _mm_set1_epi8(63)), _mm_set1_epi8((char) 0xC0));
+  unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_setzero_si128()));
+  return __builtin_ctz(~mask);
+#else
+  v128_t v = wasm_v128_and(wasm_v128_load(c), wasm_i8x16_splat(0x7F));
+  v128_t t = wasm_v128_and(wasm_i8x16_sub(v, wasm_i8x16_splat(63)), wasm_i8x16_splat(0xC0));
+  unsigned int mask = wasm_i8x16_bitmask(wasm_i8x16_eq(t, wasm_i8x16_splat(0)));
+  return __builtin_ctz(~mask);
+#endif
+}
+
+// OR of all sixel codes in pack (for M1 band height).
+static inline int pack_or(sixel_pack v) {
+#if SIMD_WIDTH == 8
+  v |= v >> 32;
+#endif
+  v |= v >> 16;
+  v |= v >> 8;
+  return v & 63;
+}
+
+#if defined(__AVX2__)
+static inline void put_row_simd(int *p, __m256i codes, __m256i colors, int bit) {
+  __m256i matcher = _mm256_set1_epi32(bit);
+  __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(codes, matcher), matcher);
+  __m256i prev = _mm256_loadu_si256((__m256i *) p);
+  _mm256_storeu_si256((__m256i *) p, _mm256_blendv_epi8(prev, colors, mask));
+}
+static inline void put_simd(int *p, int stride, sixel_pack pack, int color) {
+  __m256i codes = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(pack));
+  __m256i colors = _mm256_set1_epi32(color);
+  put_row_simd(p, codes, colors, 1);
+  put_row_simd(p + stride, codes, colors, 2);
+  put_row_simd(p + stride * 2, codes, colors, 4);
+  put_row_simd(p + stride * 3, codes, colors, 8);
+  put_row_simd(p + stride * 4, codes, colors, 16);
+  put_row_simd(p + stride * 5, codes, colors, 32);
+}
+#elif defined(__SSE4_1__)
+static inline void put_row_simd(int *p, __m128i codes, __m128i colors, int bit) {
+  __m128i matcher = _mm_set1_epi32(bit);
+  __m128i mask = _mm_cmpeq_epi32(_mm_and_si128(codes, matcher), matcher);
+  __m128i prev = _mm_loadu_si128((__m128i *) p);
+  _mm_storeu_si128((__m128i *) p, _mm_blendv_epi8(prev, colors, mask));
+}
+static inline void put_simd(int *p, int stride, sixel_pack pack, int color) {
+  __m128i codes = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pack));
+  __m128i colors = _mm_set1_epi32(color);
+  put_row_simd(p, codes, colors, 1);
+  put_row_simd(p + stride, codes, colors, 2);
+  put_row_simd(p + stride * 2, codes, colors, 4);
+  put_row_simd(p + stride * 3, codes, colors, 8);
+  put_row_simd(p + stride * 4, codes, colors, 16);
+  put_row_simd(p + stride * 5, codes, colors, 32);
+}
+#else
+// wasm: and/andnot/or is faster than bitselect on v8
+static inline void put_row_simd(int *p, v128_t codes, v128_t colors, int bit) {
+  v128_t matcher = wasm_i32x4_splat(bit);
+  v128_t mask = wasm_i32x4_eq(wasm_v128_and(codes, matcher), matcher);
+  v128_t prev = wasm_v128_load(p);
+  wasm_v128_store(p, wasm_v128_or(wasm_v128_andnot(prev, mask), wasm_v128_and(colors, mask)));
+}
+static inline void put_simd(int *p, int stride, sixel_pack pack, int color) {
+  v128_t codes = wasm_u32x4_extend_low_u16x8(wasm_u16x8_extend_low_u8x16(wasm_i32x4_make(pack, 0, 0, 0)));
+  v128_t colors = wasm_i32x4_splat(color);
+  put_row_simd(p, codes, colors, 1);
+  put_row_simd(p + stride, codes, colors, 2);
+  put_row_simd(p + stride * 2, codes, colors, 4);
+  put_row_simd(p + stride * 3, codes, colors, 8);
+  put_row_simd(p + stride * 4, codes, colors, 16);
+  put_row_simd(p + stride * 5, codes, colors, 32);
+}
+#endif
+#endif  // SIMD_WIDTH
 
 /**
  * Color handling.
@@ -164,83 +309,290 @@ static inline int normalize_hls(int hi, int li, int si) {
   return 0xFF000000 | b << 16 | g << 8 | r;
 }
 
-// Static color converter fp array to avoid branching.
-typedef int (*color_converter)(int, int, int);
-static const color_converter COLOR_CONVERTERS[2] = { &normalize_hls, &normalize_rgb };
+// Convert RGBA8888 to the output format (not for DEC_INDEXED).
+static inline int convert_color(int format, int color) {
+  const unsigned int c = (unsigned int) color;
+  switch (format) {
+    case DEC_BGRA8888:
+      return (int) ((c & 0xFF00FF00) | (c >> 16 & 0xFF) | (c & 0xFF) << 16);
+    case DEC_RGBA8888_PREMUL: {
+      const unsigned int a = c >> 24;
+      const unsigned int r = ((c & 0xFF) * a + 127) / 255;
+      const unsigned int g = ((c >> 8 & 0xFF) * a + 127) / 255;
+      const unsigned int b = ((c >> 16 & 0xFF) * a + 127) / 255;
+      return (int) (a << 24 | b << 16 | g << 8 | r);
+    }
+    case DEC_RGB565:
+      return (int) ((c << 8 & 0xF800) | (c >> 5 & 0x7E0) | (c >> 19 & 0x1F));
+    default:  // DEC_RGBA8888, DEC_RGB24
+      return color;
+  }
+}
+
+// Convert the palette into the output format (`ps->colors`), thus color selects need no conversion.
+// RGBA8888, RGB24 and indices read the palette as it is.
+static void convert_palette(ParserState *ps) {
+  if (ps->indexed || ps->format == DEC_RGBA8888 || ps->format == DEC_RGB24) {
+    ps->colors = ps->palette;
+    return;
+  }
+  ps->colors = ps->converted;
+  for (int i = 0; i < ps->palette_length; ++i) ps->converted[i] = convert_color(ps->format, ps->palette[i]);
+}
 
 // Tiny modulo optimization.
 static inline int fastmod(unsigned int value, unsigned int ceil) {
   return value < ceil ? value : value % ceil;
 }
 
-// Apply color request.
-static inline int apply_color(int color) {
-  if (ps.p_length == 1) {
-    color = ps.palette[fastmod(ps.params[0], ps.palette_length)];
-  } else if (ps.p_length == 5
-    && ps.params[1] == 1 ? ps.params[2] <= 360 : ps.params[2] <= 100
-    && ps.params[3] <= 100
-    && ps.params[4] <= 100)
+// Apply color request. Returns the register index instead of the color in indexed mode,
+// else the register color in the output format (color definitions update both palettes).
+template <int INDEXED>
+static inline int apply_color(ParserState *ps, int color) {
+  if (ps->p_length == 1) {
+    int slot = fastmod(ps->params[0], ps->palette_length);
+    color = INDEXED ? slot : ps->colors[slot];
+  } else if (ps->p_length == 5
+    && ps->params[1] == 1 ? ps->params[2] <= 360 : ps->params[2] <= 100
+    && ps->params[3] <= 100
+    && ps->params[4] <= 100)
   {
-    if (ps.params[1] && ps.params[1] < 3) {
-      ps.palette[fastmod(ps.params[0], ps.palette_length)] = COLOR_CONVERTERS[ps.params[1] - 1](
-        ps.params[2], ps.params[3], ps.params[4]);
+    int slot = fastmod(ps->params[0], ps->palette_length);
+    if (ps->params[1] == 1) {
+      ps->palette[slot] = normalize_hls(ps->params[2], ps->params[3], ps->params[4]);
+    } else if (ps->params[1] == 2) {
+      ps->palette[slot] = normalize_rgb(ps->params[2], ps->params[3], ps->params[4]);
     }
-    color = ps.palette[fastmod(ps.params[0], ps.palette_length)];
+    if (ps->colors != ps->palette) ps->colors[slot] = convert_color(ps->format, ps->palette[slot]);
+    color = INDEXED ? slot : ps->colors[slot];
   }
   return color;
 }
 
+// Count the color request in ps->params (statistics only).
+static inline void count_color(ParserState *ps) {
+#ifdef DECODER_STATS
+  if (ps->p_length == 1) ps->stats.color_selects++;
+  else if (ps->p_length == 5 && ps->params[1] == 1) ps->stats.color_hls++;
+  else if (ps->p_length == 5 && ps->params[1] == 2) ps->stats.color_rgb++;
+#else
+  (void) ps;
+#endif
+}
+
+
+/**
+ * Pixel line memory.
+ *
+ * The lines p0 .. p5 live in one allocation with a row stride of line_width + 4.
+ * Natively they are allocated with malloc. In wasm they sit at the heap base (behind the
+ * static memory) growing the wasm memory as needed, thus grown lines keep their address.
+ */
+
+#ifdef __EMSCRIPTEN__
+extern "C" unsigned char __heap_base;
+
+static inline int *line_memory() {
+  return (int *) (((unsigned long) &__heap_base + 15) & ~15UL);
+}
+
+static int *alloc_lines(unsigned long size) {
+  unsigned long end = (unsigned long) line_memory() + size;
+  unsigned long available = __builtin_wasm_memory_size(0) * 65536;
+  if (end > available && __builtin_wasm_memory_grow(0, (end - available + 65535) / 65536) == (unsigned long) -1) {
+    return 0;
+  }
+  return line_memory();
+}
+
+static void free_lines(int *lines) {}
+#else
+static int *alloc_lines(unsigned long size) { return (int *) malloc(size); }
+static void free_lines(int *lines) { free(lines); }
+#endif
+
+// Grow the lines to hold cursor positions below width, keeps the pixels.
+// Returns 1 if the memory cannot be allocated.
+static int grow_lines(ParserState *ps, int width) {
+  if (width <= ps->line_width) return 0;
+  const int limit = (ps->max_width + 127) / 128 * 128;
+  int line_width = ps->line_width ? ps->line_width : 128;
+  while (line_width < width) line_width *= 2;
+  if (line_width > limit) line_width = limit;
+  const int stride = line_width + 4;
+  int *lines = alloc_lines((unsigned long) stride * 6 * sizeof(int));
+  if (!lines) return 1;
+  if (ps->line_width) {
+    // backwards, in wasm the rows move up within the same memory
+    const int old_stride = ps->line_width + 4;
+    for (int r = 5; r >= 0; --r) {
+      __builtin_memmove(lines + r * stride, ps->p0 + r * old_stride, old_stride * sizeof(int));
+    }
+    if (lines != ps->p0) free_lines(ps->p0);
+  }
+  ps->p0 = lines;
+  ps->p1 = lines + stride;
+  ps->p2 = lines + stride * 2;
+  ps->p3 = lines + stride * 3;
+  ps->p4 = lines + stride * 4;
+  ps->p5 = lines + stride * 5;
+  ps->line_width = line_width;
+  return 0;
+}
+
+// Make cursor positions below width usable, lowers the cursor limit if the lines cannot grow.
+static inline void reserve_lines(ParserState *ps, int width) {
+  if (width > ps->line_width && grow_lines(ps, width)) {
+    ps->cursor_limit = ps->line_width < ps->cursor_limit ? ps->line_width : ps->cursor_limit;
+  }
+}
+
 
 /**
  * Pixel buffer reset handling clearing with fill_color.
  */
 
-// Clear next chunk in pixel buffers (m1). Hardcoded to 128px width.
-static inline void clear_next() {
-  long long *blueprint = (long long *) &ps.p0[ps.cleared_width];
-  for (int i = 0; i < 64; ++i) blueprint[i] = ps.fill_color;
-  __builtin_memcpy(&ps.p1[ps.cleared_width], blueprint, 512);
-  __builtin_memcpy(&ps.p2[ps.cleared_width], blueprint, 512);
-  __builtin_memcpy(&ps.p3[ps.cleared_width], blueprint, 512);
-  __builtin_memcpy(&ps.p4[ps.cleared_width], blueprint, 512);
-  __builtin_memcpy(&ps.p5[ps.cleared_width], blueprint, 512);
-  ps.cleared_width += 128;
+// Clear next chunk in pixel buffers (m1). Hardcoded to 128px width, grows the lines as needed.
+// Must only be called with cleared_width < cursor_limit.
+static inline void clear_next(ParserState *ps) {
+  if (ps->cleared_width + 124 > ps->line_width) {
+    reserve_lines(ps, ps->cleared_width + 124);
+    if (ps->cleared_width >= ps->cursor_limit) return;
+  }
+  STATS_ADD(ps, clears, 1);
+  long long *blueprint = (long long *) &ps->p0[ps->cleared_width];
+  for (int i = 0; i < 64; ++i) blueprint[i] = ps->fill_color;
+  __builtin_memcpy(&ps->p1[ps->cleared_width], blueprint, 512);
+  __builtin_memcpy(&ps->p2[ps->cleared_width], blueprint, 512);
+  __builtin_memcpy(&ps->p3[ps->cleared_width], blueprint, 512);
+  __builtin_memcpy(&ps->p4[ps->cleared_width], blueprint, 512);
+  __builtin_memcpy(&ps->p5[ps->cleared_width], blueprint, 512);
+  ps->cleared_width += 128;
 }
 
 // Clear pixel buffers for next line processing (m1). Hardcoded to 128px chunk.
-static inline void reset_line_m1() {
-  ps.real_width = 4;
-  ps.band_height = 0;
+static inline void reset_line_m1(ParserState *ps) {
+  ps->real_width = 4;
+  ps->band_height = 0;
+  STATS_ADD(ps, clears, 1);
 
   // fill 128 pixels in p0 as copy source
-  long long *blueprint = (long long *) &ps.p0[4];
-  for (int i = 0; i < 64; ++i) blueprint[i] = ps.fill_color;
+  long long *blueprint = (long long *) &ps->p0[4];
+  for (int i = 0; i < 64; ++i) blueprint[i] = ps->fill_color;
 
   // clear remaining in p0 .. p5
-  int parts128 = (ps.width + 127) / 128;
-  for (int i = 1; i < parts128; ++i) __builtin_memcpy(&ps.p0[4 + i * 128], blueprint, 512);
-  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps.p1[4 + i * 128], blueprint, 512);
-  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps.p2[4 + i * 128], blueprint, 512);
-  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps.p3[4 + i * 128], blueprint, 512);
-  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps.p4[4 + i * 128], blueprint, 512);
-  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps.p5[4 + i * 128], blueprint, 512);
+  int parts128 = (ps->width + 127) / 128;
+  for (int i = 1; i < parts128; ++i) __builtin_memcpy(&ps->p0[4 + i * 128], blueprint, 512);
+  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps->p1[4 + i * 128], blueprint, 512);
+  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps->p2[4 + i * 128], blueprint, 512);
+  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps->p3[4 + i * 128], blueprint, 512);
+  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps->p4[4 + i * 128], blueprint, 512);
+  for (int i = 0; i < parts128; ++i) __builtin_memcpy(&ps->p5[4 + i * 128], blueprint, 512);
 
-  ps.cleared_width = 4 + parts128 * 128;
+  ps->cleared_width = 4 + parts128 * 128;
 }
 
-// Clear pixel buffers for next line processing (m2). Clears ps.width pixels.
-static inline void reset_line_m2() {
-  long long *blueprint = (long long *) &ps.p0[4];
-  int l = (ps.width - 3) / 2;  // -4 because we added 4 in init, +1 for ceil in 8byte
-  for (int i = 0; i < l; ++i) blueprint[i] = ps.fill_color;
-  __builtin_memcpy(&ps.p1[4], blueprint, ps.width * 4);
-  __builtin_memcpy(&ps.p2[4], blueprint, ps.width * 4);
-  __builtin_memcpy(&ps.p3[4], blueprint, ps.width * 4);
-  __builtin_memcpy(&ps.p4[4], blueprint, ps.width * 4);
-  __builtin_memcpy(&ps.p5[4], blueprint, ps.width * 4);
+// Clear pixel buffers for next line processing (m2). Clears ps->width pixels.
+static inline void reset_line_m2(ParserState *ps) {
+  STATS_ADD(ps, clears, 1);
+  long long *blueprint = (long long *) &ps->p0[4];
+  int l = (ps->width - 3) / 2;  // -4 because we added 4 in init, +1 for ceil in 8byte
+  for (int i = 0; i < l; ++i) blueprint[i] = ps->fill_color;
+  __builtin_memcpy(&ps->p1[4], blueprint, ps->width * 4);
+  __builtin_memcpy(&ps->p2[4], blueprint, ps->width * 4);
+  __builtin_memcpy(&ps->p3[4], blueprint, ps->width * 4);
+  __builtin_memcpy(&ps->p4[4], blueprint, ps->width * 4);
+  __builtin_memcpy(&ps->p5[4], blueprint, ps->width * 4);
+}
+
+/**
+ * Thumbnail reduction (m2).
+ *
+ * Finished bands get reduced from the pixel lines into the thumbnail, either by taking
+ * every factor-th pixel of every factor-th row (nearest), or by averaging factor x factor boxes.
+ * Box rows may span several bands, their channel sums are kept in `t_sums` (alpha weighted,
+ * thus transparent pixels do not darken the colors), which stays below 2^32 for factors up to 256.
+ */
+
+// Write thumbnail row ty from box sums of `rows` source rows.
+static void put_box_row(ParserState *ps, const unsigned int *sums, int ty, int rows) {
+  const int f = ps->t_factor;
+  const int width = ps->width - 4;
+  int *out = ps->thumbnail + ty * ps->t_width;
+  for (int tx = 0; tx < ps->t_width; ++tx, sums += 4) {
+    const unsigned int cols = width - tx * f < f ? width - tx * f : f;
+    const unsigned int a = sums[3];
+    if (!a) {
+      out[tx] = 0;
+      continue;
+    }
+    const unsigned int r = (sums[0] + a / 2) / a;
+    const unsigned int g = (sums[1] + a / 2) / a;
+    const unsigned int b = (sums[2] + a / 2) / a;
+    const unsigned int count = cols * rows;
+    out[tx] = (int) (((a + count / 2) / count) << 24 | b << 16 | g << 8 | r);
+  }
 }
 
+// Reduce `rows` band rows starting at source row t_row. With commit the band is finished,
+// otherwise the rows are peeked with a copy of the box sums (band in progress).
+static void reduce_band(ParserState *ps, int rows, int commit) {
+  const int f = ps->t_factor;
+  const int width = ps->width - 4;
+  const int stride = ps->line_width + 4;
+  unsigned int *sums = ps->t_sums;
+  if (!commit) {
+    __builtin_memcpy(sums + ps->t_width * 4, sums, ps->t_width * 16);
+    sums += ps->t_width * 4;
+  }
+  int y = ps->t_row;
+  const int end = y + rows < ps->height ? y + rows : ps->height;
+  for (const int *line = ps->p0 + 4; y < end; ++y, line += stride) {
+    if (!ps->t_box) {
+      if (y % f == 0) {
+        int *out = ps->thumbnail + y / f * ps->t_width;
+        for (int tx = 0; tx < ps->t_width; ++tx) out[tx] = line[tx * f];
+      }
+      continue;
+    }
+    unsigned int *s = sums;
+    for (int x = 0; x < width; x += f, s += 4) {
+      const int x_end = x + f < width ? x + f : width;
+      for (int i = x; i < x_end; ++i) {
+        const unsigned int color = line[i];
+        const unsigned int a = color >> 24;
+        s[0] += (color & 0xFF) * a;
+        s[1] += (color >> 8 & 0xFF) * a;
+        s[2] += (color >> 16 & 0xFF) * a;
+        s[3] += a;
+      }
+    }
+    if ((y + 1) % f == 0 || y + 1 == ps->height) {
+      put_box_row(ps, sums, y / f, y % f + 1);
+      __builtin_memset(sums, 0, ps->t_width * 16);
+    }
+  }
+  if (commit) {
+    ps->t_row += 6;
+    ps->canvas_row = ps->t_row >= ps->height ? ps->t_height : ps->t_box ? ps->t_row / f : (ps->t_row + f - 1) / f;
+  } else if (ps->t_box && y % f && y < ps->height) {
+    // open box row of the band in progress, rows below hold fill_color (same as in the full image)
+    const int rows = y / f * f + f < ps->height ? f : ps->height - y / f * f;
+    const unsigned int fill = (unsigned int) ps->fill_color;
+    const unsigned int a = fill >> 24;
+    unsigned int *s = sums;
+    for (int x = 0; x < width; x += f, s += 4) {
+      const unsigned int n = (x + f < width ? f : width - x) * (rows - y % f) * a;
+      s[0] += (fill & 0xFF) * n;
+      s[1] += (fill >> 8 & 0xFF) * n;
+      s[2] += (fill >> 16 & 0xFF) * n;
+      s[3] += n;
+    }
+    put_box_row(ps, sums, y / f, rows);
+  }
+}
+
+
 /**
  * Decoders
  * 
@@ -253,115 +605,306 @@ static inline void reset_line_m2() {
  *            truncating excess pixels. While this is not 100% spec conform,
  *            it is what most ppl want. The optimization gives a 15-20% speed bonus.
  * 
+ * - m2 canvas: m2 painting directly into a caller provided canvas (see `decoder_set_canvas`)
+ *            Saves the band buffer clearing and copying, and the `handle_band` calls.
+ *            Decoding stops after the last band within the raster height.
+ * 
  * - raster:  decoder for raster attributes
  *            Decoder running first after init to determine, whether the image data
  *            contains raster attributes. Calls into m1 or m2 afterwards.
+ *
+ * m1, m2 and m2 canvas share the templated core `decode_sixels`, specialized at compile time
+ * on the variant and the output (colors or palette indices). The variant checks are constant
+ * in every instance, thus the hot loops carry no mode or output branches.
+ *
+ * The decoders run from c to c_end (exclusive) and return the position where they stopped.
+ * The byte at c_end must end the inner digit and sixel loops, which is either the sentinel
+ * written by `decoder_decode`, or a command byte in caller data (see `decoder_decode_buffer`).
+ * Such a command byte might get processed already, then the returned position is c_end + 1.
  */
 
-void decode_raster(int start, int end);
-void decode_m1(int start, int end);
-void decode_m2(int start, int end);
+// Internal band handlers of the arena canvas (see `decoder_set_arena`).
+static int arena_handle_band(ParserState *ps, int width);
+static int arena_mode_parsed(ParserState *ps, int mode);
+
+// Embedder callbacks (or the arena handlers), timed with DECODER_STATS.
+static inline int call_handle_band(ParserState *ps, int width) {
+  if (ps->arena) return arena_handle_band(ps, width);
+#ifdef DECODER_STATS
+  const unsigned long long start = stats_clock();
+  const int result = ps->handle_band(ps->user_data, width);
+  ps->stats.band_cycles += stats_clock() - start;
+  return result;
+#else
+  return ps->handle_band(ps->user_data, width);
+#endif
+}
+
+static inline int call_mode_parsed(ParserState *ps, int mode) {
+  if (ps->arena) return arena_mode_parsed(ps, mode);
+#ifdef DECODER_STATS
+  const unsigned long long start = stats_clock();
+  const int result = ps->mode_parsed(ps->user_data, mode);
+  ps->stats.mode_cycles += stats_clock() - start;
+  return result;
+#else
+  return ps->mode_parsed(ps->user_data, mode);
+#endif
+}
+
+// Whether the work spent exceeds any limit of the budget.
+static inline int budget_exceeded(const ParserState *ps) {
+  return (ps->budget_pixels && ps->work_pixels > ps->budget_pixels)
+    || (ps->budget_bands && ps->work_bands > ps->budget_bands)
+    || (ps->budget_overdraws && ps->work_overdraws > ps->budget_overdraws);
+}
+
+// Account a finished band pass (CR or LF) with the pixels up to the cursor,
+// returns 1 if the work budget is exceeded. Not called per byte, thus the sixel loops stay untouched.
+static inline int over_budget(ParserState *ps, int cursor, int limit, int lf) {
+  // the cursor stays in 4 .. limit (see `advance`), clamped again to never account a wrapped extent
+  const int end = cursor < limit ? cursor : limit;
+  const unsigned int extent = end > 4 ? end - 4 : 0;
+  ps->work_pixels += extent * 6ULL;
+  if (lf) ps->work_bands++;
+  else ps->work_overdraws++;
+  return budget_exceeded(ps);
+}
+
+// Decoding stopped for good (DEC_ABORT_COMPLETE still applies color commands).
+static inline int stopped(const ParserState *ps) {
+  return ps->abort && ps->abort != DEC_ABORT_COMPLETE;
+}
+
+// Stop decoding for reason (DEC_ABORT_*), the cursor gets reset to keep `current_width` sane.
+static inline const char *abort_decoding(ParserState *ps, int reason, const char *c_end) {
+  ps->abort = reason;
+  ps->cursor = 4;
+  if (ps->mode == M1) ps->real_width = 4;
+  return c_end;
+}
+
+// Painting helpers of the decoder variants. Band lines are taken from ps (they may move in m1),
+// the canvas band is given by band and stride. limit is the cursor limit.
+// m1 reads the cursor limit from ps, it drops if the lines cannot grow
+template <int VARIANT>
+static inline int cursor_limit(const ParserState *ps, int width) {
+  return VARIANT == V_M1 ? ps->cursor_limit : width;
+}
+
+// Move the cursor n sixels forward, but not beyond limit (nothing gets painted there),
+// thus the cursor stays in 4 .. limit and repeats and SIMD runs cannot wrap it.
+static inline int advance(int cur, unsigned int n, int limit) {
+  return cur < limit ? (n < unsigned(limit - cur) ? cur + (int) n : limit) : cur;
+}
+
+template <int VARIANT>
+static inline void paint_single(ParserState *ps, int *band, int stride, unsigned int code, int color,
+                                unsigned int cursor, unsigned int limit) {
+  if (VARIANT == V_M2_CANVAS) put_single_canvas(band, stride, code, color, cursor, limit);
+  else put_single(ps, code, color, cursor, limit);
+}
+
+template <int VARIANT>
+static inline void paint(ParserState *ps, int *band, int stride, int code, int color,
+                         unsigned int n, unsigned int cursor, unsigned int limit) {
+  if (VARIANT == V_M2_CANVAS) put_canvas(band, stride, code, color, n, cursor, limit);
+  else put(ps, code, color, n, cursor, limit);
+}
+
+#ifdef SIMD_WIDTH
+template <int VARIANT>
+static inline void paint_simd(ParserState *ps, int *band, int stride, sixel_pack pack, int color, int cursor) {
+  if (VARIANT == V_M2_CANVAS) put_simd(band + cursor, stride, pack, color);
+  else put_simd(ps->p0 + cursor, ps->line_width + 4, pack, color);
+}
+#endif
 
-typedef void (*decode_func)(int, int);
-static const decode_func DECODERS[3] = { &decode_raster, &decode_m1, &decode_m2 };
+// OR of the sixel codes of a run (M1 band height).
+static inline int run_bits(const char *src, int length) {
+  int bits = 0;
+  for (int i = 0; i < length; ++i) bits |= (src[i] & 0x7F) - 63;
+  return bits & 63;
+}
+
+#ifdef DECODER_SPANS
+/**
+ * Deferred painting (`decoder_set_spans`, DECODER_SPANS only).
+ *
+ * The line decoders record the sixels of the band as spans instead of painting them.
+ * `resolve_spans` walks the spans backwards and only paints the sixel bits no later span
+ * has painted (`span_rows` holds the resolved rows per cursor position), thus every pixel
+ * gets written once per resolve, however often the band overdraws it. Runs of single sixels
+ * keep their codes, a run continues over short repeats (up to SPAN_REPEAT) and later runs
+ * in the same color that start at its end, thus a color pass over the band mostly ends up
+ * in one span. Longer repeats are stored with their mask, or dropped without any bit set.
+ * The spans get resolved at LF, for full span buffers and by `decoder_flush_spans`.
+ */
+
+// Copy sixel codes (without offset) of a run to dst.
+static inline void record_codes(unsigned char *__restrict dst, const char *__restrict src, int length) {
+  for (int i = 0; i < length; ++i) dst[i] = (src[i] & 0x7F) - 63;
+}
+
+// Paint row r of a run where no later span has painted yet.
+static inline void resolve_run(int *__restrict p, unsigned char *__restrict done,
+                               const unsigned char *__restrict codes, int length, int color, int r) {
+  for (int i = 0; i < length; ++i) {
+    const int bit = (codes[i] & ~done[i]) >> r & 1;
+    p[i] = bit ? color : p[i];
+    done[i] |= bit << r;
+  }
+}
+
+// Paint row r of a repeat where no later span has painted yet.
+static inline void resolve_fill(int *__restrict p, unsigned char *__restrict done, int length, int color, int r) {
+  for (int i = 0; i < length; ++i) {
+    const int bit = ~done[i] >> r & 1;
+    p[i] = bit ? color : p[i];
+    done[i] |= bit << r;
+  }
+}
+
+static void resolve_spans(ParserState *ps) {
+  if (!ps->span_length) return;
+  const BandSpan *first = ps->span;
+  const BandSpan *last = ps->span + ps->span_length - 1;
+  int start = first->cursor;
+  int end = first->cursor + first->length;
+  for (const BandSpan *s = first; s <= last; ++s) {
+    start = s->cursor < start ? s->cursor : start;
+    end = s->cursor + s->length > end ? s->cursor + s->length : end;
+  }
+  __builtin_memset(ps->span_rows + start, 0, end - start);
+  const int stride = ps->line_width + 4;
+  for (int r = 0; r < 6; ++r) {
+    int *row = ps->p0 + r * stride;
+    for (const BandSpan *s = last; s >= first; --s) {
+      if (!s->mask) {
+        resolve_run(row + s->cursor, ps->span_rows + s->cursor, ps->span_codes + s->codes, s->length, s->color, r);
+      } else if (s->mask >> r & 1) {
+        resolve_fill(row + s->cursor, ps->span_rows + s->cursor, s->length, s->color, r);
+      }
+    }
+  }
+  ps->span_length = 0;
+  ps->code_length = 0;
+}
+
+static inline BandSpan *open_span(ParserState *ps, int cursor, int color, int mask) {
+  if (ps->span_length == SPAN_SIZE) resolve_spans(ps);
+  BandSpan *s = &ps->span[ps->span_length++];
+  s->cursor = cursor;
+  s->length = 0;
+  s->color = color;
+  s->mask = mask;
+  s->codes = ps->code_length;
+  return s;
+}
+
+// Code buffer for length (<= SPAN_CODES) sixels at cursor, continues the last span
+// if it is a run ending at cursor in the same color.
+static inline unsigned char *run_codes(ParserState *ps, int cursor, int color, int length) {
+  if (ps->code_length + length > SPAN_CODES) resolve_spans(ps);
+  BandSpan *s = ps->span_length ? &ps->span[ps->span_length - 1] : 0;
+  if (!s || s->mask || s->color != color || s->cursor + s->length != cursor) {
+    s = open_span(ps, cursor, color, 0);
+  }
+  unsigned char *codes = ps->span_codes + ps->code_length;
+  s->length += length;
+  ps->code_length += length;
+  return codes;
+}
+
+// Record a run of single sixels from cursor, up to limit.
+static inline void defer_run(ParserState *ps, const char *run, int color, int n, int cursor, int limit) {
+  n = cursor < limit ? (n < limit - cursor ? n : limit - cursor) : 0;
+  while (n) {
+    const int length = n < SPAN_CODES ? n : SPAN_CODES;
+    record_codes(run_codes(ps, cursor, color, length), run, length);
+    run += length;
+    cursor += length;
+    n -= length;
+  }
+}
 
+// Record a repeated sixel from cursor, up to limit.
+static inline void defer_repeat(ParserState *ps, int code, int color, unsigned int n, int cursor, int limit) {
+  if (cursor >= limit) return;
+  const int length = n < unsigned(limit - cursor) ? n : limit - cursor;
+  if (length <= SPAN_REPEAT) {
+    unsigned char *codes = run_codes(ps, cursor, color, length);
+    for (int i = 0; i < length; ++i) codes[i] = code;
+  } else if (code) {
+    open_span(ps, cursor, color, code)->length = length;
+  }
+}
+#else
+// without DECODER_SPANS only the eager line decoders get instantiated (SPANS = 0)
+static inline void resolve_spans(ParserState *) {}
+static inline void defer_run(ParserState *, const char *, int, int, int, int) {}
+static inline void defer_repeat(ParserState *, int, int, unsigned int, int, int) {}
+#endif
 
-void decode_m1(int start, int end) {
-  int cur = ps.cursor;
-  int state = ps.state;
-  int color = ps.color;
-  char *c = &ps.chunk[start];
-  char *c_end = &ps.chunk[end];
-  *c_end = 0xFF;
+// Decoder behind a complete direct canvas or thumbnail (DEC_ABORT_COMPLETE): sixels, CR and LF
+// are skipped, but color commands still get applied, thus the palette ends up as with the band path.
+template <int INDEXED>
+static const char *decode_colors(ParserState *ps, const char *c, const char *c_end) {
+  int state = ps->state;
+  int color = ps->color;
   while (c < c_end) {
     int code = *c++ & 0x7F;
-
-    // digits
     if (unsigned(code - 48) < 10) {
-      int *p = &ps.params[ps.p_length - 1];
+      int *p = &ps->params[ps->p_length - 1];
       do {
         *p = *p * 10 + code - 48;
         code = *c++ & 0x7F;
       } while (unsigned(code - 48) < 10);
     }
-
-    // sixels
+    // same byte handling as `decode_sixels`, the byte behind a sixel run is taken as command
     if (unsigned(code - 63) < 64) {
-      if (state != ST_DATA) {
-        if (state == ST_COMPRESSION) {
-          int k = ps.params[0] ? ps.params[0] : 1;
-          while (cur + k >= ps.cleared_width && ps.cleared_width < MAX_WIDTH) clear_next();
-          put(code - 63, color, k, cur);
-          ps.band_height |= code - 63;
-          cur += k;
-          code = *c++ & 0x7F;
-        } else {
-          color = apply_color(color);
-        }
-        state = ST_DATA;
+      if (state == ST_COLOR) {
+        count_color(ps);
+        color = apply_color<INDEXED>(ps, color);
       }
-      while (unsigned(code - 63) < 64) {
-        if (cur >= ps.cleared_width && ps.cleared_width < MAX_WIDTH) clear_next();  // FIXME: MAX_WIDTH is exp here
-        put_single(code - 63, color, cur++);
-        ps.band_height |= code - 63;
-        code = *c++ & 0x7F;
-      };
+      state = ST_DATA;
+      do code = *c++ & 0x7F; while (unsigned(code - 63) < 64);
     }
-
-    // compression and color
     if (code == ST_COMPRESSION || code == ST_COLOR) {
-      if (state == ST_COLOR) color = apply_color(color);
-      ps.params[0] = 0;
-      ps.p_length = 1;
-      state = code;
-    } else
-
-    // CR and LF
-    if (code == '$') {
-      ps.real_width = cur > ps.real_width ? cur : ps.real_width;
-      ps.real_width = ps.real_width < MAX_WIDTH ? ps.real_width : MAX_WIDTH;
-      cur = 4;
-    } else
-    if (code == '-') {
-      ps.real_width = cur > ps.real_width ? cur : ps.real_width;
-      ps.real_width = ps.real_width < MAX_WIDTH ? ps.real_width : MAX_WIDTH;
-      ps.cursor = ps.real_width;  // explicit update to avoid conflicts if current_width() is called in handle_band
-      if (handle_band(ps.real_width - 4)) {
-        ps.abort = 1;
-        ps.cursor = ps.real_width = 4;  // same - to fix current_width() after breaking
-        return;
+      if (state == ST_COLOR) {
+        count_color(ps);
+        color = apply_color<INDEXED>(ps, color);
       }
-      reset_line_m1();
-      cur = 4;
+      ps->params[0] = 0;
+      ps->p_length = 1;
+      state = code;
     } else
-
-    // new param
     if (code == ';') {
-      if (ps.p_length < PARAM_SIZE) {
-        ps.params[ps.p_length++] = 0;
+      if (ps->p_length < PARAM_SIZE) {
+        ps->params[ps->p_length++] = 0;
       }
     }
-
   }
-  ps.cursor = cur;
-  ps.state = state;
-  ps.color = color;
+  ps->state = state;
+  ps->color = color;
+  return c;
 }
 
-
-void decode_m2(int start, int end) {
-  int cur = ps.cursor;
-  int state = ps.state;
-  int color = ps.color;
-  char *c = &ps.chunk[start];
-  char *c_end = &ps.chunk[end];
-  *c_end = 0xFF;
+template <int VARIANT, int INDEXED, int SPANS>
+static const char *decode_sixels(ParserState *ps, const char *c, const char *c_end) {
+  int cur = ps->cursor;
+  int state = ps->state;
+  int color = ps->color;
+  const int width = ps->width;
+  // canvas band, shifted by -4 to be indexed by cursor
+  const int stride = width - 4;
+  int *band = VARIANT == V_M2_CANVAS ? ps->canvas + ps->canvas_row * stride - 4 : 0;
   while (c < c_end) {
     int code = *c++ & 0x7F;
 
     // digits
     if (unsigned(code - 48) < 10) {
-      int *p = &ps.params[ps.p_length - 1];
+      int *p = &ps->params[ps->p_length - 1];
       do {
         *p = *p * 10 + code - 48;
         code = *c++ & 0x7F;
@@ -372,118 +915,271 @@ void decode_m2(int start, int end) {
     if (unsigned(code - 63) < 64) {
       if (state != ST_DATA) {
         if (state == ST_COMPRESSION) {
-          int k = ps.params[0] ? ps.params[0] : 1;
-          put(code - 63, color, k, cur);
+          unsigned int k = ps->params[0] ? ps->params[0] : 1;
+          STATS_ADD(ps, repeats, 1);
+          STATS_ADD(ps, repeat_length, k);
+          // the repeat stops at the cursor limit, thus huge counts cannot wrap the cursor
+          // (the cursor may already sit beyond a limit lowered by failed line growth)
+          const int limit = cursor_limit<VARIANT>(ps, width);
+          k = cur < limit ? (k < unsigned(limit - cur) ? k : limit - cur) : 0;
+          if (VARIANT == V_M1) {
+            while (cur + (int) k >= ps->cleared_width && ps->cleared_width < ps->cursor_limit) clear_next(ps);
+            ps->band_height |= code - 63;
+          }
+          if (SPANS) defer_repeat(ps, code - 63, color, k, cur, cursor_limit<VARIANT>(ps, width));
+          else paint<VARIANT>(ps, band, stride, code - 63, color, k, cur, cursor_limit<VARIANT>(ps, width));
           cur += k;
           code = *c++ & 0x7F;
         } else {
-          color = apply_color(color);
+          count_color(ps);
+          color = apply_color<INDEXED>(ps, color);
         }
         state = ST_DATA;
       }
+      if (SPANS) {
+        // record the run up to the cursor limit
+        const char *run = --c;
+        while (unsigned((*c & 0x7F) - 63) < 64) c++;
+        const int n = c - run;
+        STATS_ADD(ps, sixels, n);
+        if (VARIANT == V_M1) {
+          while (cur + n > ps->cleared_width && ps->cleared_width < ps->cursor_limit) clear_next(ps);
+          ps->band_height |= run_bits(run, n);
+        }
+        defer_run(ps, run, color, n, cur, cursor_limit<VARIANT>(ps, width));
+        cur = advance(cur, n, cursor_limit<VARIANT>(ps, width));
+        code = *c++ & 0x7F;
+      } else
       while (unsigned(code - 63) < 64) {
-        put_single(code - 63, color, cur++);
+#ifdef SIMD_WIDTH
+        int n = sixel_run(--c);
+        STATS_ADD(ps, sixels, n);
+        for (; n >= SIMD_WIDTH && cur + SIMD_WIDTH <= cursor_limit<VARIANT>(ps, width); n -= SIMD_WIDTH) {
+          sixel_pack pack = load_sixels(c);
+          if (VARIANT == V_M1) {
+            while (cur + SIMD_WIDTH > ps->cleared_width && ps->cleared_width < ps->cursor_limit) clear_next(ps);
+            if (cur + SIMD_WIDTH > ps->cursor_limit) break;  // lines could not grow
+            ps->band_height |= pack_or(pack);
+          }
+          paint_simd<VARIANT>(ps, band, stride, pack, color, cur);
+          cur += SIMD_WIDTH;
+          c += SIMD_WIDTH;
+        }
+        for (; n; --n) {
+          code = *c++ & 0x7F;
+          if (VARIANT == V_M1) {
+            if (cur >= ps->cleared_width && ps->cleared_width < ps->cursor_limit) clear_next(ps);
+            ps->band_height |= code - 63;
+          }
+          paint_single<VARIANT>(ps, band, stride, code - 63, color, cur, cursor_limit<VARIANT>(ps, width));
+          cur = advance(cur, 1, cursor_limit<VARIANT>(ps, width));
+        }
+        code = *c++ & 0x7F;
+#else
+        STATS_ADD(ps, sixels, 1);
+        if (VARIANT == V_M1) {
+          if (cur >= ps->cleared_width && ps->cleared_width < ps->cursor_limit) clear_next(ps);
+          ps->band_height |= code - 63;
+        }
+        paint_single<VARIANT>(ps, band, stride, code - 63, color, cur, cursor_limit<VARIANT>(ps, width));
+        cur = advance(cur, 1, cursor_limit<VARIANT>(ps, width));
         code = *c++ & 0x7F;
+#endif
       };
     }
 
     // compression and color
     if (code == ST_COMPRESSION || code == ST_COLOR) {
-      if (state == ST_COLOR) color = apply_color(color);
-      ps.params[0] = 0;
-      ps.p_length = 1;
+      if (state == ST_COLOR) {
+        count_color(ps);
+        color = apply_color<INDEXED>(ps, color);
+      }
+      ps->params[0] = 0;
+      ps->p_length = 1;
       state = code;
     } else
 
     // CR and LF
     if (code == '$') {
+      STATS_ADD(ps, crs, 1);
+      if (over_budget(ps, cur, cursor_limit<VARIANT>(ps, width), 0)) return abort_decoding(ps, DEC_ABORT_BUDGET, c_end);
+      if (VARIANT == V_M1) {
+        ps->real_width = cur > ps->real_width ? cur : ps->real_width;
+        ps->real_width = ps->real_width < ps->cursor_limit ? ps->real_width : ps->cursor_limit;
+      }
       cur = 4;
     } else
     if (code == '-') {
-      if (handle_band(ps.width - 4)) {
-        ps.abort = 1;
-        return;
+      STATS_ADD(ps, bands, 1);
+      if (over_budget(ps, cur, cursor_limit<VARIANT>(ps, width), 1)) return abort_decoding(ps, DEC_ABORT_BUDGET, c_end);
+      if (SPANS) resolve_spans(ps);
+      if (VARIANT == V_M1) {
+        ps->real_width = cur > ps->real_width ? cur : ps->real_width;
+        ps->real_width = ps->real_width < ps->cursor_limit ? ps->real_width : ps->cursor_limit;
+        ps->cursor = ps->real_width;  // explicit update to avoid conflicts if current_width() is called in handle_band
+        if (call_handle_band(ps, ps->real_width - 4)) {
+          // the arena handlers only fail for a full arena
+          ps->abort = ps->arena ? DEC_ABORT_MEMORY : DEC_ABORT_CALLBACK;
+          ps->cursor = ps->real_width = 4;  // same - to fix current_width() after breaking
+          return c_end;
+        }
+        reset_line_m1(ps);
+      } else if (VARIANT == V_M2) {
+        if (ps->thumbnail) {
+          reduce_band(ps, 6, 1);
+          if (ps->t_row >= ps->height) {
+            // thumbnail is complete, same as for the canvas
+            ps->abort = DEC_ABORT_COMPLETE;
+            ps->cursor = 4;
+            ps->state = state;
+            ps->color = color;
+            return decode_colors<INDEXED>(ps, c, c_end);
+          }
+        } else if (call_handle_band(ps, ps->width - 4)) {
+          ps->abort = ps->arena ? DEC_ABORT_MEMORY : DEC_ABORT_CALLBACK;
+          return c_end;
+        }
+        reset_line_m2(ps);
+      } else {
+        ps->canvas_row += 6;
+        if (ps->canvas_row >= ps->height) {
+          // canvas is full, further sixels would be truncated anyway, only colors get applied
+          ps->abort = DEC_ABORT_COMPLETE;
+          ps->cursor = 4;
+          ps->state = state;
+          ps->color = color;
+          return decode_colors<INDEXED>(ps, c, c_end);
+        }
+        band += stride * 6;
       }
-      reset_line_m2();
       cur = 4;
     } else
 
     // new param
     if (code == ';') {
-      if (ps.p_length < PARAM_SIZE) {
-        ps.params[ps.p_length++] = 0;
+      if (ps->p_length < PARAM_SIZE) {
+        ps->params[ps->p_length++] = 0;
       }
     }
 
   }
-  ps.cursor = cur;
-  ps.state = state;
-  ps.color = color;
+  ps->cursor = cur;
+  ps->state = state;
+  ps->color = color;
+  return c;
+}
+
+static const char *decode_raster(ParserState *ps, const char *c, const char *c_end);
+
+typedef const char *(*decode_func)(ParserState *, const char *, const char *);
+
+// Line decoder of a variant for the output and painting (eager or deferred).
+template <int VARIANT>
+static inline decode_func line_decoder(const ParserState *ps) {
+#ifdef DECODER_SPANS
+  // `span_rows` covers cursor positions up to MAX_WIDTH
+  if (ps->spans && ps->cursor_limit <= MAX_WIDTH) {
+    return ps->indexed ? &decode_sixels<VARIANT, 1, 1> : &decode_sixels<VARIANT, 0, 1>;
+  }
+#endif
+  return ps->indexed ? &decode_sixels<VARIANT, 1, 0> : &decode_sixels<VARIANT, 0, 0>;
 }
 
+// Decoder for the current mode and output, M2 with a canvas set paints directly
+// (the canvas is never set in indexed mode). A complete canvas or thumbnail only takes colors.
+static inline decode_func get_decoder(ParserState *ps) {
+  if (ps->abort == DEC_ABORT_COMPLETE) return ps->indexed ? &decode_colors<1> : &decode_colors<0>;
+  if (ps->mode == M1) return line_decoder<V_M1>(ps);
+  if (ps->mode == M2) {
+    if (ps->canvas) return &decode_sixels<V_M2_CANVAS, 0, 0>;
+    return line_decoder<V_M2>(ps);
+  }
+  return &decode_raster;
+}
 
-void decode_raster(int start, int end) {
-  char *c = &ps.chunk[start];
-  char *c_end = &ps.chunk[end];
+// Parse raster attributes in chunk, returns the settled mode (M0 if still undecided).
+static int parse_raster(ParserState *ps, const char *c, const char *c_end) {
   while (c < c_end) {
     int code = *c++ & 0x7F;
-    if (ps.state == ST_DATA) {
+    if (ps->state == ST_DATA) {
       if (code == ST_ATTR) {
-        ps.params[0] = 0;
-        ps.p_length = 1;
-        ps.state = ST_ATTR;
+        ps->params[0] = 0;
+        ps->p_length = 1;
+        ps->state = ST_ATTR;
       } else
       if (unsigned(code - 63) < 64 || code == 33 || code == 35 || code == 36 || code == 45) {
-        ps.level = LV1;
-        ps.mode = M1;
-        ps.r_num = 0;
-        ps.r_denom = 0;
-        ps.r_width = 0;
-        ps.r_height = 0;
+        ps->level = LV1;
+        ps->mode = M1;
+        ps->r_num = 0;
+        ps->r_denom = 0;
+        ps->r_width = 0;
+        ps->r_height = 0;
         break;
       }
     } else
-    if (ps.state == ST_ATTR) {
+    if (ps->state == ST_ATTR) {
       if (unsigned(code - 48) < 10) {
-        ps.params[ps.p_length - 1] = ps.params[ps.p_length - 1] * 10 + code - 48;
+        ps->params[ps->p_length - 1] = ps->params[ps->p_length - 1] * 10 + code - 48;
       } else
       if (code == ';') {
-        if (ps.p_length < PARAM_SIZE) {
-          ps.params[ps.p_length++] = 0;
+        if (ps->p_length < PARAM_SIZE) {
+          ps->params[ps->p_length++] = 0;
         }
       } else
-      if (ps.p_length == 4) {
-        ps.level = LV2;
-        ps.mode = ps.truncate ? M2 : M1;
-        ps.r_num = ps.params[0];
-        ps.r_denom = ps.params[1];
-        ps.r_width = ps.params[2];    // investigate: Should omitted P3/P4 default to 1 as well?
-        ps.r_height = ps.params[3];
-        ps.state = ST_DATA;
-        ps.width = ps.truncate ? (ps.r_width < MAX_WIDTH ? ps.r_width : MAX_WIDTH) + 4 : 0;
-        ps.height = ps.truncate ? ps.r_height : 0;
+      if (ps->p_length == 4) {
+        ps->level = LV2;
+        ps->mode = ps->truncate ? M2 : M1;
+        ps->r_num = ps->params[0];
+        ps->r_denom = ps->params[1];
+        ps->r_width = ps->params[2];    // investigate: Should omitted P3/P4 default to 1 as well?
+        ps->r_height = ps->params[3];
+        ps->state = ST_DATA;
+        ps->width = ps->truncate ? (ps->r_width < ps->cursor_limit - 4 ? ps->r_width : ps->cursor_limit - 4) + 4 : 0;
+        ps->height = ps->truncate ? ps->r_height : 0;
         break;
       }
       // error   : some image have broken raster attributes defining not all values, e.g. "1;1 ...
       // recovery: set mode to M1, save any seen attributes, reset to state ST_DATA  
       if (unsigned(code - 63) < 64 || code == 33 || code == 35 || code == 36 || code == 45) {
-        ps.level = LV1;
-        ps.mode = M1;
-        ps.r_num = ps.p_length > 0 ? ps.params[0] : 0;
-        ps.r_denom = ps.p_length > 1 ? ps.params[1] : 0;
-        ps.r_width = ps.p_length > 2 ? ps.params[2] : 0;
-        ps.r_height = 0;
-        ps.state = ST_DATA;
+        ps->level = LV1;
+        ps->mode = M1;
+        ps->r_num = ps->p_length > 0 ? ps->params[0] : 0;
+        ps->r_denom = ps->p_length > 1 ? ps->params[1] : 0;
+        ps->r_width = ps->p_length > 2 ? ps->params[2] : 0;
+        ps->r_height = 0;
+        ps->state = ST_DATA;
         break;
       }
     }
   }
-  if (ps.mode) {
-    if (ps.mode == M2) reset_line_m2();
-    else reset_line_m1();
-    ps.abort = mode_parsed(ps.mode);
-    if (!ps.abort) DECODERS[ps.mode](start, end);
+  return ps->mode;
+}
+
+// Prepare pixel buffers for the settled mode and announce it to the embedder.
+// The lines get sized from the raster width (M1 grows them further on demand).
+static void settle_mode(ParserState *ps) {
+  // color commands start with the settled mode, the embedder may have set the palette after init
+  convert_palette(ps);
+  if (ps->mode == M2) {
+    reserve_lines(ps, ps->width);
+    if (ps->width > ps->cursor_limit) ps->width = ps->cursor_limit;
+    reset_line_m2(ps);
+  } else {
+    if (ps->level == LV2) reserve_lines(ps, ps->r_width + 4 < ps->cursor_limit ? ps->r_width + 4 : ps->cursor_limit);
+    reset_line_m1(ps);
+  }
+  ps->abort = !call_mode_parsed(ps, ps->mode)
+    ? DEC_ABORT_NONE
+    : ps->arena ? DEC_ABORT_MEMORY : DEC_ABORT_CALLBACK;
+}
+
+static const char *decode_raster(ParserState *ps, const char *c, const char *c_end) {
+  if (parse_raster(ps, c, c_end)) {
+    settle_mode(ps);
+    // decoding restarts at chunk start, the raster attributes are ignored by m1/m2
+    if (!ps->abort) return get_decoder(ps)(ps, c, c_end);
   }
+  return c_end;
 }
 
 
@@ -491,50 +1187,811 @@ void decode_raster(int start, int end) {
  * API functions.
  */
 
+// Register embedder callbacks. Must be called once before any decoding happens.
+void decoder_set_callbacks(ParserState *ps, band_handler handle_band, mode_handler mode_parsed, void *user_data) {
+  ps->handle_band = handle_band;
+  ps->mode_parsed = mode_parsed;
+  ps->user_data = user_data;
+}
+
+// Limit the image width to max_width pixels (applies at the next `decoder_init`).
+void decoder_set_max_width(ParserState *ps, int max_width) {
+  max_width = max_width < 1 ? 1 : max_width < (1 << 24) ? max_width : (1 << 24);
+  ps->max_width = max_width + 4;
+}
+
+// Limit the work per image (0 - unlimited), the spent work gets reset by `decoder_init`.
+// pixels counts the cursor extent of every band pass (CR or LF) times 6, bands the LFs and overdraws the CRs.
+void decoder_set_budget(ParserState *ps, unsigned int pixels, unsigned int bands, unsigned int overdraws) {
+  ps->budget_pixels = pixels;
+  ps->budget_bands = bands;
+  ps->budget_overdraws = overdraws;
+}
+
+#ifdef DECODER_SPANS
+// Paint the line decoders deferred from band spans (1) or eagerly (0), can be switched between decode calls.
+// Not used for a max width beyond MAX_WIDTH.
+void decoder_set_spans(ParserState *ps, int spans) {
+  resolve_spans(ps);
+  ps->spans = spans ? 1 : 0;
+}
+
+// Paint the recorded spans of the band in progress into the pixel lines
+// (before reading the lines outside of `handle_band`, e.g. at the end of the data).
+void decoder_flush_spans(ParserState *ps) {
+  resolve_spans(ps);
+}
+#endif
+
+// Free the pixel lines (wasm: mark as unused), they get allocated again by `decoder_init`.
+void decoder_release(ParserState *ps) {
+  if (ps->line_width) free_lines(ps->p0);
+  ps->p0 = ps->p1 = ps->p2 = ps->p3 = ps->p4 = ps->p5 = 0;
+  ps->line_width = 0;
+}
+
 // Initialize parser state for new SIXEL image.
-void init(int sixel_color, int fill_color, unsigned int palette_length, int truncate) {
-  ps.state = ST_DATA;
-  ps.color = sixel_color;
-  ps.cursor = 4;
-  ps.palette_length = (palette_length < PALETTE_SIZE) ? palette_length : PALETTE_SIZE;
-  ps.params[0] = 0;
-  ps.p_length = 1;
-  ps.truncate = truncate;
-  ps.level = LV0;
-  ps.mode = M0;
-  ps.state = ST_DATA;
-  ps.fill_color = ((unsigned long long) fill_color) << 32 | (unsigned int) fill_color;
-  ps.r_num = 0;
-  ps.r_denom = 0;
-  ps.r_width = 0;
-  ps.r_height = 0;
-  ps.width = 0;
-  ps.height = 0;
-  ps.band_height = 0;
-  ps.abort = 0;
-}
-
-// Decode data in ps.chunk from start to end (exclusive).
-void decode(int start, int end) {
-  if (ps.abort) return;
-  DECODERS[ps.mode](start, end);
+// format selects the output pixel format (DEC_*), sixel_color and fill_color are given as RGBA8888,
+// or as palette indices for DEC_INDEXED.
+void decoder_init(ParserState *ps, int sixel_color, int fill_color, unsigned int palette_length, int truncate, int format) {
+  ps->format = format;
+  ps->indexed = format == DEC_INDEXED;
+  ps->colors = ps->palette;
+  if (!ps->indexed) {
+    sixel_color = convert_color(format, sixel_color);
+    fill_color = convert_color(format, fill_color);
+  }
+  ps->state = ST_DATA;
+  ps->color = sixel_color;
+  ps->cursor = 4;
+  ps->palette_length = (palette_length < PALETTE_SIZE) ? palette_length : PALETTE_SIZE;
+  ps->params[0] = 0;
+  ps->p_length = 1;
+  ps->truncate = truncate;
+  ps->level = LV0;
+  ps->mode = M0;
+  ps->state = ST_DATA;
+  ps->fill_color = ((unsigned long long) fill_color) << 32 | (unsigned int) fill_color;
+  ps->r_num = 0;
+  ps->r_denom = 0;
+  ps->r_width = 0;
+  ps->r_height = 0;
+  ps->width = 0;
+  ps->height = 0;
+  ps->band_height = 0;
+  ps->abort = DEC_ABORT_NONE;
+  ps->canvas = 0;
+  ps->canvas_row = 0;
+  ps->thumbnail = 0;
+  ps->t_row = 0;
+  ps->arena = 0;
+  ps->work_pixels = 0;
+  ps->work_bands = 0;
+  ps->work_overdraws = 0;
+#ifdef DECODER_SPANS
+  ps->span_length = 0;
+  ps->code_length = 0;
+#endif
+#ifdef DECODER_STATS
+  __builtin_memset(&ps->stats, 0, sizeof(ps->stats));
+#endif
+  if (!ps->max_width) ps->max_width = MAX_WIDTH;
+  ps->cursor_limit = ps->max_width;
+  // minimal lines for M1 clearing (128 pixels)
+  if (grow_lines(ps, 128)) ps->abort = DEC_ABORT_MEMORY;
+}
+
+// Set canvas for direct painting in M2, to be called from `mode_parsed`.
+// The canvas must hold width * height pixels with height rounded up to a multiple of 6,
+// it gets filled with fill_color. Returns 1 if not in M2, in indexed mode or for empty images
+// (canvas not used), else 0.
+int decoder_set_canvas(ParserState *ps, int *canvas) {
+  if (ps->mode != M2 || ps->indexed || ps->width <= 4 || !ps->height) return 1;
+  ps->canvas = canvas;
+  ps->canvas_row = 0;
+  ps->thumbnail = 0;
+  int length = (ps->width - 4) * ((ps->height + 5) / 6 * 6);
+  int fill_color = (int) ps->fill_color;
+  for (int i = 0; i < length; ++i) canvas[i] = fill_color;
+  return 0;
+}
+
+// Ints needed for a thumbnail reduced by factor (pixels plus box sums), 0 if not in M2.
+int decoder_thumbnail_length(ParserState *ps, int factor) {
+  if (ps->mode != M2 || ps->width <= 4 || factor < 1 || factor > 256) return 0;
+  const int t_width = (ps->width - 4 + factor - 1) / factor;
+  return t_width * ((ps->height + factor - 1) / factor) + t_width * 8;
+}
+
+// Set canvas for a thumbnail reduced by factor (1 .. 256), to be called from `mode_parsed`.
+// box selects box averaging, else nearest. The canvas must hold `decoder_thumbnail_length` ints,
+// the thumbnail pixels get filled with fill_color. Returns 1 if not in M2, for box filtering
+// without straight RGBA (indices, premultiplied, RGB565) or for empty images (thumbnail not used), else 0.
+int decoder_set_thumbnail(ParserState *ps, int *canvas, int factor, int box) {
+  if (!decoder_thumbnail_length(ps, factor) || !ps->height) return 1;
+  if (box && ps->format != DEC_RGBA8888 && ps->format != DEC_BGRA8888 && ps->format != DEC_RGB24) return 1;
+  ps->canvas = 0;
+  ps->canvas_row = 0;
+  ps->thumbnail = canvas;
+  ps->t_factor = factor;
+  ps->t_box = box;
+  ps->t_width = (ps->width - 4 + factor - 1) / factor;
+  ps->t_height = (ps->height + factor - 1) / factor;
+  ps->t_row = 0;
+  int length = ps->t_width * ps->t_height;
+  int fill_color = (int) ps->fill_color;
+  for (int i = 0; i < length; ++i) canvas[i] = fill_color;
+  ps->t_sums = (unsigned int *) canvas + length;
+  __builtin_memset(ps->t_sums, 0, ps->t_width * 16);
+  return 0;
+}
+
+// Reduce the rows of the band in progress into the thumbnail.
+void decoder_flush_thumbnail(ParserState *ps) {
+  resolve_spans(ps);
+  if (ps->thumbnail && ps->t_row < ps->height) reduce_band(ps, 6, 0);
+}
+
+static inline void decode_chunk(ParserState *ps, int start, int end) {
+  ps->chunk[end] = 0xFF;  // sentinel
+  get_decoder(ps)(ps, &ps->chunk[start], &ps->chunk[end]);
+}
+
+// Decode data in ps->chunk from start to end (exclusive).
+void decoder_decode(ParserState *ps, int start, int end) {
+  if (stopped(ps)) return;
+  STATS_ADD(ps, bytes, end - start);
+  decode_chunk(ps, start, end);
 }
 
+// Distance of the stop byte from the end of caller data in `decoder_decode_buffer`,
+// the decoders read behind the last sixel of a run up to SCAN_WIDTH - 1 bytes.
+#ifdef SCAN_WIDTH
+  #define INPLACE_TAIL SCAN_WIDTH
+#else
+  #define INPLACE_TAIL 1
+#endif
+
+// Decode data[0 .. length] (exclusive) in place.
+// Other than `decoder_decode` caller data is not written, thus there is no sentinel.
+// Instead the decoders run up to the last byte, that ends the digit and sixel loops
+// (a command byte), only the remaining tail gets copied into ps->chunk.
+// Until the mode is settled data goes through ps->chunk as well, since `decode_raster`
+// restarts at the slice start and must see the raster attributes in one piece.
+void decoder_decode_buffer(ParserState *ps, const char *data, int length) {
+  const char *c = data;
+  const char *end = data + length;
+  if (stopped(ps)) return;
+  STATS_ADD(ps, bytes, length);
+  while (ps->mode == M0 && c < end && !stopped(ps)) {
+    int chunk_length = end - c < CHUNK_SIZE ? end - c : CHUNK_SIZE;
+    __builtin_memcpy(ps->chunk, c, chunk_length);
+    decode_chunk(ps, 0, chunk_length);
+    c += chunk_length;
+  }
+  if (end - c > INPLACE_TAIL && !stopped(ps)) {
+    const char *stop = end - INPLACE_TAIL;
+    while (stop > c && (unsigned((*stop & 0x7F) - 48) < 10 || unsigned((*stop & 0x7F) - 63) < 64)) --stop;
+    if (stop > c) c = get_decoder(ps)(ps, c, stop);
+  }
+  while (c < end && !stopped(ps)) {
+    int chunk_length = end - c < CHUNK_SIZE ? end - c : CHUNK_SIZE;
+    __builtin_memcpy(ps->chunk, c, chunk_length);
+    decode_chunk(ps, 0, chunk_length);
+    c += chunk_length;
+  }
+}
+
+#ifdef DECODER_MMAP
+// Decode a whole file with mmap. Returns 0 on success, -1 if the file cannot be read.
+int decoder_decode_file(ParserState *ps, const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    // length is int in the decoder API, feed huge files in 1 GB pieces
+    for (off_t p = 0; p < st.st_size; p += 1 << 30) {
+      off_t length = st.st_size - p < (1 << 30) ? st.st_size - p : (1 << 30);
+      decoder_decode_buffer(ps, (const char *) data + p, (int) length);
+    }
+    munmap(data, st.st_size);
+  }
+  close(fd);
+  return 0;
+}
+#endif
+
 // Width of the current band.
-int current_width() {
-  if (ps.mode == M1) {
-    ps.real_width = ps.cursor > ps.real_width ? ps.cursor : ps.real_width;
-    ps.real_width = ps.real_width < MAX_WIDTH ? ps.real_width : MAX_WIDTH;
-    return ps.real_width - 4;
+int decoder_current_width(ParserState *ps) {
+  if (ps->mode == M1) {
+    ps->real_width = ps->cursor > ps->real_width ? ps->cursor : ps->real_width;
+    ps->real_width = ps->real_width < ps->cursor_limit ? ps->real_width : ps->cursor_limit;
+    return ps->real_width - 4;
   }
-  if (ps.mode == M2) {
-    return ps.width - 4;
+  if (ps->mode == M2) {
+    return ps->width - 4;
   }
   return 0;
 }
 
 // Height of the current band (M1 only).
-int current_height() {
-  int x = ps.band_height;
+int decoder_current_height(ParserState *ps) {
+  int x = ps->band_height;
   return x & 32 ? 6 : x & 16 ? 5 : x & 8 ? 4 : x & 4 ? 3 : x & 2 ? 2 : x & 1 ? 1 : 0;
 }
+
+// Copy `rows` pixel lines from `row` on (`width` pixels from cursor position 4) to dst in the pixel size
+// of the output format: 3 bytes RGB for DEC_RGB24, 2 bytes for DEC_RGB565, else ints.
+// The rows get packed without padding, returns the bytes written.
+int decoder_pack_rows(ParserState *ps, void *dst, int row, int rows, int width) {
+  const int stride = ps->line_width + 4;
+  if (row < 0 || rows < 0 || row + rows > 6 || width > ps->line_width) return 0;
+  unsigned char *d = (unsigned char *) dst;
+  for (int r = row; r < row + rows; ++r) {
+    const unsigned int *src = (const unsigned int *) ps->p0 + r * stride + 4;
+    if (ps->format == DEC_RGB24) {
+      for (int i = 0; i < width; ++i, d += 3) {
+        d[0] = src[i];
+        d[1] = src[i] >> 8;
+        d[2] = src[i] >> 16;
+      }
+    } else if (ps->format == DEC_RGB565) {
+      for (int i = 0; i < width; ++i, d += 2) {
+        const unsigned short color = src[i];
+        __builtin_memcpy(d, &color, 2);
+      }
+    } else {
+      __builtin_memcpy(d, src, width * sizeof(int));
+      d += width * sizeof(int);
+    }
+  }
+  return d - (unsigned char *) dst;
+}
+
+
+
+/**
+ * Arena canvas (`decoder_set_arena`) and batch decoding (`decoder_decode_batch`).
+ *
+ * With an arena the decoder calls internal band handlers instead of the embedder callbacks:
+ * M2 images are painted as direct canvas into the arena, M1 images and indexed M2 images get their
+ * bands appended by `arena_handle_band`. M1 rows are stored with a stride doubling with the band width
+ * (like the JS canvas), and get compacted to the image width by `decoder_flush_arena`.
+ * The arena grows the wasm memory up to its capacity, a full arena aborts with DEC_ABORT_MEMORY.
+ */
+
+// Make the arena hold ints, returns 1 if not possible.
+static int reserve_arena(ParserState *ps, unsigned long long ints) {
+  if (ints > ps->a_capacity) return 1;
+#ifdef __EMSCRIPTEN__
+  if (ps->a_grow) {
+    // the capacity may exceed the 32 bit address space
+    if (ints > (0xFFFFFFFFul - (unsigned long) ps->arena) / sizeof(int)) return 1;
+    unsigned long end = (unsigned long) (ps->arena + ints);
+    unsigned long available = __builtin_wasm_memory_size(0) * 65536;
+    if (end > available && __builtin_wasm_memory_grow(0, (end - available + 65535) / 65536) == (unsigned long) -1) {
+      return 1;
+    }
+  }
+#endif
+  return 0;
+}
+
+// Start the current image at end ints of the arena.
+static void open_arena(ParserState *ps, int *arena, unsigned long capacity, unsigned long end, int grow) {
+  ps->arena = arena;
+  ps->a_capacity = capacity;
+  ps->a_end = end;
+  ps->a_grow = grow;
+  ps->a_pixels = end;
+  ps->a_width = 0;
+  ps->a_stride = 0;
+  ps->a_rows = 0;
+}
+
+// Copy rows of the pixel lines (width pixels) to image row y, filled up to the stride.
+// The lines are contiguous (see `grow_lines`), thus no pointer table on the stack.
+static void put_arena_rows(ParserState *ps, int y, int width, int rows) {
+  const int line_stride = ps->line_width + 4;
+  const int fill_color = (int) ps->fill_color;
+  int *p = ps->arena + ps->a_pixels + (unsigned long) y * ps->a_stride;
+  for (int r = 0; r < rows; ++r, p += ps->a_stride) {
+    __builtin_memcpy(p, ps->p0 + r * line_stride + 4, width * sizeof(int));
+    for (int i = width; i < ps->a_stride; ++i) p[i] = fill_color;
+  }
+}
+
+// Widen the M1 rows to hold width pixels and reserve the next band, returns 1 if the arena is full.
+static int grow_arena_rows(ParserState *ps, int width) {
+  const int old = ps->a_stride;
+  int stride = old;
+  if (width > old) {
+    const int limit = ps->cursor_limit - 4;
+    stride = old * 2 < limit ? old * 2 : limit;
+    stride = width > stride ? width : stride;
+  }
+  if (reserve_arena(ps, ps->a_pixels + (unsigned long long) (ps->a_rows + 6) * stride)) return 1;
+  if (stride == old) return 0;
+  // backwards, the rows move to higher offsets
+  const int fill_color = (int) ps->fill_color;
+  int *pixels = ps->arena + ps->a_pixels;
+  for (int y = ps->a_rows - 1; y >= 0; --y) {
+    int *p = pixels + (unsigned long) y * stride;
+    __builtin_memmove(p, pixels + (unsigned long) y * old, old * sizeof(int));
+    for (int i = old; i < stride; ++i) p[i] = fill_color;
+  }
+  ps->a_stride = stride;
+  return 0;
+}
+
+static int arena_handle_band(ParserState *ps, int width) {
+  if (ps->mode == M2) {
+    const int remaining = ps->height - ps->a_rows;
+    const int rows = remaining < 6 ? remaining : 6;
+    put_arena_rows(ps, ps->a_rows, width, rows);
+    ps->a_rows += rows;
+    return 0;
+  }
+  if (grow_arena_rows(ps, width)) return 1;
+  put_arena_rows(ps, ps->a_rows, width, 6);
+  ps->a_rows += 6;
+  ps->a_width = width > ps->a_width ? width : ps->a_width;
+  return 0;
+}
+
+static int arena_mode_parsed(ParserState *ps, int mode) {
+  if (mode == M2 && ps->width > 4 && ps->height > 0) {
+    const int width = ps->width - 4;
+    if (reserve_arena(ps, ps->a_pixels + (unsigned long long) width * ((ps->height + 5ull) / 6 * 6))) return 1;
+    ps->a_stride = width;
+    decoder_set_canvas(ps, ps->arena + ps->a_pixels);
+  }
+  return 0;
+}
+
+// Decode the current image into arena (capacity ints) without calling the embedder callbacks,
+// to be called after `decoder_init` before any data. The arena holds the image rows with a stride
+// of `ps->a_stride` (M2: image width, M1: grows with the bands), `decoder_flush_arena` makes it
+// a complete image of `decoder_arena_width` x `decoder_arena_height` pixels.
+void decoder_set_arena(ParserState *ps, int *arena, int capacity) {
+  open_arena(ps, arena, capacity > 0 ? capacity : 0, 0, 0);
+}
+
+// Copy the band in progress into the arena (peek, the band gets copied again when finished)
+// and compact M1 rows to the image width. Sets DEC_ABORT_MEMORY if the arena is full.
+void decoder_flush_arena(ParserState *ps) {
+  if (!ps->arena || ps->abort == DEC_ABORT_MEMORY) return;
+  resolve_spans(ps);
+  if (ps->mode == M2 && ps->width > 4 && !ps->canvas && ps->a_rows < ps->height) {
+    // lines of the band in progress, rows below are not touched yet
+    const int width = ps->width - 4;
+    const int remaining = ps->height - ps->a_rows;
+    const int rows = remaining < 6 ? remaining : 6;
+    put_arena_rows(ps, ps->a_rows, width, rows);
+    const int fill_color = (int) ps->fill_color;
+    int *p = ps->arena + ps->a_pixels + (unsigned long) (ps->a_rows + rows) * width;
+    for (unsigned long i = 0, l = (unsigned long) (remaining - rows) * width; i < l; ++i) p[i] = fill_color;
+  } else if (ps->mode == M1) {
+    const int current = decoder_current_width(ps);
+    if (current) {
+      if (grow_arena_rows(ps, current)) {
+        ps->abort = DEC_ABORT_MEMORY;
+        return;
+      }
+      put_arena_rows(ps, ps->a_rows, current, decoder_current_height(ps));
+    }
+    // compact the rows to the image width, stays in place until the width grows again
+    const int width = decoder_arena_width(ps);
+    if (width < ps->a_stride) {
+      int *pixels = ps->arena + ps->a_pixels;
+      for (int y = 1, height = decoder_arena_height(ps); y < height; ++y) {
+        __builtin_memmove(pixels + (unsigned long) y * width, pixels + (unsigned long) y * ps->a_stride, width * sizeof(int));
+      }
+      ps->a_stride = width;
+    }
+  }
+}
+
+// Image width in the arena (M1: widest band including the band in progress).
+int decoder_arena_width(ParserState *ps) {
+  if (ps->mode == M2) return ps->width > 4 ? ps->width - 4 : 0;
+  if (ps->mode != M1) return 0;
+  const int current = decoder_current_width(ps);
+  return current > ps->a_width ? current : ps->a_width;
+}
+
+// Image height in the arena (M1: finished rows plus the rows of the band in progress).
+int decoder_arena_height(ParserState *ps) {
+  if (ps->mode == M2) return ps->width > 4 ? ps->height : 0;
+  if (ps->mode != M1) return 0;
+  return decoder_current_width(ps) ? ps->a_rows + decoder_current_height(ps) : ps->a_rows;
+}
+
+// Rows of finished bands in the arena.
+int decoder_arena_rows(ParserState *ps) {
+  if (ps->canvas) return ps->canvas_row < ps->height ? ps->canvas_row : ps->height;
+  return ps->a_rows;
+}
+
+static int run_batch(ParserState *ps, const char *data, BatchImage *images, int count,
+                     int *arena, int capacity, int grow) {
+  unsigned long end = 0;
+  int reset = 0;
+  for (int i = 0; i < count; ++i) reset |= images[i].reset_palette;
+  if (reset) {
+    open_arena(ps, arena, capacity > 0 ? capacity : 0, 0, grow);
+    if (reserve_arena(ps, PALETTE_SIZE)) {
+      for (int i = 0; i < count; ++i) images[i].abort = DEC_ABORT_MEMORY;
+      ps->arena = 0;
+      return 0;
+    }
+    __builtin_memcpy(arena, ps->palette, sizeof(ps->palette));
+    end = PALETTE_SIZE;
+  }
+  for (int i = 0; i < count; ++i) {
+    BatchImage *image = &images[i];
+    if (image->reset_palette) __builtin_memcpy(ps->palette, arena, sizeof(ps->palette));
+    decoder_init(ps, image->sixel_color, image->fill_color, image->palette_length, image->truncate, image->format);
+    open_arena(ps, arena, capacity > 0 ? capacity : 0, end, grow);
+    if (!ps->abort) decoder_decode_buffer(ps, data + image->offset, image->length);
+    decoder_flush_arena(ps);
+    const int full = ps->abort == DEC_ABORT_MEMORY;
+    image->pixels = end;
+    image->width = full ? 0 : decoder_arena_width(ps);
+    image->height = full ? 0 : decoder_arena_height(ps);
+    image->abort = ps->abort;
+    end += (unsigned long) image->width * image->height;
+  }
+  ps->arena = 0;
+  return end;
+}
+
+// Decode count images from data (BatchImage offset and length) into arena (capacity ints).
+// The images start with the palette at call time if reset_palette is set, else they keep the
+// color definitions of the previous image, the palette snapshot takes the first PALETTE_SIZE ints
+// of the arena then. Returns the ints used in the arena. The callbacks registered with
+// `decoder_set_callbacks` are not called, the decoder holds the state of the last image afterwards.
+int decoder_decode_batch(ParserState *ps, const char *data, BatchImage *images, int count, int *arena, int capacity) {
+  return run_batch(ps, data, images, count, arena, capacity, 0);
+}
+
+
+#ifdef DECODER_THREADS
+/**
+ * Band parallel decoding (M2 with direct canvas only).
+ *
+ * Bands only depend on each other by the parser state carried over the band border
+ * (current color, pending params and the palette). A serial pre-scan runs the state machine
+ * without painting, and splits the data at band borders into groups of roughly equal size,
+ * recording the carried state for every group. The groups are then painted by worker threads
+ * into disjoint canvas rows, each with its own parser state.
+ */
+
+// Minimal data size of a band group. Images below 2 groups get decoded serially.
+#ifndef PARALLEL_GROUP_SIZE
+  #define PARALLEL_GROUP_SIZE 65536
+#endif
+
+struct BandGroup {
+  int start;
+  int end;
+  int canvas_row;
+  int state;
+  int color;
+  int cursor;
+  int p_length;
+  int params[PARAM_SIZE];
+  std::vector<int> palette;
+};
+
+static void save_group(ParserState *ps, BandGroup &group, int start, int row, int state, int color, int cursor) {
+  group.start = start;
+  group.end = start;
+  group.canvas_row = row;
+  group.state = state;
+  group.color = color;
+  group.cursor = cursor;
+  group.p_length = ps->p_length;
+  memcpy(group.params, ps->params, sizeof(group.params));
+  group.palette.assign(ps->palette, ps->palette + ps->palette_length);
+}
+
+// Pre-scan data from start to end (exclusive) into band groups of at least group_size bytes.
+// Mirrors the state handling of the m2 canvas decoder, leaves ps in the state after decoding.
+static void scan_groups(ParserState *ps, const char *data, int start, int end, int group_size,
+                        std::vector<BandGroup> &groups) {
+  int cur = ps->cursor;
+  int state = ps->state;
+  int color = ps->color;
+  int row = ps->canvas_row;
+  groups.resize(1);
+  save_group(ps, groups[0], start, row, state, color, cur);
+  int next = start + group_size;
+  int c = start;
+  while (c < end) {
+    int code = data[c++] & 0x7F;
+
+    if (unsigned(code - 48) < 10) {
+      ps->params[ps->p_length - 1] = ps->params[ps->p_length - 1] * 10 + code - 48;
+    } else
+    if (unsigned(code - 63) < 64) {
+      if (state == ST_COMPRESSION) {
+        cur = advance(cur, ps->params[0] ? ps->params[0] : 1, ps->width);
+      } else {
+        if (state != ST_DATA) color = apply_color<0>(ps, color);
+        cur = advance(cur, 1, ps->width);
+      }
+      state = ST_DATA;
+    } else
+    if (code == ST_COMPRESSION || code == ST_COLOR) {
+      if (state == ST_COLOR) color = apply_color<0>(ps, color);
+      ps->params[0] = 0;
+      ps->p_length = 1;
+      state = code;
+    } else
+    if (code == '$') {
+      cur = 4;
+    } else
+    if (code == '-') {
+      row += 6;
+      if (row >= ps->height) {
+        groups.back().end = c;
+        ps->canvas_row = row;
+        ps->abort = DEC_ABORT_COMPLETE;
+        ps->cursor = 4;
+        ps->state = state;
+        ps->color = color;
+        return;
+      }
+      cur = 4;
+      if (c >= next) {
+        groups.back().end = c;
+        groups.resize(groups.size() + 1);
+        save_group(ps, groups.back(), c, row, state, color, cur);
+        next = c + group_size;
+      }
+    } else
+    if (code == ';') {
+      if (ps->p_length < PARAM_SIZE) {
+        ps->params[ps->p_length++] = 0;
+      }
+    }
+  }
+  groups.back().end = end;
+  ps->canvas_row = row;
+  ps->cursor = cur;
+  ps->state = state;
+  ps->color = color;
+}
+
+#ifdef DECODER_STATS
+static void add_stats(DecoderStats *to, const DecoderStats *from) {
+  to->bytes += from->bytes;
+  to->sixels += from->sixels;
+  to->repeats += from->repeats;
+  to->repeat_length += from->repeat_length;
+  to->color_selects += from->color_selects;
+  to->color_hls += from->color_hls;
+  to->color_rgb += from->color_rgb;
+  to->crs += from->crs;
+  to->bands += from->bands;
+  to->clears += from->clears;
+  to->band_cycles += from->band_cycles;
+  to->mode_cycles += from->mode_cycles;
+}
+#endif
+
+// Decode a band group into the canvas with worker state ws, image settings are taken from ps.
+static void decode_group(ParserState *ws, const ParserState *ps, const char *data, const BandGroup &group) {
+  ws->fill_color = ps->fill_color;
+  ws->width = ps->width;
+  ws->height = ps->height;
+  ws->r_num = ps->r_num;
+  ws->r_denom = ps->r_denom;
+  ws->r_width = ps->r_width;
+  ws->r_height = ps->r_height;
+  ws->truncate = ps->truncate;
+  ws->level = ps->level;
+  ws->mode = ps->mode;
+  ws->palette_length = ps->palette_length;
+  ws->format = ps->format;
+  ws->indexed = ps->indexed;
+  ws->canvas = ps->canvas;
+  ws->abort = DEC_ABORT_NONE;
+
+  ws->canvas_row = group.canvas_row;
+  ws->state = group.state;
+  ws->color = group.color;
+  ws->cursor = group.cursor;
+  ws->p_length = group.p_length;
+  memcpy(ws->params, group.params, sizeof(ws->params));
+  memcpy(ws->palette, group.palette.data(), group.palette.size() * sizeof(int));
+  convert_palette(ws);
+
+  decoder_decode_buffer(ws, data + group.start, group.end - group.start);
+}
+
+// Decode data[0 .. length] with up to `threads` threads (0 - number of cores).
+int decoder_decode_parallel(ParserState *ps, const char *data, int length, int threads) {
+  if (stopped(ps)) return 0;
+
+  // settle mode from raster attributes, decoding restarts at data start
+  if (ps->mode == M0) {
+    if (!parse_raster(ps, data, data + length)) return 1;
+    settle_mode(ps);
+    if (ps->abort) return 0;
+  }
+
+  if (threads <= 0) threads = std::thread::hardware_concurrency();
+  if (ps->mode != M2 || !ps->canvas || ps->abort || threads < 2 || length < PARALLEL_GROUP_SIZE * 2) {
+    decoder_decode_buffer(ps, data, length);
+    return 1;
+  }
+
+  int group_size = length / (threads * 4);
+  std::vector<BandGroup> groups;
+  scan_groups(ps, data, 0, length, group_size > PARALLEL_GROUP_SIZE ? group_size : PARALLEL_GROUP_SIZE, groups);
+
+  // the calling thread works as one of the workers
+  int workers = (size_t) threads < groups.size() ? threads : groups.size();
+  std::atomic<size_t> next_group(0);
+  std::atomic<bool> stop(false);
+  std::mutex merge_lock;
+  const unsigned long long base_pixels = ps->work_pixels;
+  const unsigned int base_bands = ps->work_bands;
+  const unsigned int base_overdraws = ps->work_overdraws;
+  auto work = [&]() {
+    ParserState *ws = new ParserState();
+    // every worker may spend the budget left, the sum gets checked after the merge
+    ws->budget_pixels = ps->budget_pixels;
+    ws->budget_bands = ps->budget_bands;
+    ws->budget_overdraws = ps->budget_overdraws;
+    ws->work_pixels = base_pixels;
+    ws->work_bands = base_bands;
+    ws->work_overdraws = base_overdraws;
+    size_t i;
+    while (!stop && (i = next_group++) < groups.size()) {
+      decode_group(ws, ps, data, groups[i]);
+      if (ws->abort == DEC_ABORT_BUDGET) stop = true;
+    }
+    {
+      std::lock_guard<std::mutex> guard(merge_lock);
+      ps->work_pixels += ws->work_pixels - base_pixels;
+      ps->work_bands += ws->work_bands - base_bands;
+      ps->work_overdraws += ws->work_overdraws - base_overdraws;
+#ifdef DECODER_STATS
+      // the pre-scan counts nothing, all counters come from the workers
+      add_stats(&ps->stats, &ws->stats);
+#endif
+    }
+    delete ws;
+  };
+  std::vector<std::thread> pool;
+  for (int i = 1; i < workers; ++i) pool.emplace_back(work);
+  work();
+  for (size_t i = 0; i < pool.size(); ++i) pool[i].join();
+  if (stop || budget_exceeded(ps)) {
+    ps->abort = DEC_ABORT_BUDGET;
+    ps->cursor = 4;
+  } else if (ps->abort == DEC_ABORT_COMPLETE) {
+    // the pre-scan stopped at the full canvas, color commands behind it still count
+    decoder_decode_buffer(ps, data + groups.back().end, length - groups.back().end);
+  }
+  return workers;
+}
+#endif  // DECODER_THREADS
+
+
+/**
+ * Static single instance interface.
+ *
+ * This is the interface exported by the wasm module, where every module instance
+ * holds exactly one parser state. Native code should use the decoder_* functions
+ * above instead (define DECODER_STATIC_INSTANCE to get the old interface natively).
+ */
+#if defined(__EMSCRIPTEN__) || defined(DECODER_STATIC_INSTANCE)
+
+static ParserState ps;
+
+extern "C" {
+  void* get_state_address() { return &ps.fill_color; }
+  void* get_chunk_address() { return &ps.chunk[0]; }
+  void* get_p0_address() { return &ps.p0[4]; }
+  void* get_palette_address() { return &ps.palette[0]; }
+  // pixel lines (valid after init), memory behind the lines is free for the embedder
+  int line_stride() { return ps.line_width + 4; }
+  void* get_free_address() { return ps.p0 + (ps.line_width + 4) * 6; }
+  // rows of finished bands in the direct canvas, finished rows of the thumbnail
+  int canvas_row() { return ps.canvas_row; }
+  // reason of a stopped decoding (DEC_ABORT_*), 0 while decoding
+  int abort_reason() { return ps.abort; }
+  // statistics block (DecoderStats), 0 if built without DECODER_STATS
+#ifdef DECODER_STATS
+  void* get_stats_address() { return &ps.stats; }
+#else
+  void* get_stats_address() { return 0; }
+#endif
+
+  void init(int sixel_color, int fill_color, unsigned int palette_length, int truncate, int format);
+  void set_max_width(int max_width);
+  void set_budget(unsigned int pixels, unsigned int bands, unsigned int overdraws);
+#ifdef DECODER_SPANS
+  void set_spans(int spans);
+  void flush_spans();
+#endif
+  void decode(int start, int end);
+  int current_width();
+  int current_height();
+  int pack_rows(void *dst, int row, int rows, int width);
+  int set_canvas(int *canvas);
+  int thumbnail_length(int factor);
+  int set_thumbnail(int *canvas, int factor, int box);
+  void flush_thumbnail();
+  void set_arena(int *arena, int capacity);
+  void flush_arena();
+  int arena_width();
+  int arena_height();
+  int arena_rows();
+  // row stride of the arena image (changes with `flush_arena` in M1)
+  int arena_stride() { return ps.a_stride; }
+  int decode_batch(BatchImage *images, int count, const char *data, int *arena, int capacity);
+#ifdef __EMSCRIPTEN__
+  // arena (or batch table, payloads and arena) behind the largest pixel lines (see `max_width`)
+  void* arena_address() {
+    const int max_width = ps.max_width ? ps.max_width : MAX_WIDTH;
+    return line_memory() + ((max_width + 127) / 128 * 128 + 4) * 6;
+  }
+#endif
+
+  // imported
+  int handle_band(int width);
+  int mode_parsed(int mode);
+}
+
+static int static_handle_band(void *, int width) { return handle_band(width); }
+static int static_mode_parsed(void *, int mode) { return mode_parsed(mode); }
+
+void init(int sixel_color, int fill_color, unsigned int palette_length, int truncate, int format) {
+  decoder_set_callbacks(&ps, &static_handle_band, &static_mode_parsed, 0);
+  decoder_init(&ps, sixel_color, fill_color, palette_length, truncate, format);
+}
+void decode(int start, int end) { decoder_decode(&ps, start, end); }
+int current_width() { return decoder_current_width(&ps); }
+int current_height() { return decoder_current_height(&ps); }
+int pack_rows(void *dst, int row, int rows, int width) { return decoder_pack_rows(&ps, dst, row, rows, width); }
+int set_canvas(int *canvas) { return decoder_set_canvas(&ps, canvas); }
+int thumbnail_length(int factor) { return decoder_thumbnail_length(&ps, factor); }
+int set_thumbnail(int *canvas, int factor, int box) { return decoder_set_thumbnail(&ps, canvas, factor, box); }
+void flush_thumbnail() { decoder_flush_thumbnail(&ps); }
+void set_max_width(int max_width) { decoder_set_max_width(&ps, max_width); }
+void set_budget(unsigned int pixels, unsigned int bands, unsigned int overdraws) {
+  decoder_set_budget(&ps, pixels, bands, overdraws);
+}
+#ifdef DECODER_SPANS
+void set_spans(int spans) { decoder_set_spans(&ps, spans); }
+void flush_spans() { decoder_flush_spans(&ps); }
+#endif
+// the arenas grow the wasm memory as needed (up to capacity ints)
+void set_arena(int *arena, int capacity) {
+  decoder_set_arena(&ps, arena, capacity);
+  ps.a_grow = 1;
+}
+void flush_arena() { decoder_flush_arena(&ps); }
+int arena_width() { return decoder_arena_width(&ps); }
+int arena_height() { return decoder_arena_height(&ps); }
+int arena_rows() { return decoder_arena_rows(&ps); }
+int decode_batch(BatchImage *images, int count, const char *data, int *arena, int capacity) {
+  return run_batch(&ps, data, images, count, arena, capacity, 1);
+}
+
+#endif
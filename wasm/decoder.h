@@ -0,0 +1,347 @@
+/**
+ * WasmDecoder - SIXEL band decoder (native interface).
+ *
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+#ifndef SIXEL_DECODER_H
+#define SIXEL_DECODER_H
+
+// cmdline overridable defines
+#ifndef CHUNK_SIZE
+  #define CHUNK_SIZE 4096
+#endif
+#ifndef PALETTE_SIZE
+  #define PALETTE_SIZE 256
+#endif
+#ifndef MAX_WIDTH
+  #define MAX_WIDTH 4096
+#endif
+// MAX_WIDTH is the default width limit of the decoder (changeable with `decoder_set_max_width`),
+// and the hard width limit of the encoder and quantizer
+#ifdef DECODER_SPANS
+  #ifndef SPAN_SIZE
+    #define SPAN_SIZE 1024
+  #endif
+  #ifndef SPAN_CODES
+    #define SPAN_CODES 16384
+  #endif
+  #ifndef SPAN_REPEAT
+    #define SPAN_REPEAT 16
+  #endif
+#endif
+// SPAN_SIZE and SPAN_CODES size the deferred span buffers (`decoder_set_spans`, DECODER_SPANS only),
+// a full buffer gets resolved early. Repeats up to SPAN_REPEAT get stored as codes.
+
+#define PARAM_SIZE 8
+
+// output pixel formats (`decoder_init`)
+#define DEC_RGBA8888 0         // ABGR32 words (default)
+#define DEC_INDEXED 1          // palette indices
+#define DEC_BGRA8888 2         // ARGB32 words (BGRA byte order)
+#define DEC_RGBA8888_PREMUL 3  // ABGR32 words, color channels premultiplied with alpha
+#define DEC_RGB24 4            // 3 bytes RGB (`decoder_pack_rows`), ABGR32 words in the pixel lines
+#define DEC_RGB565 5           // 16 bit RGB565 (`decoder_pack_rows`), in the low 16 bit of the pixel lines
+
+// abort reasons (`ps->abort`), any non zero value stops decoding until the next `decoder_init`
+// (DEC_ABORT_COMPLETE stops painting only, color commands still update the palette)
+#define DEC_ABORT_NONE 0
+#define DEC_ABORT_CALLBACK 1   // `handle_band` or `mode_parsed` returned non zero
+#define DEC_ABORT_COMPLETE 2   // direct canvas or thumbnail is complete, further sixels would be truncated
+#define DEC_ABORT_MEMORY 3     // pixel lines could not be allocated
+#define DEC_ABORT_BUDGET 4     // work budget exceeded (`decoder_set_budget`)
+
+
+/**
+ * Callbacks into the embedding code.
+ * `user_data` is the pointer registered with `decoder_set_callbacks`.
+ * Return 0 to continue, 1 to abort further processing.
+ */
+typedef int (*band_handler)(void *user_data, int width);
+typedef int (*mode_handler)(void *user_data, int mode);
+
+
+/**
+ * Decoder statistics (define DECODER_STATS), counted per image from `decoder_init`.
+ * The 32 bit counters are exposed to JS in this order and wrap around.
+ * The callback timers are taken with the CPU cycle counter natively (x86, ARM64), they stay 0 in wasm.
+ */
+#ifdef DECODER_STATS
+typedef struct DecoderStats {
+  unsigned int bytes;          // bytes consumed
+  unsigned int sixels;         // sixels painted singly (SIMD runs included)
+  unsigned int repeats;        // repeat introducers (!Pn) painted with `put`
+  unsigned int repeat_length;  // pixels painted by repeats
+  unsigned int color_selects;  // color register selects (#Pc)
+  unsigned int color_hls;      // color definitions in HLS (#Pc;1;...)
+  unsigned int color_rgb;      // color definitions in RGB (#Pc;2;...)
+  unsigned int crs;            // carriage returns, the band gets overdrawn
+  unsigned int bands;          // line feeds (finished bands)
+  unsigned int clears;         // pixel line clears (band resets and 128 pixel chunks in M1)
+  unsigned long long band_cycles;  // cycles spent in `handle_band`
+  unsigned long long mode_cycles;  // cycles spent in `mode_parsed`
+} DecoderStats;
+#endif
+
+
+#ifdef DECODER_SPANS
+/**
+ * Deferred band span (`decoder_set_spans`), either a repeated sixel with its 6 bit mask,
+ * or a run of single sixels with their codes stored in `span_codes` (mask 0).
+ */
+typedef struct BandSpan {
+  int cursor;
+  int length;
+  int color;
+  int mask;
+  int codes;  // offset in span_codes (runs)
+} BandSpan;
+#endif
+
+
+/**
+ * Image of a batch (`decoder_decode_batch`), options set by the caller, results set by the decoder.
+ * The pixels have a row stride of width and the output format of the image.
+ */
+typedef struct BatchImage {
+  // options
+  int offset;          // payload in data
+  int length;
+  int sixel_color;     // same as for `decoder_init`
+  int fill_color;
+  int palette_length;
+  int truncate;
+  int format;
+  int reset_palette;   // 1 - start with the palette at batch start, 0 - keep colors of the previous image
+  // results
+  int pixels;          // offset of the pixels in the arena (ints)
+  int width;
+  int height;
+  int abort;           // DEC_ABORT_* of the image, DEC_ABORT_MEMORY if the arena is full
+} BatchImage;
+
+
+/**
+ * Parser state of a decoder instance.
+ *
+ * The entries up to `params` form the state block exposed to JS
+ * by `get_state_address` and must not be reordered.
+ *
+ * The pixel lines are not part of the state, they get sized from the raster width
+ * and grow with the cursor in M1 (never beyond `max_width`).
+ */
+typedef struct ParserState {
+  // exposed entries (when changed also needs changes in JS)
+  long long fill_color;
+  int width;
+  int height;
+  int r_num;
+  int r_denom;
+  int r_width;
+  int r_height;
+  int truncate;
+  int level;  // LV0 undecided, LV1 level1, LV2 level2
+  int mode;   // M0 undecided, M1 level1 or !truncate, M2 level2 + truncate
+  int palette_length;
+
+#ifdef DECODER_STATS
+  // statistics (individually exposed)
+  DecoderStats stats;
+#endif
+
+  // internal or individually exposed
+  int abort;  // DEC_ABORT_*
+  int cleared_width;
+  int real_width;
+  int band_height;
+  int state;
+  int color;
+  int cursor;
+  int p_length;
+  int params[PARAM_SIZE];
+  int palette[PALETTE_SIZE];
+  char chunk[CHUNK_SIZE + 32] __attribute__((aligned(16)));  // sentinel + SIMD overread
+
+  // pixel lines, contiguous with a row stride of line_width + 4 (p1 = p0 + stride ...)
+  int *p0;
+  int *p1;
+  int *p2;
+  int *p3;
+  int *p4;
+  int *p5;
+  int line_width;    // allocated cursor limit (multiple of 128), 0 - not allocated
+  int max_width;     // configured cursor limit (max image width + 4), 0 - MAX_WIDTH
+  int cursor_limit;  // max_width, lowered to line_width if the lines cannot grow
+
+  // output format (DEC_*), indexed is set for DEC_INDEXED
+  int format;
+  int indexed;
+  // palette in the output format (converted when the mode settles), points to `palette` for
+  // formats without conversion
+  int *colors;
+  int converted[PALETTE_SIZE];
+
+  // direct canvas (M2 only)
+  int *canvas;
+  int canvas_row;  // finished rows of the canvas or thumbnail
+
+  // thumbnail canvas (M2 only), box sums of the open row group behind the thumbnail pixels
+  int *thumbnail;
+  unsigned int *t_sums;
+  int t_factor;
+  int t_box;
+  int t_width;
+  int t_height;
+  int t_row;  // source rows reduced so far
+
+  // arena canvas (`decoder_set_arena`), replaces the embedder callbacks
+  int *arena;
+  unsigned long a_capacity;  // ints
+  unsigned long a_end;       // ints used by the images before the current one (batch)
+  int a_grow;                // wasm: grow the memory behind the arena
+  int a_pixels;              // offset of the current image
+  int a_width;               // widest finished band (M1)
+  int a_stride;              // row stride of the current image
+  int a_rows;                // rows of finished bands
+
+#ifdef DECODER_SPANS
+  // deferred spans of the band in progress, painted into the pixel lines by `resolve_spans`
+  int spans;  // deferred painting enabled
+  int span_length;
+  int code_length;
+  BandSpan span[SPAN_SIZE];
+  unsigned char span_codes[SPAN_CODES];
+  unsigned char span_rows[MAX_WIDTH];  // rows already resolved per cursor position
+#endif
+
+  // work budget (0 - unlimited) and the work spent on the current image
+  unsigned int budget_pixels;
+  unsigned int budget_bands;
+  unsigned int budget_overdraws;
+  unsigned long long work_pixels;  // painted pixels, cursor extent of every band pass * 6
+  unsigned int work_bands;
+  unsigned int work_overdraws;
+
+  // embedder callbacks
+  band_handler handle_band;
+  mode_handler mode_parsed;
+  void *user_data;
+} __attribute__((aligned(16))) ParserState;
+
+
+/**
+ * Native API.
+ *
+ * All functions operate on an explicit parser state, thus several decoders
+ * can be used side by side (e.g. one per thread). The state is a rather big
+ * struct (mainly the chunk and palette), allocate it zero initialized on the heap
+ * (e.g. `new ParserState()`) and free the pixel lines with `decoder_release` when done.
+ *
+ * Usage pattern:
+ *  - register callbacks once with `decoder_set_callbacks`
+ *  - optionally limit the image width with `decoder_set_max_width` (default MAX_WIDTH - 4 pixels)
+ *    and the work per image with `decoder_set_budget`
+ *  - call `decoder_init` for every new image
+ *  - load data into `ps->chunk` and call `decoder_decode`, or decode caller data in place
+ *    with `decoder_decode_buffer` (`decoder_decode_file` maps a file, POSIX only)
+ *  - grab pixels from `ps->p0 .. ps->p5` in `handle_band` (starting at index 4)
+ *
+ * For M2 images the decoder can paint directly into a canvas instead (no `handle_band` calls),
+ * by calling `decoder_set_canvas` from `mode_parsed`. The canvas has a row stride of `width - 4`
+ * and must be sized for full bands (height rounded up to a multiple of 6).
+ *
+ * Define DECODER_THREADS to get `decoder_decode_parallel`, which decodes a complete image (or the rest of it)
+ * from `data` with several threads. The band parallel path needs the direct canvas (M2 only),
+ * otherwise it falls back to serial decoding. Returns the number of threads used.
+ *
+ * A reduced copy of M2 images can be decoded instead with `decoder_set_thumbnail` (also from `mode_parsed`,
+ * no `handle_band` calls). Every band gets reduced by `factor` (nearest or box filter) when finished,
+ * thus the memory scales with the thumbnail size. The thumbnail has `ceil(width / factor)` columns and
+ * `ceil(height / factor)` rows, the canvas must hold `decoder_thumbnail_length` ints (pixels plus box sums).
+ * Call `decoder_flush_thumbnail` to get the rows of the band in progress into the thumbnail
+ * (e.g. when the data ended without a final LF), it can be called repeatedly.
+ *
+ * The output format is chosen with `format` at `decoder_init`. With DEC_INDEXED the pixels hold palette
+ * indices instead of RGBA8888 colors (`sixel_color` and `fill_color` are indices then). Color definitions
+ * still update `ps->palette`, which holds the final colors after decoding. Indices are always lower
+ * than `palette_length`. The other formats write one int per pixel as well: `sixel_color`, `fill_color`
+ * and `ps->palette` stay RGBA8888, the decoder keeps a copy of the palette in the output format
+ * (converted when the mode settles, thus the palette may be set after `decoder_init`, and on color
+ * definitions), thus the pixel loops are the same for all formats and color selects convert nothing.
+ * `decoder_pack_rows` copies rows of the pixel lines in the pixel size of the format (3 bytes for
+ * DEC_RGB24, 2 bytes for DEC_RGB565), e.g. in `handle_band`. The direct canvas takes all formats
+ * as ints, box filtered thumbnails need straight RGBA (DEC_RGBA8888, DEC_BGRA8888 and DEC_RGB24).
+ *
+ * Define DECODER_STATS to count the decoder work of every image in `ps->stats` (see `DecoderStats`),
+ * e.g. to find out why some images decode much slower than others. Without it the counters
+ * are not compiled in at all. Like the size settings it changes the state layout.
+ *
+ * The work on a single image is not bounded by the data size: a repeat paints up to the max width
+ * from a few bytes, every CR lets the band get overdrawn, and in M1 the height is unlimited.
+ * `decoder_set_budget` limits the painted pixels, the bands (LF) and the overdraws (CR) per image
+ * (0 - unlimited), the spent work gets reset by `decoder_init`. The work gets accounted at CR and LF only,
+ * exceeding a limit aborts decoding with DEC_ABORT_BUDGET in `ps->abort`. Other abort reasons
+ * are listed with the DEC_ABORT_* defines. `decoder_decode_parallel` gives every worker the budget left
+ * and checks the sum after the merge.
+ *
+ * Built with DECODER_SPANS, `decoder_set_spans(ps, 1)` makes the line decoders (not the direct canvas) paint
+ * deferred: sixels get recorded as spans of the current band (cursor, length, color, repeat mask or the codes
+ * of a sixel run), which get resolved into the pixel lines at LF, writing every pixel once (last span wins).
+ * Spans stay pending across decode calls, a full span buffer resolves early, `decoder_flush_spans`,
+ * `decoder_flush_thumbnail`, `decoder_flush_arena` and `decoder_set_spans` resolve the band in progress.
+ * Not used for a max width beyond MAX_WIDTH. The output is the same as with eager painting,
+ * which is faster for all test images, thus the default build leaves the span state and decoders out.
+ *
+ * `decoder_set_arena` (after `decoder_init`) makes the decoder own the output canvas: instead of calling
+ * the embedder callbacks, finished bands get appended to an arena (M2 images are painted as direct canvas),
+ * thus the embedder only looks at the image at the end or when decoding stopped (`ps->abort`, DEC_ABORT_MEMORY
+ * if the arena capacity is exhausted). `decoder_flush_arena` adds the band in progress and compacts the rows
+ * to the image width, the arena then holds `decoder_arena_width` x `decoder_arena_height` pixels.
+ *
+ * `decoder_decode_batch` decodes many images (e.g. icons) in one call into one arena, without calling
+ * the embedder callbacks. Every image gets initialized with its options from the `BatchImage` table,
+ * the results (pixel offset, width, height and the abort reason) are written back into the table.
+ * An image not fitting into the arena is marked with DEC_ABORT_MEMORY and takes no pixels.
+ * Aspect ratio and thumbnails are not applied in batches.
+ *
+ * The pixel lines start small at `decoder_init`, get sized from the raster width when the mode settles,
+ * and grow by doubling in M1 when the cursor moves beyond. Pixels beyond the max width are truncated.
+ * The line pointers and the row stride (`line_width + 4`) may change during decoding, re-read them
+ * in `handle_band`. The lines are allocated with malloc natively, in wasm they sit behind the static
+ * memory. If the lines cannot grow, the image gets truncated to the allocated width.
+ */
+extern "C" {
+  void decoder_set_callbacks(ParserState *ps, band_handler handle_band, mode_handler mode_parsed, void *user_data);
+  void decoder_set_max_width(ParserState *ps, int max_width);
+  void decoder_set_budget(ParserState *ps, unsigned int pixels, unsigned int bands, unsigned int overdraws);
+#ifdef DECODER_SPANS
+  void decoder_set_spans(ParserState *ps, int spans);
+  void decoder_flush_spans(ParserState *ps);
+#endif
+  void decoder_release(ParserState *ps);
+  void decoder_init(ParserState *ps, int sixel_color, int fill_color, unsigned int palette_length, int truncate, int format);
+  void decoder_decode(ParserState *ps, int start, int end);
+  void decoder_decode_buffer(ParserState *ps, const char *data, int length);
+#if !defined(__EMSCRIPTEN__) && (defined(__unix__) || defined(__APPLE__))
+  int decoder_decode_file(ParserState *ps, const char *filename);
+#endif
+  int decoder_current_width(ParserState *ps);
+  int decoder_current_height(ParserState *ps);
+  int decoder_pack_rows(ParserState *ps, void *dst, int row, int rows, int width);
+  int decoder_set_canvas(ParserState *ps, int *canvas);
+  int decoder_thumbnail_length(ParserState *ps, int factor);
+  int decoder_set_thumbnail(ParserState *ps, int *canvas, int factor, int box);
+  void decoder_flush_thumbnail(ParserState *ps);
+  void decoder_set_arena(ParserState *ps, int *arena, int capacity);
+  void decoder_flush_arena(ParserState *ps);
+  int decoder_arena_width(ParserState *ps);
+  int decoder_arena_height(ParserState *ps);
+  int decoder_arena_rows(ParserState *ps);
+  int decoder_decode_batch(ParserState *ps, const char *data, BatchImage *images, int count, int *arena, int capacity);
+#ifdef DECODER_THREADS
+  int decoder_decode_parallel(ParserState *ps, const char *data, int length, int threads);
+#endif
+}
+
+#endif  // SIXEL_DECODER_H
@@ -0,0 +1,482 @@
+/**
+ * WasmEncoder - SIXEL band encoder.
+ *
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+#include <cstring>
+
+#include "encoder.h"
+
+// band parallel encoding with native threads (not available in wasm)
+#ifdef DECODER_THREADS
+  #include <atomic>
+  #include <thread>
+  #include <vector>
+#endif
+
+#if MAX_WIDTH > 65536 || PALETTE_SIZE > 65535
+  #error "encoder needs MAX_WIDTH <= 65536 and PALETTE_SIZE <= 65535"
+#endif
+
+// max output size of the raster attributes and of a color definition
+#define UNIT_RASTER 32
+#define UNIT_COLOR 24
+
+
+/**
+ * Output helpers.
+ */
+
+static inline char *put_int(char *o, unsigned int value) {
+  char digits[10];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (n) *o++ = digits[--n];
+  return o;
+}
+
+// Write a run of n equal sixels, with repeat compression for n > 3.
+static inline char *put_run(char *o, int code, int n) {
+  char c = code + 63;
+  if (n > 3) {
+    *o++ = '!';
+    o = put_int(o, n);
+    *o++ = c;
+  } else {
+    while (n--) *o++ = c;
+  }
+  return o;
+}
+
+// Channel byte value 0..255 to SIXEL % value 0..100 (rounded like Math.round).
+static inline int to_percent(int value) {
+  return (value * 200 + 255) / 510;
+}
+
+// Raster attributes " Pan ; Pad ; Ph ; Pv (Pan/Pad are dummies, not eval'd by any terminal).
+static inline char *put_raster(char *o, int width, int height) {
+  *o++ = '"';
+  *o++ = '1';
+  *o++ = ';';
+  *o++ = '1';
+  *o++ = ';';
+  o = put_int(o, width);
+  *o++ = ';';
+  return put_int(o, height);
+}
+
+// Color definition # Pc ; 2 ; Pr ; Pg ; Pb
+static inline char *put_color(char *o, int idx, unsigned int color) {
+  *o++ = '#';
+  o = put_int(o, idx);
+  *o++ = ';';
+  *o++ = '2';
+  *o++ = ';';
+  o = put_int(o, to_percent(color & 0xFF));
+  *o++ = ';';
+  o = put_int(o, to_percent((color >> 8) & 0xFF));
+  *o++ = ';';
+  return put_int(o, to_percent((color >> 16) & 0xFF));
+}
+
+
+/**
+ * Color matching (RGBA8888 input).
+ */
+
+// Palette index of the nearest color by euclidean distance (first match wins).
+static int nearest_color(const EncoderState *es, unsigned int color) {
+  int r = color & 0xFF;
+  int g = (color >> 8) & 0xFF;
+  int b = (color >> 16) & 0xFF;
+  int min = 0x7FFFFFFF;
+  int idx = 0;
+  for (int i = 0; i < es->palette_length; ++i) {
+    int dr = r - (es->palette[i] & 0xFF);
+    int dg = g - ((es->palette[i] >> 8) & 0xFF);
+    int db = b - ((es->palette[i] >> 16) & 0xFF);
+    int d = dr * dr + dg * dg + db * db;
+    if (d < min) {
+      min = d;
+      idx = i;
+      if (!d) break;
+    }
+  }
+  return idx;
+}
+
+// Slot of a color, 0 for transparent (alpha 0). Nearest colors are cached by RGB.
+static inline int match_color(EncoderState *es, unsigned int color) {
+  if (!(color >> 24)) return 0;
+  unsigned int rgb = color & 0xFFFFFF;
+  unsigned int h = (rgb * 2654435761u) >> (32 - ENCODER_CACHE_BITS);
+  if (es->cache_key[h] != rgb) {
+    es->cache_key[h] = rgb;
+    es->cache_slot[h] = nearest_color(es, rgb) + 1;
+  }
+  return es->cache_slot[h];
+}
+
+
+/**
+ * Band encoding.
+ *
+ * A band is encoded in 3 steps:
+ *  - scan: map the pixels to slots (column order) and count the columns every slot appears in,
+ *    which gives the used slots in order of appearance and an output bound for the band
+ *  - sort: bucket the columns by slot
+ *  - write: walk the columns of every slot and write its sixel line with repeat compression,
+ *    gaps are written as empty sixels, trailing empty sixels are skipped
+ * The column stamps avoid counting a slot twice for the same column.
+ */
+
+static void reset_scratch(EncoderState *es) {
+  memset(es->count, 0, sizeof(es->count));
+  memset(es->stamp, 0, sizeof(es->stamp));
+  memset(es->cache_key, 0xFF, sizeof(es->cache_key));
+  es->used_length = 0;
+  es->tick = 0;
+}
+
+// Load pixel rows y .. y + 5 as slots into the band buffer, missing rows are transparent.
+static void load_band(EncoderState *es, int y) {
+  const int width = es->width;
+  const int rows = es->height - y < 6 ? es->height - y : 6;
+  const int limit = es->palette_length;
+  unsigned short *band = es->band;
+  for (int r = 0; r < rows; ++r) {
+    size_t offset = (size_t) (y + r) * width;
+    if (es->format == ENC_RGBA8888) {
+      const unsigned int *p = (const unsigned int *) es->pixels + offset;
+      unsigned int last_color = 0;
+      int last_slot = 0;
+      for (int x = 0; x < width; ++x) {
+        if (p[x] != last_color) {
+          last_color = p[x];
+          last_slot = match_color(es, last_color);
+        }
+        band[x * 6 + r] = last_slot;
+      }
+    } else if (es->format == ENC_INDEXED8) {
+      const unsigned char *p = (const unsigned char *) es->pixels + offset;
+      for (int x = 0; x < width; ++x) band[x * 6 + r] = p[x] < limit ? p[x] + 1 : 0;
+    } else {
+      const unsigned short *p = (const unsigned short *) es->pixels + offset;
+      for (int x = 0; x < width; ++x) band[x * 6 + r] = p[x] < limit ? p[x] + 1 : 0;
+    }
+  }
+  for (int r = rows; r < 6; ++r) {
+    for (int x = 0; x < width; ++x) band[x * 6 + r] = 0;
+  }
+}
+
+// Scan the band at row y. Returns the output bound of the band.
+static int scan_band(EncoderState *es, int y) {
+  load_band(es, y);
+  if (es->tick > 0x40000000) {
+    memset(es->stamp, 0, sizeof(es->stamp));
+    es->tick = 0;
+  }
+  int entries = 0;
+  for (int x = 0; x < es->width; ++x) {
+    const unsigned short *column = &es->band[x * 6];
+    int tick = ++es->tick;
+    for (int r = 0; r < 6; ++r) {
+      int s = column[r];
+      if (s && es->stamp[s] != tick) {
+        es->stamp[s] = tick;
+        if (!es->count[s]++) es->used[es->used_length++] = s;
+        entries++;
+      }
+    }
+  }
+  // per slot: color introducer + sixels (never more than 1 byte per column or 7 bytes per run)
+  int sixels = es->used_length * es->width;
+  return 7 * es->used_length + (sixels < 14 * entries ? sixels : 14 * entries) + 2;
+}
+
+// Write the scanned band at row es->next, resets the scratch for the next band.
+static char *write_band(EncoderState *es, char *o) {
+  if (es->next) {
+    *o++ = '-';
+    *o++ = '\n';
+  }
+
+  // bucket columns by slot
+  int offset = 0;
+  for (int i = 0; i < es->used_length; ++i) {
+    es->pos[es->used[i]] = offset;
+    offset += es->count[es->used[i]];
+  }
+  for (int x = 0; x < es->width; ++x) {
+    const unsigned short *column = &es->band[x * 6];
+    int tick = ++es->tick;
+    for (int r = 0; r < 6; ++r) {
+      int s = column[r];
+      if (s && es->stamp[s] != tick) {
+        es->stamp[s] = tick;
+        es->cols[es->pos[s]++] = x;
+      }
+    }
+  }
+
+  // sixel line per slot
+  for (int i = 0; i < es->used_length; ++i) {
+    int s = es->used[i];
+    *o++ = '#';
+    o = put_int(o, s - 1);
+    int last = -1;
+    int accu = 0;
+    int cursor = 0;
+    for (int k = es->pos[s] - es->count[s]; k < es->pos[s]; ++k) {
+      int x = es->cols[k];
+      const unsigned short *column = &es->band[x * 6];
+      int code = (column[0] == s)
+        | (column[1] == s) << 1
+        | (column[2] == s) << 2
+        | (column[3] == s) << 3
+        | (column[4] == s) << 4
+        | (column[5] == s) << 5;
+      if (x > cursor) {
+        if (last) {
+          if (accu) o = put_run(o, last, accu);
+          last = 0;
+          accu = 0;
+        }
+        accu += x - cursor;
+      }
+      if (code == last) {
+        accu++;
+      } else {
+        if (accu) o = put_run(o, last, accu);
+        last = code;
+        accu = 1;
+      }
+      cursor = x + 1;
+    }
+    o = put_run(o, last, accu);
+    *o++ = '$';
+    es->count[s] = 0;
+  }
+  es->used_length = 0;
+  return o;
+}
+
+// Write raster attributes and color definitions, as far as they fit.
+static char *write_header(EncoderState *es, char *o, char *end) {
+  if (es->stage == 0) {
+    if (es->raster) {
+      if (end - o < UNIT_RASTER) return o;
+      o = put_raster(o, es->width, es->height);
+    }
+    es->stage = 1;
+  }
+  while (es->next < es->palette_length) {
+    if (end - o < UNIT_COLOR) return o;
+    o = put_color(o, es->next, es->palette[es->next]);
+    es->next++;
+  }
+  es->stage = 2;
+  es->next = 0;
+  return o;
+}
+
+// Write bands, as far as they fit.
+static char *write_bands(EncoderState *es, char *o, char *end) {
+  while (es->stage == 2) {
+    if (!es->scanned) {
+      es->bound = scan_band(es, es->next);
+      es->scanned = 1;
+    }
+    if (end - o < es->bound) break;
+    o = write_band(es, o);
+    es->scanned = 0;
+    es->next += 6;
+    if (es->next >= es->height) es->stage = 3;
+  }
+  return o;
+}
+
+
+/**
+ * Native API.
+ */
+
+int encoder_init(EncoderState *es, const void *pixels, int format, int width, int height,
+                 const int *palette, int palette_length, int raster) {
+  if (format < ENC_RGBA8888 || format > ENC_INDEXED16
+    || width < 1 || width > MAX_WIDTH || height < 1
+    || palette_length < 1 || palette_length > PALETTE_SIZE)
+  {
+    es->stage = 3;
+    return 1;
+  }
+  es->pixels = pixels;
+  es->format = format;
+  es->width = width;
+  es->height = height;
+  es->raster = raster;
+  es->palette_length = palette_length;
+  if (palette != es->palette) memcpy(es->palette, palette, palette_length * sizeof(int));
+  es->stage = 0;
+  es->next = 0;
+  es->scanned = 0;
+  es->bound = 0;
+  reset_scratch(es);
+  return 0;
+}
+
+int encoder_encode(EncoderState *es, char *out, int size) {
+  if (es->stage == 3) return 0;
+  char *end = out + size;
+  char *o = out;
+  if (es->stage < 2) o = write_header(es, o, end);
+  o = write_bands(es, o, end);
+  return o > out ? o - out : -1;
+}
+
+int encoder_output_limit(int width, int palette_length) {
+  int used = 6 * width < palette_length ? 6 * width : palette_length;
+  int sixels = used < 84 ? used * width : 84 * width;
+  int limit = 7 * used + sixels + 2;
+  return limit > UNIT_RASTER ? limit : UNIT_RASTER;
+}
+
+
+#ifdef DECODER_THREADS
+/**
+ * Band parallel encoding.
+ *
+ * Bands are independent from each other, worker threads encode groups of bands
+ * into their own buffers, which get copied in order into the output afterwards.
+ * Workers stop picking new groups, once the encoded data exceeds the output size.
+ */
+
+// Bands per group. Images below 2 groups get encoded serially.
+#ifndef ENCODER_GROUP_BANDS
+  #define ENCODER_GROUP_BANDS 8
+#endif
+
+struct BandOutput {
+  std::vector<char> data;
+  std::vector<int> ends;
+};
+
+// Encode bands from row y with worker state ws into output, image settings are taken from es.
+static void encode_group(EncoderState *ws, const EncoderState *es, int y, BandOutput &output) {
+  ws->pixels = es->pixels;
+  ws->format = es->format;
+  ws->width = es->width;
+  ws->height = es->height;
+  if (ws->palette_length != es->palette_length
+    || memcmp(ws->palette, es->palette, es->palette_length * sizeof(int)))
+  {
+    ws->palette_length = es->palette_length;
+    memcpy(ws->palette, es->palette, es->palette_length * sizeof(int));
+    memset(ws->cache_key, 0xFF, sizeof(ws->cache_key));
+  }
+  for (int i = 0; i < ENCODER_GROUP_BANDS && y < es->height; ++i, y += 6) {
+    ws->next = y;
+    size_t offset = output.data.size();
+    output.data.resize(offset + scan_band(ws, y));
+    char *o = write_band(ws, &output.data[offset]);
+    output.data.resize(o - output.data.data());
+    output.ends.push_back(output.data.size());
+  }
+}
+
+// Encode with up to `threads` threads (0 - number of cores).
+int encoder_encode_parallel(EncoderState *es, char *out, int size, int threads) {
+  if (es->stage == 3) return 0;
+  char *end = out + size;
+  char *o = out;
+  if (es->stage < 2) {
+    o = write_header(es, o, end);
+    if (es->stage < 2) return o > out ? o - out : -1;
+  }
+
+  if (threads <= 0) threads = std::thread::hardware_concurrency();
+  int groups = ((es->height - es->next + 5) / 6 + ENCODER_GROUP_BANDS - 1) / ENCODER_GROUP_BANDS;
+  if (threads < 2 || groups < 2) {
+    o = write_bands(es, o, end);
+    return o > out ? o - out : -1;
+  }
+
+  // drop a band scanned by a previous serial call
+  if (es->scanned) {
+    for (int i = 0; i < es->used_length; ++i) es->count[es->used[i]] = 0;
+    es->used_length = 0;
+    es->scanned = 0;
+  }
+
+  // the calling thread works as one of the workers
+  std::vector<BandOutput> outputs(groups);
+  std::atomic<int> next_group(0);
+  std::atomic<long long> produced(0);
+  long long available = end - o;
+  auto work = [&]() {
+    EncoderState *ws = new EncoderState;
+    ws->palette_length = 0;
+    reset_scratch(ws);
+    int i;
+    while (produced < available && (i = next_group++) < groups) {
+      encode_group(ws, es, es->next + i * ENCODER_GROUP_BANDS * 6, outputs[i]);
+      produced += outputs[i].data.size();
+    }
+    delete ws;
+  };
+  int workers = threads < groups ? threads : groups;
+  std::vector<std::thread> pool;
+  for (int i = 1; i < workers; ++i) pool.emplace_back(work);
+  work();
+  for (size_t i = 0; i < pool.size(); ++i) pool[i].join();
+
+  // copy whole bands in order, as far as they fit
+  for (int i = 0; i < groups && !outputs[i].ends.empty(); ++i) {
+    int start = 0;
+    for (size_t k = 0; k < outputs[i].ends.size(); ++k) {
+      int length = outputs[i].ends[k] - start;
+      if (end - o < length) goto done;
+      memcpy(o, &outputs[i].data[start], length);
+      o += length;
+      start = outputs[i].ends[k];
+      es->next += 6;
+    }
+  }
+done:
+  if (es->next >= es->height) es->stage = 3;
+  return o > out ? o - out : -1;
+}
+#endif  // DECODER_THREADS
+
+
+/**
+ * Static single instance interface.
+ *
+ * Encoder part of the wasm module interface. JS places pixels and output buffer
+ * in memory behind the static memory, the palette gets written into the encoder palette.
+ */
+#if defined(__EMSCRIPTEN__) || defined(DECODER_STATIC_INSTANCE)
+
+static EncoderState es;
+
+extern "C" {
+  void* get_encoder_palette_address() { return &es.palette[0]; }
+
+  int encode_init(const void *pixels, int format, int width, int height, int palette_length, int raster);
+  int encode(char *out, int size);
+  int encode_limit(int width, int palette_length);
+}
+
+int encode_init(const void *pixels, int format, int width, int height, int palette_length, int raster) {
+  return encoder_init(&es, pixels, format, width, height, es.palette, palette_length, raster);
+}
+int encode(char *out, int size) { return encoder_encode(&es, out, size); }
+int encode_limit(int width, int palette_length) { return encoder_output_limit(width, palette_length); }
+
+#endif
@@ -0,0 +1,94 @@
+/**
+ * WasmEncoder - SIXEL band encoder (native interface).
+ *
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+#ifndef SIXEL_ENCODER_H
+#define SIXEL_ENCODER_H
+
+// shares PALETTE_SIZE and MAX_WIDTH with the decoder
+#include "decoder.h"
+
+// size of the color matching cache (RGBA8888 input only)
+#ifndef ENCODER_CACHE_BITS
+  #define ENCODER_CACHE_BITS 12
+#endif
+#define ENCODER_CACHE_SIZE (1 << ENCODER_CACHE_BITS)
+
+// input pixel formats
+#define ENC_RGBA8888 0
+#define ENC_INDEXED8 1
+#define ENC_INDEXED16 2
+
+
+/**
+ * State of an encoder instance.
+ *
+ * Holds the image description, the output progress and the band scratch memory.
+ * Band pixels are stored as slots (palette index + 1, 0 for transparent) in column order.
+ */
+typedef struct EncoderState {
+  // image
+  const void *pixels;
+  int format;
+  int width;
+  int height;
+  int raster;
+  int palette_length;
+
+  // output progress
+  int stage;      // 0 raster attributes, 1 color definitions, 2 bands, 3 done
+  int next;       // next color definition or first row of next band
+  int scanned;    // band at `next` is scanned, but not written yet
+  int bound;      // output bound of the scanned band
+  int tick;       // column stamp counter
+
+  int palette[PALETTE_SIZE];
+  unsigned int cache_key[ENCODER_CACHE_SIZE];
+  unsigned short cache_slot[ENCODER_CACHE_SIZE];
+
+  // band scratch
+  int used_length;
+  int used[PALETTE_SIZE + 1];   // slots of the band in order of appearance
+  int count[PALETTE_SIZE + 1];  // columns per slot
+  int pos[PALETTE_SIZE + 1];    // column list offset per slot
+  int stamp[PALETTE_SIZE + 1];  // last column stamp per slot
+  unsigned short band[6 * MAX_WIDTH] __attribute__((aligned(16)));
+  unsigned short cols[6 * MAX_WIDTH] __attribute__((aligned(16)));
+} __attribute__((aligned(16))) EncoderState;
+
+
+/**
+ * Native API.
+ *
+ * Usage pattern:
+ *  - call `encoder_init` for every new image
+ *  - call `encoder_encode` with an output buffer until it returns 0
+ *
+ * The encoder writes the SIXEL data body (raster attributes, color definitions and bands),
+ * without the DCS introducer and ST. The output is written in whole units (a band or
+ * a color definition), an output buffer of `encoder_output_limit` bytes always makes progress.
+ * `encoder_encode` returns the number of bytes written, 0 when done or -1 if the buffer
+ * is too small for the next unit.
+ *
+ * Pixels are either RGBA8888 colors (alpha 0 is transparent, other colors get mapped
+ * to the nearest palette color by euclidean distance) or 8/16 bit palette indices
+ * (indices beyond the palette are transparent). `palette` holds RGBA8888 colors,
+ * alpha is ignored. The pixel data must stay valid until the image is done.
+ *
+ * With DECODER_THREADS `encoder_encode_parallel` encodes groups of bands with several threads.
+ * It behaves like `encoder_encode`, but writes as many bands as fit in one call.
+ */
+extern "C" {
+  int encoder_init(EncoderState *es, const void *pixels, int format, int width, int height,
+                   const int *palette, int palette_length, int raster);
+  int encoder_encode(EncoderState *es, char *out, int size);
+  int encoder_output_limit(int width, int palette_length);
+#ifdef DECODER_THREADS
+  int encoder_encode_parallel(EncoderState *es, char *out, int size, int threads);
+#endif
+}
+
+#endif  // SIXEL_ENCODER_H
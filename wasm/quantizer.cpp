@@ -0,0 +1,508 @@
+/**
+ * WasmQuantizer - color quantizer for the SIXEL encoder.
+ *
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+#include <cstring>
+
+#include "quantizer.h"
+
+// SIMD nearest color search, selected at compile time by the target features
+// (same selection as in the decoder, define NO_SIMD to force the scalar path).
+#ifndef NO_SIMD
+  #if defined(__AVX2__)
+    #include <immintrin.h>
+    #define SIMD_WIDTH 8
+  #elif defined(__SSE4_1__)
+    #include <smmintrin.h>
+    #define SIMD_WIDTH 4
+  #elif defined(__wasm_simd128__)
+    #include <wasm_simd128.h>
+    #define SIMD_WIDTH 4
+  #endif
+#endif
+
+// candidate lists are padded to a multiple of 8 entries
+#define POOL_ALIGN 8
+
+// max pixels sampled for palette creation (keeps the 32 bit histogram sums from overflowing)
+#define MAX_SAMPLES (1 << 24)
+
+
+static inline int clamp8(int value) {
+  return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static inline int bin_of(unsigned int rgb) {
+  return (rgb & 0xF8) << 7 | (rgb >> 6 & 0x3E0) | (rgb >> 19 & 0x1F);
+}
+
+
+/**
+ * Nearest color LUT.
+ *
+ * A box covers 16x16x16 colors. Its candidates are all palette colors, whose minimal distance
+ * to the box is not bigger than the smallest maximal distance of any palette color to the box.
+ * Thus the nearest color of any point in the box is among the candidates (exact matching).
+ * The search runs over keys of (distance << 12 | index), the minimal key wins,
+ * which resolves ties to the lowest palette index.
+ */
+
+static void reset_lut(QuantizerState *qs) {
+  for (int i = 0; i < 4096; ++i) qs->box_length[i] = -1;
+  qs->pool_length = 0;
+}
+
+static void build_box(QuantizerState *qs, int box) {
+  const int lo[3] = { (box >> 8) << 4, (box >> 4 & 15) << 4, (box & 15) << 4 };
+  if (qs->pool_length + qs->palette_length + POOL_ALIGN > QUANT_POOL_SIZE) reset_lut(qs);
+
+  int minmax = 0x7FFFFFFF;
+  for (int i = 0; i < qs->palette_length; ++i) {
+    int d = 0;
+    for (int c = 0; c < 3; ++c) {
+      int v = qs->palette[i] >> (c * 8) & 0xFF;
+      int dl = v - lo[c];
+      int dh = lo[c] + 15 - v;
+      int m = dl > dh ? dl : dh;
+      d += m * m;
+    }
+    if (d < minmax) minmax = d;
+  }
+
+  int offset = qs->pool_length;
+  int n = offset;
+  for (int i = 0; i < qs->palette_length; ++i) {
+    int d = 0;
+    for (int c = 0; c < 3; ++c) {
+      int v = qs->palette[i] >> (c * 8) & 0xFF;
+      int m = v < lo[c] ? lo[c] - v : v > lo[c] + 15 ? v - lo[c] - 15 : 0;
+      d += m * m;
+    }
+    if (d <= minmax) {
+      qs->pool_r[n] = qs->palette[i] & 0xFF;
+      qs->pool_g[n] = qs->palette[i] >> 8 & 0xFF;
+      qs->pool_b[n] = qs->palette[i] >> 16 & 0xFF;
+      qs->pool_idx[n] = i;
+      n++;
+    }
+  }
+  // pad with copies of the first candidate
+  while ((n - offset) % POOL_ALIGN) {
+    qs->pool_r[n] = qs->pool_r[offset];
+    qs->pool_g[n] = qs->pool_g[offset];
+    qs->pool_b[n] = qs->pool_b[offset];
+    qs->pool_idx[n] = qs->pool_idx[offset];
+    n++;
+  }
+  qs->box_offset[box] = offset;
+  qs->box_length[box] = n - offset;
+  qs->pool_length = n;
+}
+
+// Palette index of the nearest color for r, g, b.
+static inline int nearest(QuantizerState *qs, int r, int g, int b) {
+  int box = (r >> 4) << 8 | (g >> 4) << 4 | b >> 4;
+  if (qs->box_length[box] < 0) build_box(qs, box);
+  const int *pr = qs->pool_r + qs->box_offset[box];
+  const int *pg = qs->pool_g + qs->box_offset[box];
+  const int *pb = qs->pool_b + qs->box_offset[box];
+  const int *pi = qs->pool_idx + qs->box_offset[box];
+  const int length = qs->box_length[box];
+#if defined(SIMD_WIDTH) && defined(__AVX2__)
+  __m256i vr = _mm256_set1_epi32(r);
+  __m256i vg = _mm256_set1_epi32(g);
+  __m256i vb = _mm256_set1_epi32(b);
+  __m256i best = _mm256_set1_epi32(0x7FFFFFFF);
+  for (int i = 0; i < length; i += 8) {
+    __m256i dr = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) (pr + i)), vr);
+    __m256i dg = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) (pg + i)), vg);
+    __m256i db = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) (pb + i)), vb);
+    __m256i d = _mm256_add_epi32(_mm256_add_epi32(
+      _mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)), _mm256_mullo_epi32(db, db));
+    best = _mm256_min_epi32(best, _mm256_or_si256(_mm256_slli_epi32(d, 12),
+      _mm256_loadu_si256((const __m256i *) (pi + i))));
+  }
+  __m128i m = _mm_min_epi32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+  m = _mm_min_epi32(m, _mm_shuffle_epi32(m, 0x4E));
+  m = _mm_min_epi32(m, _mm_shuffle_epi32(m, 0xB1));
+  return _mm_cvtsi128_si32(m) & 0xFFF;
+#elif defined(SIMD_WIDTH) && defined(__SSE4_1__)
+  __m128i vr = _mm_set1_epi32(r);
+  __m128i vg = _mm_set1_epi32(g);
+  __m128i vb = _mm_set1_epi32(b);
+  __m128i best = _mm_set1_epi32(0x7FFFFFFF);
+  for (int i = 0; i < length; i += 4) {
+    __m128i dr = _mm_sub_epi32(_mm_loadu_si128((const __m128i *) (pr + i)), vr);
+    __m128i dg = _mm_sub_epi32(_mm_loadu_si128((const __m128i *) (pg + i)), vg);
+    __m128i db = _mm_sub_epi32(_mm_loadu_si128((const __m128i *) (pb + i)), vb);
+    __m128i d = _mm_add_epi32(_mm_add_epi32(
+      _mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg)), _mm_mullo_epi32(db, db));
+    best = _mm_min_epi32(best, _mm_or_si128(_mm_slli_epi32(d, 12),
+      _mm_loadu_si128((const __m128i *) (pi + i))));
+  }
+  best = _mm_min_epi32(best, _mm_shuffle_epi32(best, 0x4E));
+  best = _mm_min_epi32(best, _mm_shuffle_epi32(best, 0xB1));
+  return _mm_cvtsi128_si32(best) & 0xFFF;
+#elif defined(SIMD_WIDTH)
+  v128_t vr = wasm_i32x4_splat(r);
+  v128_t vg = wasm_i32x4_splat(g);
+  v128_t vb = wasm_i32x4_splat(b);
+  v128_t best = wasm_i32x4_splat(0x7FFFFFFF);
+  for (int i = 0; i < length; i += 4) {
+    v128_t dr = wasm_i32x4_sub(wasm_v128_load(pr + i), vr);
+    v128_t dg = wasm_i32x4_sub(wasm_v128_load(pg + i), vg);
+    v128_t db = wasm_i32x4_sub(wasm_v128_load(pb + i), vb);
+    v128_t d = wasm_i32x4_add(wasm_i32x4_add(
+      wasm_i32x4_mul(dr, dr), wasm_i32x4_mul(dg, dg)), wasm_i32x4_mul(db, db));
+    best = wasm_i32x4_min(best, wasm_v128_or(wasm_i32x4_shl(d, 12), wasm_v128_load(pi + i)));
+  }
+  best = wasm_i32x4_min(best, wasm_i32x4_shuffle(best, best, 2, 3, 0, 1));
+  best = wasm_i32x4_min(best, wasm_i32x4_shuffle(best, best, 1, 0, 3, 2));
+  return wasm_i32x4_extract_lane(best, 0) & 0xFFF;
+#else
+  int best = 0x7FFFFFFF;
+  for (int i = 0; i < length; ++i) {
+    int dr = pr[i] - r;
+    int dg = pg[i] - g;
+    int db = pb[i] - b;
+    int key = (dr * dr + dg * dg + db * db) << 12 | pi[i];
+    if (key < best) best = key;
+  }
+  return best & 0xFFF;
+#endif
+}
+
+
+/**
+ * Palette creation.
+ *
+ * Variance based box splitting over the occupied histogram bins: the box with the biggest
+ * squared error gets split along its channel with the biggest variance, at the position
+ * minimizing the squared error of both halves. Palette colors are the pixel means of the boxes.
+ */
+
+// Squared error of bins[start .. end), sums into sum[3] and *weight.
+static double box_stats(const QuantizerState *qs, int start, int end, double *sum, double *weight) {
+  double sq = 0;
+  double w = 0;
+  sum[0] = sum[1] = sum[2] = 0;
+  for (int i = start; i < end; ++i) {
+    int bin = qs->bins[i];
+    double r = qs->hist_r[bin];
+    double g = qs->hist_g[bin];
+    double b = qs->hist_b[bin];
+    sum[0] += r;
+    sum[1] += g;
+    sum[2] += b;
+    w += qs->hist_count[bin];
+    sq += (r * r + g * g + b * b) / qs->hist_count[bin];
+  }
+  *weight = w;
+  return sq - (sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]) / w;
+}
+
+static void set_box(QuantizerState *qs, int k, int start, int end) {
+  double sum[3];
+  double w;
+  qs->box_start[k] = start;
+  qs->box_end[k] = end;
+  qs->box_error[k] = end - start > 1 ? box_stats(qs, start, end, sum, &w) : -1;
+}
+
+static void split_box(QuantizerState *qs, int k, int next) {
+  const int start = qs->box_start[k];
+  const int end = qs->box_end[k];
+
+  // channel with the biggest variance
+  double sum[3] = { 0, 0, 0 };
+  double sq[3] = { 0, 0, 0 };
+  double w = 0;
+  for (int i = start; i < end; ++i) {
+    int bin = qs->bins[i];
+    double n = qs->hist_count[bin];
+    const unsigned int *hist[3] = { qs->hist_r, qs->hist_g, qs->hist_b };
+    for (int c = 0; c < 3; ++c) {
+      sum[c] += hist[c][bin];
+      sq[c] += (double) hist[c][bin] * hist[c][bin] / n;
+    }
+    w += n;
+  }
+  int axis = 0;
+  double max_var = -1;
+  for (int c = 0; c < 3; ++c) {
+    double var = sq[c] - sum[c] * sum[c] / w;
+    if (var > max_var) {
+      max_var = var;
+      axis = c;
+    }
+  }
+
+  // counting sort by the 5 bit channel value of the bins
+  int shift = 10 - axis * 5;
+  int counts[33] = { 0 };
+  for (int i = start; i < end; ++i) counts[(qs->bins[i] >> shift & 31) + 1]++;
+  for (int i = 1; i < 33; ++i) counts[i] += counts[i - 1];
+  for (int i = start; i < end; ++i) qs->bins_tmp[start + counts[qs->bins[i] >> shift & 31]++] = qs->bins[i];
+  memcpy(qs->bins + start, qs->bins_tmp + start, (end - start) * sizeof(int));
+
+  // split position minimizing the squared error of both halves,
+  // which maximizes |sum_left|^2 / w_left + |sum_right|^2 / w_right
+  double left[3] = { 0, 0, 0 };
+  double wl = 0;
+  double best = -1;
+  int split = start + 1;
+  for (int i = start + 1; i < end; ++i) {
+    int bin = qs->bins[i - 1];
+    left[0] += qs->hist_r[bin];
+    left[1] += qs->hist_g[bin];
+    left[2] += qs->hist_b[bin];
+    wl += qs->hist_count[bin];
+    double r0 = sum[0] - left[0];
+    double r1 = sum[1] - left[1];
+    double r2 = sum[2] - left[2];
+    double score = (left[0] * left[0] + left[1] * left[1] + left[2] * left[2]) / wl
+      + (r0 * r0 + r1 * r1 + r2 * r2) / (w - wl);
+    if (score > best) {
+      best = score;
+      split = i;
+    }
+  }
+  set_box(qs, k, start, split);
+  set_box(qs, next, split, end);
+}
+
+// Count colors into the histogram, also collects the exact colors into the palette
+// as long as there are not more than `colors`. Returns 1 if the colors are exact.
+static int count_colors(QuantizerState *qs, const unsigned int *pixels, int length, int colors) {
+  memset(qs->hist_count, 0, sizeof(qs->hist_count));
+  memset(qs->hist_r, 0, sizeof(qs->hist_r));
+  memset(qs->hist_g, 0, sizeof(qs->hist_g));
+  memset(qs->hist_b, 0, sizeof(qs->hist_b));
+  memset(qs->exact_key, 0xFF, sizeof(qs->exact_key));
+  qs->exact_length = 0;
+
+  int exact = 1;
+  int step = length > MAX_SAMPLES ? (length + MAX_SAMPLES - 1) / MAX_SAMPLES : 1;
+  unsigned int last = 0xFFFFFFFF;
+  for (int i = 0; i < length; i += step) {
+    unsigned int color = pixels[i];
+    if (!(color >> 24)) continue;
+    unsigned int rgb = color & 0xFFFFFF;
+    int bin = bin_of(rgb);
+    qs->hist_count[bin]++;
+    qs->hist_r[bin] += rgb & 0xFF;
+    qs->hist_g[bin] += rgb >> 8 & 0xFF;
+    qs->hist_b[bin] += rgb >> 16;
+    if (exact && rgb != last) {
+      last = rgb;
+      unsigned int h = (rgb * 2654435761u) >> 19;
+      while (qs->exact_key[h] != 0xFFFFFFFF && qs->exact_key[h] != rgb) h = (h + 1) & (2 * QUANT_MAX_COLORS - 1);
+      if (qs->exact_key[h] == 0xFFFFFFFF) {
+        if (qs->exact_length == colors) {
+          exact = 0;
+          continue;
+        }
+        qs->exact_key[h] = rgb;
+        qs->palette[qs->exact_length++] = 0xFF000000 | rgb;
+      }
+    }
+  }
+  return exact;
+}
+
+
+/**
+ * Dithering.
+ */
+
+static const unsigned char BAYER8[64] = {
+   0, 32,  8, 40,  2, 34, 10, 42,
+  48, 16, 56, 24, 50, 18, 58, 26,
+  12, 44,  4, 36, 14, 46,  6, 38,
+  60, 28, 52, 20, 62, 30, 54, 22,
+   3, 35, 11, 43,  1, 33,  9, 41,
+  51, 19, 59, 27, 49, 17, 57, 25,
+  15, 47,  7, 39, 13, 45,  5, 37,
+  63, 31, 55, 23, 61, 29, 53, 21
+};
+
+static void reduce_plain(QuantizerState *qs, const unsigned int *pixels, int length, unsigned short *indices) {
+  unsigned int last = ~pixels[0];
+  int idx = 0;
+  for (int i = 0; i < length; ++i) {
+    if (pixels[i] != last) {
+      last = pixels[i];
+      idx = last >> 24 ? nearest(qs, last & 0xFF, last >> 8 & 0xFF, last >> 16 & 0xFF) : QUANT_TRANSPARENT;
+    }
+    indices[i] = idx;
+  }
+}
+
+// Ordered dithering with a 8x8 Bayer matrix, spread by the palette density.
+static void reduce_ordered(QuantizerState *qs, const unsigned int *pixels, int width, int height,
+                           unsigned short *indices) {
+  int levels = 1;
+  while ((levels + 1) * (levels + 1) * (levels + 1) <= qs->palette_length) levels++;
+  int spread = 255 / levels;
+  int offsets[64];
+  for (int i = 0; i < 64; ++i) offsets[i] = (2 * BAYER8[i] - 63) * spread / 128;
+
+  for (int y = 0; y < height; ++y) {
+    const unsigned int *p = pixels + (size_t) y * width;
+    unsigned short *out = indices + (size_t) y * width;
+    const int *row = offsets + (y & 7) * 8;
+    for (int x = 0; x < width; ++x) {
+      unsigned int color = p[x];
+      if (!(color >> 24)) {
+        out[x] = QUANT_TRANSPARENT;
+        continue;
+      }
+      int o = row[x & 7];
+      out[x] = nearest(qs, clamp8((color & 0xFF) + o), clamp8((color >> 8 & 0xFF) + o), clamp8((color >> 16 & 0xFF) + o));
+    }
+  }
+}
+
+// Floyd-Steinberg error diffusion. The error rows have a border pixel on both sides,
+// thus errors never leak across row borders or past the image.
+static void reduce_floyd_steinberg(QuantizerState *qs, const unsigned int *pixels, int width, int height,
+                                   unsigned short *indices) {
+  short *cur = qs->error_rows[0];
+  short *next = qs->error_rows[1];
+  const size_t row_size = (width + 2) * 3 * sizeof(short);
+  memset(cur, 0, row_size);
+
+  for (int y = 0; y < height; ++y) {
+    const unsigned int *p = pixels + (size_t) y * width;
+    unsigned short *out = indices + (size_t) y * width;
+    memset(next, 0, row_size);
+    for (int x = 0; x < width; ++x) {
+      unsigned int color = p[x];
+      if (!(color >> 24)) {
+        out[x] = QUANT_TRANSPARENT;
+        continue;
+      }
+      short *e = cur + (x + 1) * 3;
+      int r = clamp8((color & 0xFF) + ((e[0] + 8) >> 4));
+      int g = clamp8((color >> 8 & 0xFF) + ((e[1] + 8) >> 4));
+      int b = clamp8((color >> 16 & 0xFF) + ((e[2] + 8) >> 4));
+      int idx = nearest(qs, r, g, b);
+      out[x] = idx;
+
+      int c = qs->palette[idx];
+      int err[3] = { r - (c & 0xFF), g - (c >> 8 & 0xFF), b - (c >> 16 & 0xFF) };
+      short *n = next + x * 3;
+      for (int k = 0; k < 3; ++k) {
+        e[3 + k] += err[k] * 7;
+        n[k] += err[k] * 3;
+        n[3 + k] += err[k] * 5;
+        n[6 + k] += err[k];
+      }
+    }
+    short *tmp = cur;
+    cur = next;
+    next = tmp;
+  }
+}
+
+
+/**
+ * Native API.
+ */
+
+int quantizer_create_palette(QuantizerState *qs, const unsigned int *pixels, int length, int colors) {
+  if (colors < 1) colors = 1;
+  if (colors > QUANT_MAX_COLORS) colors = QUANT_MAX_COLORS;
+
+  if (count_colors(qs, pixels, length, colors)) {
+    // no opaque pixels at all - single black entry
+    if (!qs->exact_length) qs->palette[qs->exact_length++] = 0xFF000000;
+    qs->palette_length = qs->exact_length;
+    reset_lut(qs);
+    return qs->palette_length;
+  }
+
+  int n = 0;
+  for (int bin = 0; bin < 32768; ++bin) {
+    if (qs->hist_count[bin]) qs->bins[n++] = bin;
+  }
+  int boxes = 1;
+  set_box(qs, 0, 0, n);
+  while (boxes < colors) {
+    int k = 0;
+    for (int i = 1; i < boxes; ++i) {
+      if (qs->box_error[i] > qs->box_error[k]) k = i;
+    }
+    if (qs->box_error[k] <= 0) break;
+    split_box(qs, k, boxes++);
+  }
+
+  // box means as palette colors, skipping doubles
+  qs->palette_length = 0;
+  for (int k = 0; k < boxes; ++k) {
+    double sum[3];
+    double w;
+    box_stats(qs, qs->box_start[k], qs->box_end[k], sum, &w);
+    int color = 0xFF000000
+      | clamp8(sum[2] / w + 0.5) << 16
+      | clamp8(sum[1] / w + 0.5) << 8
+      | clamp8(sum[0] / w + 0.5);
+    int i = 0;
+    while (i < qs->palette_length && qs->palette[i] != color) i++;
+    if (i == qs->palette_length) qs->palette[qs->palette_length++] = color;
+  }
+  reset_lut(qs);
+  return qs->palette_length;
+}
+
+int quantizer_set_palette(QuantizerState *qs, const int *palette, int length) {
+  if (length < 1 || length > QUANT_MAX_COLORS) return 1;
+  if (palette != qs->palette) memmove(qs->palette, palette, length * sizeof(int));
+  for (int i = 0; i < length; ++i) qs->palette[i] |= 0xFF000000;
+  qs->palette_length = length;
+  reset_lut(qs);
+  return 0;
+}
+
+int quantizer_reduce(QuantizerState *qs, const unsigned int *pixels, int width, int height,
+                     unsigned short *indices, int dither) {
+  if (qs->palette_length < 1 || width < 1 || width > MAX_WIDTH || height < 1) return 1;
+  if (dither == QUANT_DITHER_FLOYD_STEINBERG) {
+    reduce_floyd_steinberg(qs, pixels, width, height, indices);
+  } else if (dither == QUANT_DITHER_ORDERED) {
+    reduce_ordered(qs, pixels, width, height, indices);
+  } else {
+    reduce_plain(qs, pixels, width * height, indices);
+  }
+  return 0;
+}
+
+
+/**
+ * Static interface.
+ *
+ * Quantizer part of the wasm module interface. The state is too big for the static memory,
+ * JS places it (with pixels and indices) in memory behind the static memory.
+ */
+#if defined(__EMSCRIPTEN__) || defined(DECODER_STATIC_INSTANCE)
+
+extern "C" {
+  int quantize_state_size() { return sizeof(QuantizerState); }
+  void* quantize_palette_address(QuantizerState *qs) { return &qs->palette[0]; }
+
+  int quantize_palette(QuantizerState *qs, const unsigned int *pixels, int length, int colors) {
+    return quantizer_create_palette(qs, pixels, length, colors);
+  }
+  int quantize_set_palette(QuantizerState *qs, int length) {
+    return quantizer_set_palette(qs, qs->palette, length);
+  }
+  int quantize_reduce(QuantizerState *qs, const unsigned int *pixels, int width, int height,
+                      unsigned short *indices, int dither) {
+    return quantizer_reduce(qs, pixels, width, height, indices, dither);
+  }
+}
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * WasmQuantizer - color quantizer for the SIXEL encoder (native interface).
+ *
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+#ifndef SIXEL_QUANTIZER_H
+#define SIXEL_QUANTIZER_H
+
+// shares MAX_WIDTH with the decoder
+#include "decoder.h"
+
+// max palette size of the quantizer (color index must fit into 12 bits)
+#define QUANT_MAX_COLORS 4096
+
+// entries of the nearest color LUT pool (flushed when full)
+#ifndef QUANT_POOL_SIZE
+  #define QUANT_POOL_SIZE 32768
+#endif
+
+// index written for transparent pixels (alpha 0)
+#define QUANT_TRANSPARENT 0xFFFF
+
+// dithering
+#define QUANT_DITHER_NONE 0
+#define QUANT_DITHER_FLOYD_STEINBERG 1
+#define QUANT_DITHER_ORDERED 2
+
+
+/**
+ * State of a quantizer instance.
+ *
+ * Palette creation works on a 5 bit per channel histogram (with exact channel sums per bin).
+ * Images with not more colors than requested get their exact colors as palette.
+ *
+ * Nearest color matching uses a LUT of 16x16x16 boxes, each box holds the candidates,
+ * that can be the nearest color for any point in the box (built on first usage of a box).
+ */
+typedef struct QuantizerState {
+  int palette_length;
+  int palette[QUANT_MAX_COLORS];
+
+  // nearest color LUT, candidates are stored as SoA in the pool
+  int box_offset[4096];
+  int box_length[4096];  // -1 not built yet
+  int pool_length;
+  int pool_r[QUANT_POOL_SIZE] __attribute__((aligned(32)));
+  int pool_g[QUANT_POOL_SIZE] __attribute__((aligned(32)));
+  int pool_b[QUANT_POOL_SIZE] __attribute__((aligned(32)));
+  int pool_idx[QUANT_POOL_SIZE] __attribute__((aligned(32)));
+
+  // palette creation
+  unsigned int hist_count[32768];
+  unsigned int hist_r[32768];
+  unsigned int hist_g[32768];
+  unsigned int hist_b[32768];
+  int bins[32768];
+  int bins_tmp[32768];
+  int box_start[QUANT_MAX_COLORS];
+  int box_end[QUANT_MAX_COLORS];
+  double box_error[QUANT_MAX_COLORS];
+  unsigned int exact_key[2 * QUANT_MAX_COLORS];
+  int exact_length;
+
+  // dithering error rows (16 * error, 1 pixel border on both sides)
+  short error_rows[2][(MAX_WIDTH + 2) * 3];
+} __attribute__((aligned(32))) QuantizerState;
+
+
+/**
+ * Native API.
+ *
+ * Usage pattern:
+ *  - create a palette with `quantizer_create_palette` or set one with `quantizer_set_palette`
+ *  - call `quantizer_reduce` to get palette indices for an image
+ *
+ * Pixels are RGBA8888 colors, alpha 0 is transparent (excluded from palette creation,
+ * written as QUANT_TRANSPARENT index), other alpha values are treated as opaque.
+ * The palette holds RGBA8888 colors with alpha 255 and no duplicates.
+ * `quantizer_reduce` respects the image dimensions for the dithering and returns 1
+ * for unsupported arguments (no palette, width > MAX_WIDTH), otherwise 0.
+ */
+extern "C" {
+  int quantizer_create_palette(QuantizerState *qs, const unsigned int *pixels, int length, int colors);
+  int quantizer_set_palette(QuantizerState *qs, const int *palette, int length);
+  int quantizer_reduce(QuantizerState *qs, const unsigned int *pixels, int width, int height,
+                       unsigned short *indices, int dither);
+}
+
+#endif  // SIXEL_QUANTIZER_H
@@ -0,0 +1,275 @@
+/**
+ * SixelStream - DCS front end for the SIXEL band decoder.
+ *
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+#include "stream.h"
+
+// SIMD sequence border search, selected at compile time by the target features
+// (same selection as in the decoder, define NO_SIMD to force the scalar path).
+#ifndef NO_SIMD
+  #if defined(__AVX2__)
+    #include <immintrin.h>
+    #define SCAN_WIDTH 32
+  #elif defined(__SSE4_1__)
+    #include <smmintrin.h>
+    #define SCAN_WIDTH 16
+  #elif defined(__wasm_simd128__)
+    #include <wasm_simd128.h>
+    #define SCAN_WIDTH 16
+  #endif
+#endif
+
+// internal states
+#define SS_GROUND 0
+#define SS_ESC 1
+#define SS_DCS 2
+#define SS_SIXEL 3
+#define SS_SIXEL_ESC 4
+
+#define CAN 0x18
+#define SUB 0x1A
+#define ESC 0x1B
+#define DCS 0x90
+#define ST 0x9C
+
+// clamp for DCS parameters
+#define PARAM_MAX 999999
+
+
+/**
+ * Sequence border search.
+ */
+
+#ifdef SCAN_WIDTH
+// Bitmask of ESC (and DCS with c1) bytes at c.
+static inline unsigned int mask_introducer(const char *c, int c1) {
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i *) c);
+  __m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(ESC));
+  if (c1) m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char) DCS)));
+  return (unsigned int) _mm256_movemask_epi8(m);
+#elif defined(__SSE4_1__)
+  __m128i v = _mm_loadu_si128((const __m128i *) c);
+  __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(ESC));
+  if (c1) m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8((char) DCS)));
+  return (unsigned int) _mm_movemask_epi8(m);
+#else
+  v128_t v = wasm_v128_load(c);
+  v128_t m = wasm_i8x16_eq(v, wasm_i8x16_splat(ESC));
+  if (c1) m = wasm_v128_or(m, wasm_i8x16_eq(v, wasm_i8x16_splat((char) DCS)));
+  return wasm_i8x16_bitmask(m);
+#endif
+}
+
+// Bitmask of C0 and high bytes at c (signed compare), candidates for the end of sixel data.
+static inline unsigned int mask_control(const char *c) {
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i *) c);
+  return (unsigned int) _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v));
+#elif defined(__SSE4_1__)
+  __m128i v = _mm_loadu_si128((const __m128i *) c);
+  return (unsigned int) _mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)));
+#else
+  v128_t v = wasm_v128_load(c);
+  return wasm_i8x16_bitmask(wasm_i8x16_lt(v, wasm_i8x16_splat(0x20)));
+#endif
+}
+#endif
+
+// Whether byte b ends sixel data.
+static inline int is_terminator(unsigned char b, int c1) {
+  return b == ESC || b == CAN || b == SUB || (c1 && (b & 0xE0) == 0x80);
+}
+
+// Position of the next sequence introducer in [c, end), or end.
+static inline const char *find_introducer(const char *c, const char *end, int c1) {
+#ifdef SCAN_WIDTH
+  for (; c + SCAN_WIDTH <= end; c += SCAN_WIDTH) {
+    unsigned int mask = mask_introducer(c, c1);
+    if (mask) return c + __builtin_ctz(mask);
+  }
+#endif
+  for (; c < end; ++c) {
+    if (*c == ESC || (c1 && (unsigned char) *c == DCS)) break;
+  }
+  return c;
+}
+
+// Position of the next byte ending sixel data in [c, end), or end.
+// The SIMD loop only spots candidates, C0 (e.g. LF) and GR bytes within the data are skipped here.
+static inline const char *find_terminator(const char *c, const char *end, int c1) {
+#ifdef SCAN_WIDTH
+  for (; c + SCAN_WIDTH <= end; c += SCAN_WIDTH) {
+    unsigned int mask = mask_control(c);
+    while (mask) {
+      const char *p = c + __builtin_ctz(mask);
+      if (is_terminator(*p, c1)) return p;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; c < end; ++c) {
+    if (is_terminator(*c, c1)) break;
+  }
+  return c;
+}
+
+
+/**
+ * Sequence handling.
+ */
+
+static inline int passthrough(StreamState *ss, const char *data, int length) {
+  return ss->passthrough ? ss->passthrough(ss->user_data, data, length) : 0;
+}
+
+// Pass held back introducer bytes through (not a SIXEL sequence).
+static inline int flush_pending(StreamState *ss) {
+  int length = ss->pending_length;
+  ss->pending_length = 0;
+  ss->state = SS_GROUND;
+  return length ? passthrough(ss, ss->pending, length) : 0;
+}
+
+static inline void enter_sequence(StreamState *ss, char c, int state) {
+  ss->pending[0] = c;
+  ss->pending_length = 1;
+  ss->state = state;
+  ss->params[0] = 0;
+  ss->p_length = 1;
+}
+
+static void start_sixel(StreamState *ss) {
+  for (int i = ss->p_length; i < STREAM_PARAM_SIZE; ++i) ss->params[i] = 0;
+  ss->transparent = ss->params[1] == 1;
+  ss->pending_length = 0;
+  ss->state = SS_SIXEL;
+  decoder_init(ss->ps, ss->sixel_color, ss->transparent ? 0 : ss->fill_color,
+               ss->palette_length, ss->truncate, ss->format);
+  ss->skip = ss->sixel ? ss->sixel(ss->user_data, STREAM_SIXEL_START) : 0;
+}
+
+static inline int end_sixel(StreamState *ss, int event) {
+  ss->state = SS_GROUND;
+  return ss->sixel ? ss->sixel(ss->user_data, event) : 0;
+}
+
+
+/**
+ * Native API.
+ */
+
+void stream_init(StreamState *ss, ParserState *ps, int c1) {
+  ss->ps = ps;
+  ss->c1 = c1;
+  ss->state = SS_GROUND;
+  ss->skip = 0;
+  ss->p_length = 0;
+  ss->transparent = 0;
+  ss->pending_length = 0;
+  ss->passthrough = 0;
+  ss->sixel = 0;
+  ss->user_data = 0;
+  stream_set_image(ss, (int) 0xFFFFFFFF, (int) 0xFF000000, 256, 0, 0);
+}
+
+void stream_set_callbacks(StreamState *ss, passthrough_handler passthrough, sixel_handler sixel, void *user_data) {
+  ss->passthrough = passthrough;
+  ss->sixel = sixel;
+  ss->user_data = user_data;
+}
+
+void stream_set_image(StreamState *ss, int sixel_color, int fill_color, unsigned int palette_length,
+                      int truncate, int format) {
+  ss->sixel_color = sixel_color;
+  ss->fill_color = fill_color;
+  ss->palette_length = palette_length;
+  ss->truncate = truncate;
+  ss->format = format;
+}
+
+// Process data[0 .. length] (exclusive), returns the bytes consumed.
+// Bytes, that need a look at the next byte (ESC, introducer parameters), are held in the state,
+// thus sequences may be split at any position.
+int stream_feed(StreamState *ss, const char *data, int length) {
+  const char *c = data;
+  const char *end = data + length;
+  while (c < end) {
+    switch (ss->state) {
+      case SS_GROUND: {
+        const char *s = find_introducer(c, end, ss->c1);
+        if (s > c && passthrough(ss, c, s - c)) return s - data;
+        c = s;
+        if (c < end) {
+          enter_sequence(ss, *c, *c == ESC ? SS_ESC : SS_DCS);
+          ++c;
+        }
+        break;
+      }
+      case SS_ESC:
+        if (*c == 'P') {
+          ss->pending[ss->pending_length++] = *c++;
+          ss->state = SS_DCS;
+        } else if (flush_pending(ss)) {
+          return c - data;
+        }
+        // other bytes are processed again in ground
+        break;
+      case SS_DCS: {
+        unsigned char b = *c;
+        if (b == 'q') {
+          ++c;
+          start_sixel(ss);
+        } else if ((unsigned(b - '0') < 10 || b == ';') && ss->pending_length < STREAM_PENDING_SIZE) {
+          ss->pending[ss->pending_length++] = *c++;
+          if (b == ';') {
+            if (ss->p_length < STREAM_PARAM_SIZE) ss->params[ss->p_length] = 0;
+            ss->p_length++;
+          } else if (ss->p_length <= STREAM_PARAM_SIZE) {
+            int *p = &ss->params[ss->p_length - 1];
+            *p = *p * 10 + b - '0';
+            if (*p > PARAM_MAX) *p = PARAM_MAX;
+          }
+        } else if (flush_pending(ss)) {
+          // other DCS sequence (intermediates, other final), introducer too long or cancelled
+          return c - data;
+        }
+        break;
+      }
+      case SS_SIXEL: {
+        const char *s = find_terminator(c, end, ss->c1);
+        if (s > c && !ss->skip) decoder_decode_buffer(ss->ps, c, s - c);
+        c = s;
+        if (c < end) {
+          unsigned char b = *c;
+          if (b == ESC) {
+            ++c;
+            ss->state = SS_SIXEL_ESC;
+          } else if (b == ST || b == CAN || b == SUB) {
+            ++c;
+            if (end_sixel(ss, b == ST ? STREAM_SIXEL_END : STREAM_SIXEL_ABORT)) return c - data;
+          } else if (end_sixel(ss, STREAM_SIXEL_ABORT)) {
+            // other C1, processed again in ground
+            return c - data;
+          }
+        }
+        break;
+      }
+      case SS_SIXEL_ESC:
+        if (*c == '\\') {
+          ++c;
+          if (end_sixel(ss, STREAM_SIXEL_END)) return c - data;
+        } else {
+          // ESC starts the next sequence
+          int pause = end_sixel(ss, STREAM_SIXEL_ABORT);
+          enter_sequence(ss, ESC, SS_ESC);
+          if (pause) return c - data;
+        }
+        break;
+    }
+  }
+  return length;
+}
@@ -0,0 +1,102 @@
+/**
+ * SixelStream - DCS front end for the SIXEL band decoder (native interface).
+ *
+ * Copyright (c) 2021 Joerg Breitbart.
+ * @license MIT
+ */
+
+#ifndef SIXEL_STREAM_H
+#define SIXEL_STREAM_H
+
+#include "decoder.h"
+
+// max. bytes of a sequence introducer held back (ESC P or DCS + parameters),
+// longer introducers are no sane SIXEL sequences and get passed through
+#define STREAM_PENDING_SIZE 32
+
+// DCS parameters kept (P1 .. P3, more are parsed and ignored)
+#define STREAM_PARAM_SIZE 3
+
+// events of `sixel_handler`
+#define STREAM_SIXEL_START 0
+#define STREAM_SIXEL_END 1
+#define STREAM_SIXEL_ABORT 2
+
+
+/**
+ * Callbacks into the embedding code.
+ * `passthrough_handler` gets all bytes, that are not part of a SIXEL sequence.
+ * `sixel_handler` gets called for the start (after `decoder_init`) and the end of a SIXEL sequence.
+ * Return 0 to continue, 1 to pause `stream_feed` (for STREAM_SIXEL_START: 1 to skip the image).
+ */
+typedef int (*passthrough_handler)(void *user_data, const char *data, int length);
+typedef int (*sixel_handler)(void *user_data, int event);
+
+
+/**
+ * State of a stream front end, drives the decoder of `ps`.
+ */
+typedef struct StreamState {
+  ParserState *ps;
+  int c1;     // also recognize 8-bit DCS (0x90) and ST (0x9C), 0 for UTF-8 streams
+  int state;
+  int skip;   // sixel data of the current sequence is not decoded
+
+  // DCS parameters of the current sequence
+  int params[STREAM_PARAM_SIZE];
+  int p_length;
+  int transparent;  // P2 = 1, unset pixels keep fill color 0
+
+  // held back introducer bytes (passed through if not a SIXEL sequence)
+  char pending[STREAM_PENDING_SIZE];
+  int pending_length;
+
+  // decoder_init arguments for every image (fill_color is replaced by 0 for P2 = 1)
+  int sixel_color;
+  int fill_color;
+  unsigned int palette_length;
+  int truncate;
+  int format;
+
+  // embedder callbacks
+  passthrough_handler passthrough;
+  sixel_handler sixel;
+  void *user_data;
+} StreamState;
+
+
+/**
+ * Native API.
+ *
+ * The front end takes raw terminal output (e.g. read from a PTY), splits off SIXEL sequences
+ * (`ESC P P1;P2;P3 q ... ESC \`) and decodes their data in place with `decoder_decode_buffer`,
+ * all other bytes go unchanged to `passthrough_handler` (including other DCS sequences).
+ * Sequence borders are searched with SIMD, if the target supports it.
+ *
+ * Usage pattern:
+ *  - set up a decoder state (`decoder_set_callbacks`, `decoder_set_max_width`)
+ *  - call `stream_init` with the decoder state, register callbacks with `stream_set_callbacks`
+ *  - optionally change the image defaults with `stream_set_image` (white sixels, black fill, 256 colors, M1, RGBA8888)
+ *  - feed data chunks with `stream_feed`
+ *
+ * `stream_feed` returns the bytes consumed, which is `length` unless a handler paused it
+ * (call again with the rest). With STREAM_SIXEL_END the image is complete and can be taken
+ * from the decoder, STREAM_SIXEL_ABORT is reported for sequences cancelled by CAN, SUB,
+ * ESC (other than ST) or C1, the decoder holds the image data up to that point.
+ * CAN and SUB cancelling a SIXEL sequence are consumed, other cancelling bytes start the next sequence.
+ *
+ * A held back introducer belongs to the next `stream_feed` call, a trailing ESC is not passed through
+ * until the next byte is known.
+ *
+ * The pixel aspect ratio is not applied, neither from P1 (kept in `params[0]`) nor from the raster
+ * attributes (`ps->r_num`, `ps->r_denom`), the image has one pixel per sixel bit.
+ */
+extern "C" {
+  void stream_init(StreamState *ss, ParserState *ps, int c1);
+  void stream_set_callbacks(StreamState *ss, passthrough_handler passthrough, sixel_handler sixel, void *user_data);
+  void stream_set_image(StreamState *ss, int sixel_color, int fill_color, unsigned int palette_length,
+                        int truncate, int format);
+  int stream_feed(StreamState *ss, const char *data, int length);
+}
+
+#endif  // SIXEL_STREAM_H
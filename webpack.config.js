@@ -138,8 +138,35 @@ const encode_umd = {
   mode: 'production'
 };
 
+// worker script of DecoderPool (nodejs uses lib/DecoderWorker.js)
+const decode_worker = {
+  entry: `./lib-esm/DecoderWorker.js`,
+  devtool: 'source-map',
+  module: {
+    rules: [
+      {
+        test: /\.js$/,
+        use: ["source-map-loader"],
+        enforce: "pre",
+        exclude: /node_modules/
+      }
+    ]
+  },
+  resolve: {
+    fallback: {
+      worker_threads: false
+    }
+  },
+  output: {
+    filename: 'decode.worker.js',
+    path: path.resolve(__dirname, 'dist')
+  },
+  mode: 'production'
+};
+
 module.exports = [
   full_esm, full_umd,
   decode_esm, decode_umd,
-  encode_esm, encode_umd
+  encode_esm, encode_umd,
+  decode_worker
 ];